@@ -1,2 +1,3 @@
 require 'mkmf'
+have_library('m', 'log2')
 create_makefile('Erope')
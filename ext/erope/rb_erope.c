@@ -1,41 +1,41 @@
-#include "../rope/rope.h"
-#include "../rope/utils.h"
+#include <math.h>
 #include <ruby.h>
+#include <stdbool.h>
+
+/*
+ * ERope (Elastic Rope) holds either a flat String or a Rope, and switches
+ * between them by the mix of operations it has seen recently.
+ *
+ * Every tuning.window operations, the cost of the recent mix is estimated
+ * for both representations, in units of bytes copied, and the other
+ * representation is taken if it is cheaper by tuning.hysteresis including
+ * the cost of the conversion itself.
+ */
 
 typedef struct erope_tag {
+	VALUE v; /* String or Rope */
 	bool is_rope;
-	union {
-		VALUE string;
-		VALUE rope;
-	} v;
-} *Erope;
-
-static Erope
-alloc_erope(VALUE str)
-{
-	Erope erpoe = palloc(sizeof(*erope));
-	erope->is_rope = false;
-	erope->v.string = str;
-
-	return erope;
-}
+	long n_ops; /* since the last evaluation */
+	/* recent operation mix, halved on each evaluation */
+	double plus, appends, append_bytes, indexes, slices, slice_bytes, flattens;
+	long n_switches;
+} *ERope;
 
-static void
-free_erope(Erope erope)
-{
-	pfree(erope);
-}
+static struct {
+	long window;       /* operations between evaluations */
+	long min_rope_len; /* shorter contents always stay flat */
+	double node_cost;  /* cost of making a rope node */
+	double level_cost; /* cost of descending one level of a rope */
+	double leaf_len;   /* expected length of rope leaves */
+	double hysteresis; /* switch if cheaper than this ratio */
+} tuning = {32, 1024, 64.0, 4.0, 64.0, 0.5};
 
-static VALUE rb_cErope;
+static VALUE rb_cERope, rb_cRope;
+static ID id_plus, id_append, id_aref, id_length, id_to_s, id_eql;
 
 static void
 erope_dmark(void *erope) {
-	rb_gc_mark(((Erope) erope)->v);
-}
-
-static void
-erope_dfree(void *erope) {
-	free_erope(erope);
+	rb_gc_mark(((ERope) erope)->v);
 }
 
 static size_t
@@ -45,67 +45,356 @@ erope_dsize(const void *erope) {
 }
 
 const rb_data_type_t erope_type = {
-    "cerope", {erope_dmark, erope_dfree, erope_dsize, 0}, 0, 0, 0};
+    "cerope", {erope_dmark, RUBY_TYPED_DEFAULT_FREE, erope_dsize, 0}, 0, 0, 0};
 
 #define value2erope(erope, value) \
 	TypedData_Get_Struct((value), struct erope_tag, &erope_type, (erope))
-#define erope2value(erope) TypedData_Wrap_Struct(rb_ceRope, &erope_type, (erope))
-#define value2erope_checked(value) \
-	((eRope) rb_check_typeddata((value), &erope_type))
 
 static VALUE
 erope_alloc(VALUE klass) {
-	(void) klass;
+	ERope erope;
+
+	return TypedData_Make_Struct(klass, struct erope_tag, &erope_type, erope);
+}
+
+static long
+erope_len(ERope erope) {
+	if (!erope->is_rope)
+		return RSTRING_LEN(erope->v);
+
+	return NUM2LONG(rb_funcall(erope->v, id_length, 0));
+}
+
+static VALUE
+to_rope(VALUE v) {
+	return RTEST(rb_obj_is_kind_of(v, rb_cRope))
+	           ? v
+	           : rb_class_new_instance(1, &v, rb_cRope);
+}
+
+static VALUE
+to_str(VALUE v) {
+	return RTEST(rb_obj_is_kind_of(v, rb_cRope)) ? rb_funcall(v, id_to_s, 0) : v;
+}
+
+/* a Rope object of its own, sharing the rope of rope, for << to change */
+static VALUE
+rope_dup(VALUE rope) {
+	VALUE dup = rb_funcall(rope, id_aref, 2, INT2FIX(0),
+	                       rb_funcall(rope, id_length, 0));
+
+	/* Rope#[] of an empty rope is nil */
+	return NIL_P(dup) ? to_rope(rb_str_new(0, 0)) : dup;
+}
+
+/* bytes of a String or Rope operand */
+static long
+value_len(VALUE v) {
+	return RB_TYPE_P(v, T_STRING) ? RSTRING_LEN(v)
+	                              : NUM2LONG(rb_funcall(v, id_length, 0));
+}
+
+static void
+erope_switch(ERope erope, bool to_rope_p) {
+	if (to_rope_p)
+		erope->v = to_rope(erope->v);
+	else {
+		VALUE str = to_str(erope->v);
+
+		if (NIL_P(str)) /* too large for Rope#to_s */
+			return;
+		erope->v = rb_str_dup(str);
+	}
+
+	erope->is_rope = to_rope_p;
+	erope->n_switches++;
+}
+
+static void
+erope_evaluate(ERope erope) {
+	double len = erope_len(erope),
+	       depth = len > tuning.leaf_len ? log2(len / tuning.leaf_len) + 1 : 1,
+	       flat, rope;
+
+	flat = erope->plus * len + erope->append_bytes + erope->indexes +
+	       erope->slice_bytes;
+	rope = (erope->plus + erope->appends) * tuning.node_cost +
+	       erope->indexes * depth * tuning.level_cost +
+	       erope->slices * (tuning.node_cost + depth * tuning.level_cost) +
+	       erope->flattens * len;
+
+	if (len < tuning.min_rope_len) {
+		if (erope->is_rope)
+			erope_switch(erope, false);
+	} else if (erope->is_rope && flat + len < rope * tuning.hysteresis)
+		erope_switch(erope, false);
+	else if (!erope->is_rope && rope + len < flat * tuning.hysteresis)
+		erope_switch(erope, true);
+
+	erope->n_ops = 0;
+	erope->plus /= 2;
+	erope->appends /= 2;
+	erope->append_bytes /= 2;
+	erope->indexes /= 2;
+	erope->slices /= 2;
+	erope->slice_bytes /= 2;
+	erope->flattens /= 2;
+}
+
+static void
+erope_count_op(ERope erope) {
+	if (++erope->n_ops >= tuning.window)
+		erope_evaluate(erope);
+}
+
+/* a new ERope holding v, which inherits the operation mix of erope */
+static VALUE
+erope_derive(ERope erope, VALUE v) {
+	ERope derived;
+	VALUE self = TypedData_Make_Struct(rb_cERope, struct erope_tag, &erope_type,
+	                                   derived);
+
+	*derived = *erope;
+	derived->v = v;
+	derived->is_rope = RTEST(rb_obj_is_kind_of(v, rb_cRope));
+	derived->n_switches = 0;
+
+	return self;
+}
+
+static VALUE
+erope_other_value(VALUE other) {
+	if (rb_typeddata_is_kind_of(other, &erope_type)) {
+		ERope erope;
+
+		value2erope(erope, other);
+		return erope->v;
+	}
+
+	if (!RTEST(rb_obj_is_kind_of(other, rb_cRope)))
+		StringValue(other);
+
+	return other;
+}
+
+static VALUE
+erope_init(int argc, VALUE *argv, VALUE self) {
+	ERope erope;
+	VALUE v;
+
+	rb_scan_args(argc, argv, "01", &v);
+	value2erope(erope, self);
+
+	if (NIL_P(v))
+		v = rb_str_new(0, 0);
+	v = erope_other_value(v);
+
+	erope->is_rope = RTEST(rb_obj_is_kind_of(v, rb_cRope));
+	erope->v = erope->is_rope ? rope_dup(v) : rb_str_dup(v);
+
+	return self;
+}
+
+static VALUE
+erope_plus(VALUE self, VALUE other) {
+	ERope erope;
+	VALUE v = erope_other_value(other);
+
+	value2erope(erope, self);
+	erope->plus++;
+	erope_count_op(erope);
+
+	if (erope->is_rope)
+		return erope_derive(erope, rb_funcall(erope->v, id_plus, 1, to_rope(v)));
 
-	return erope2value(0);
+	return erope_derive(erope, rb_str_plus(erope->v, to_str(v)));
 }
 
 static VALUE
-erope_init(VALUE self, VALUE str)
-{
-	Erope erope;
-	Check_Type(str, T_STRING);
+erope_append(VALUE self, VALUE other) {
+	ERope erope;
+	VALUE v = erope_other_value(other);
+
+	value2erope(erope, self);
+	erope->appends++;
+	/* counted in either representation, as the flat cost is estimated in
+	 * both */
+	erope->append_bytes += value_len(v);
 
-	erope = alloc_erope(str);
+	if (erope->is_rope)
+		rb_funcall(erope->v, id_append, 1, v);
+	else
+		rb_str_append(erope->v, to_str(v));
 
-	DATA_PTR(self) = erope;
+	erope_count_op(erope);
 
 	return self;
 }
 
 static VALUE
-erope_concat(VALUE self, VALUE other)
-{
-	Erope my_erope, other_erope;
+erope_slice(int argc, VALUE *argv, VALUE self) {
+	ERope erope;
+	VALUE rv;
 
+	rb_check_arity(argc, 1, 2);
 	value2erope(erope, self);
-	other_erope = value2erope_checked(other);
 
-	if (!other_erope->is_rope)
-		other_erope->v = 
+	if (argc == 1)
+		erope->indexes++;
+	else {
+		erope->slices++;
+		erope->slice_bytes += NUM2LONG(argv[1]) > 0 ? NUM2LONG(argv[1]) : 0;
+	}
 
-	/* concat and return */
+	rv = rb_funcallv(erope->v, id_aref, argc, argv);
+	erope_count_op(erope);
+
+	/* a slice stays in the representation it was taken from */
+	return argc == 1 || NIL_P(rv) ? rv : erope_derive(erope, rv);
+}
+
+static VALUE
+erope_to_s(VALUE self) {
+	ERope erope;
+	VALUE rv;
+
+	value2erope(erope, self);
+
+	if (erope->is_rope) {
+		erope->flattens++;
+		rv = rb_funcall(erope->v, id_to_s, 0);
+	} else
+		rv = rb_str_dup(erope->v);
+
+	erope_count_op(erope);
+
+	return rv;
+}
+
+static VALUE
+erope_length(VALUE self) {
+	ERope erope;
+
+	value2erope(erope, self);
+
+	return LONG2NUM(erope_len(erope));
+}
+
+/* compared by Rope#eql? if either side is a Rope, so that it is not
+ * flattened, which would count as a to_s in the operation mix */
+static VALUE
+erope_equal(VALUE self, VALUE other) {
+	ERope erope;
+	VALUE v = erope_other_value(other);
+
+	value2erope(erope, self);
+
+	if (value_len(erope->v) != value_len(v))
+		return Qfalse;
+	if (!erope->is_rope && RB_TYPE_P(v, T_STRING))
+		return rb_str_equal(erope->v, v);
+
+	return rb_funcall(to_rope(erope->v), id_eql, 1, to_rope(v));
+}
+
+static VALUE
+erope_is_rope(VALUE self) {
+	ERope erope;
+
+	value2erope(erope, self);
+
+	return erope->is_rope ? Qtrue : Qfalse;
+}
+
+static VALUE
+erope_profile(VALUE self) {
+	ERope erope;
+	VALUE hash = rb_hash_new();
+
+	value2erope(erope, self);
+
+	rb_hash_aset(hash, ID2SYM(rb_intern("rope")), erope->is_rope ? Qtrue : Qfalse);
+	rb_hash_aset(hash, ID2SYM(rb_intern("switches")), LONG2NUM(erope->n_switches));
+	rb_hash_aset(hash, ID2SYM(rb_intern("plus")), DBL2NUM(erope->plus));
+	rb_hash_aset(hash, ID2SYM(rb_intern("appends")), DBL2NUM(erope->appends));
+	rb_hash_aset(hash, ID2SYM(rb_intern("indexes")), DBL2NUM(erope->indexes));
+	rb_hash_aset(hash, ID2SYM(rb_intern("slices")), DBL2NUM(erope->slices));
+	rb_hash_aset(hash, ID2SYM(rb_intern("flattens")), DBL2NUM(erope->flattens));
+
+	return hash;
+}
+
+static VALUE
+erope_s_tuning(VALUE klass) {
+	VALUE hash = rb_hash_new();
+
+	(void) klass;
+
+	rb_hash_aset(hash, ID2SYM(rb_intern("window")), LONG2NUM(tuning.window));
+	rb_hash_aset(hash, ID2SYM(rb_intern("min_rope_len")),
+	             LONG2NUM(tuning.min_rope_len));
+	rb_hash_aset(hash, ID2SYM(rb_intern("node_cost")), DBL2NUM(tuning.node_cost));
+	rb_hash_aset(hash, ID2SYM(rb_intern("level_cost")),
+	             DBL2NUM(tuning.level_cost));
+	rb_hash_aset(hash, ID2SYM(rb_intern("leaf_len")), DBL2NUM(tuning.leaf_len));
+	rb_hash_aset(hash, ID2SYM(rb_intern("hysteresis")),
+	             DBL2NUM(tuning.hysteresis));
+
+	return hash;
+}
+
+static VALUE
+erope_s_set_tuning(VALUE klass, VALUE hash) {
+	VALUE v;
+
+	Check_Type(hash, T_HASH);
+
+#define SET_TUNING(name, conv)                                              \
+	if (!NIL_P(v = rb_hash_lookup(hash, ID2SYM(rb_intern(#name))))) \
+		tuning.name = conv(v);
+
+	SET_TUNING(window, NUM2LONG);
+	SET_TUNING(min_rope_len, NUM2LONG);
+	SET_TUNING(node_cost, NUM2DBL);
+	SET_TUNING(level_cost, NUM2DBL);
+	SET_TUNING(leaf_len, NUM2DBL);
+	SET_TUNING(hysteresis, NUM2DBL);
+#undef SET_TUNING
+
+	if (tuning.window < 1)
+		tuning.window = 1;
+
+	return erope_s_tuning(klass);
 }
 
 void
 Init_Erope(void) {
-#undef rb_intern
-#define rb_inetrn(erope) rb_intern_const(erope)
-	rb_cRope = rb_define_class("Erope", rb_cData);
-
-	rb_define_alloc_func(rb_cErope, erope_alloc);
-	rb_define_private_method(rb_cErope, "initialize", erope_init, 1);
-	rb_define_method(rb_cRope, "eql?", rope_equal_as_string, 1);
-	rb_define_method(rb_cRope, "+", rope_concat, 1);
-	rb_define_method(rb_cRope, "concat", rope_concat, 1);
-	rb_define_method(rb_cRope, "length", rope_len, 0);
-	rb_define_method(rb_cRope, "size", rope_len, 0);
-	rb_define_method(rb_cRope, "[]", rope_slice, -1);
-	rb_define_method(rb_cRope, "delete_at", rope_delete, -1);
-	rb_define_method(rb_cRope, "slice", rope_slice, -1);
-	rb_define_method(rb_cRope, "at", rope_at, 1);
-	rb_define_method(rb_cRope, "to_s", rope_to_s, 0);
-	rb_define_method(rb_cRope, "to_str", rope_to_s, 0);
-	rb_define_method(rb_cRope, "inspect", rope_dump, 0);
-	rb_define_method(rb_cRope, "dump", rope_dump, 0);
+	rb_require("Rope");
+	rb_cRope = rb_path2class("Rope");
+
+	id_plus = rb_intern("+");
+	id_append = rb_intern("<<");
+	id_aref = rb_intern("[]");
+	id_length = rb_intern("length");
+	id_to_s = rb_intern("to_s");
+	id_eql = rb_intern("eql?");
+
+	rb_cERope = rb_define_class("ERope", rb_cObject);
+
+	rb_define_alloc_func(rb_cERope, erope_alloc);
+	rb_define_private_method(rb_cERope, "initialize", erope_init, -1);
+	rb_define_method(rb_cERope, "==", erope_equal, 1);
+	rb_define_method(rb_cERope, "+", erope_plus, 1);
+	rb_define_method(rb_cERope, "<<", erope_append, 1);
+	rb_define_method(rb_cERope, "concat", erope_append, 1);
+	rb_define_method(rb_cERope, "length", erope_length, 0);
+	rb_define_method(rb_cERope, "size", erope_length, 0);
+	rb_define_method(rb_cERope, "[]", erope_slice, -1);
+	rb_define_method(rb_cERope, "slice", erope_slice, -1);
+	rb_define_method(rb_cERope, "to_s", erope_to_s, 0);
+	rb_define_method(rb_cERope, "to_str", erope_to_s, 0);
+	rb_define_method(rb_cERope, "rope?", erope_is_rope, 0);
+	rb_define_method(rb_cERope, "profile", erope_profile, 0);
+	rb_define_singleton_method(rb_cERope, "tuning", erope_s_tuning, 0);
+	rb_define_singleton_method(rb_cERope, "tuning=", erope_s_set_tuning, 1);
 }
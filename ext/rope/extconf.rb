@@ -1,2 +1,4 @@
 require 'mkmf'
+# ruby extconf.rb --enable-instrument
+$CFLAGS << ' -DROPE_INSTRUMENT' if enable_config('instrument', false)
 create_makefile('Rope')
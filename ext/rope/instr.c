@@ -0,0 +1,86 @@
+#include "instr.h"
+
+#include <string.h>
+
+static const char *op_names[ROPE_N_OPS] = {
+    "create", "concat", "substr", "delete", "index", "to_string", "append",
+    "index_many", "splice", "find_all", "find",
+};
+
+const char *
+RopeInstrOpName(RopeOp op) {
+	return op_names[op];
+}
+
+#ifdef ROPE_INSTRUMENT_ALLOC
+
+struct instr_counters instr_counters;
+
+#ifdef ROPE_INSTRUMENT
+void
+instr_op_end(RopeOp op, const struct timespec *start) {
+	struct timespec end;
+	unsigned long long ns;
+	int bucket = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ns = (end.tv_sec - start->tv_sec) * 1000000000ull + end.tv_nsec -
+	     start->tv_nsec;
+
+	for (; ns > 1 && bucket < ROPE_INSTR_HIST_SIZE - 1; ns >>= 1)
+		bucket++;
+
+	INSTR_ADD(latency_hist[op][bucket], 1);
+}
+#endif
+
+#define LOAD(field) atomic_load_explicit(&(field), memory_order_relaxed)
+#define CLEAR(field) atomic_store_explicit(&(field), 0, memory_order_relaxed)
+
+bool
+RopeInstrSnapshot(RopeInstrStats *stats) {
+	stats->n_alloc = LOAD(instr_counters.n_alloc);
+	stats->n_free = LOAD(instr_counters.n_free);
+	stats->alloc_bytes = LOAD(instr_counters.alloc_bytes);
+	stats->index_nodes_visited = LOAD(instr_counters.index_nodes_visited);
+	stats->create_bytes = LOAD(instr_counters.create_bytes);
+	stats->to_string_bytes = LOAD(instr_counters.to_string_bytes);
+
+	for (int op = 0; op < ROPE_N_OPS; op++) {
+		stats->n_calls[op] = LOAD(instr_counters.n_calls[op]);
+		for (int i = 0; i < ROPE_INSTR_HIST_SIZE; i++)
+			stats->latency_hist[op][i] = LOAD(instr_counters.latency_hist[op][i]);
+	}
+
+	return true;
+}
+
+void
+RopeInstrReset(void) {
+	CLEAR(instr_counters.n_alloc);
+	CLEAR(instr_counters.n_free);
+	CLEAR(instr_counters.alloc_bytes);
+	CLEAR(instr_counters.index_nodes_visited);
+	CLEAR(instr_counters.create_bytes);
+	CLEAR(instr_counters.to_string_bytes);
+
+	for (int op = 0; op < ROPE_N_OPS; op++) {
+		CLEAR(instr_counters.n_calls[op]);
+		for (int i = 0; i < ROPE_INSTR_HIST_SIZE; i++)
+			CLEAR(instr_counters.latency_hist[op][i]);
+	}
+}
+
+#else
+
+bool
+RopeInstrSnapshot(RopeInstrStats *stats) {
+	memset(stats, 0, sizeof(*stats));
+	return false;
+}
+
+void
+RopeInstrReset(void) {
+}
+
+#endif
@@ -0,0 +1,57 @@
+#pragma once
+
+/*
+ * Hot path instrumentation, compiled in only with -DROPE_INSTRUMENT.
+ * -DROPE_INSTRUMENT_ALLOC alone enables just the allocation counters, which
+ * are cheap enough to keep on while timing (see src/bench.c).
+ * Without them every macro expands to nothing.
+ */
+
+#include "rope.h"
+
+#if defined(ROPE_INSTRUMENT) && !defined(ROPE_INSTRUMENT_ALLOC)
+#define ROPE_INSTRUMENT_ALLOC
+#endif
+
+#ifdef ROPE_INSTRUMENT_ALLOC
+
+#include <stdatomic.h>
+#include <time.h>
+
+struct instr_counters {
+	atomic_size_t n_alloc, n_free, alloc_bytes;
+	atomic_size_t n_calls[ROPE_N_OPS];
+	atomic_size_t index_nodes_visited;
+	atomic_size_t create_bytes, to_string_bytes;
+	atomic_size_t latency_hist[ROPE_N_OPS][ROPE_INSTR_HIST_SIZE];
+};
+
+extern struct instr_counters instr_counters;
+
+void instr_op_end(RopeOp op, const struct timespec *start);
+
+#define INSTR_ALLOC_ADD(field, n) \
+	atomic_fetch_add_explicit(&instr_counters.field, (n), memory_order_relaxed)
+
+#else
+
+#define INSTR_ALLOC_ADD(field, n) ((void) 0)
+
+#endif
+
+#ifdef ROPE_INSTRUMENT
+
+#define INSTR_ADD(field, n) INSTR_ALLOC_ADD(field, n)
+#define INSTR_OP_BEGIN(op)               \
+	struct timespec instr_start;         \
+	INSTR_ADD(n_calls[(op)], 1);         \
+	clock_gettime(CLOCK_MONOTONIC, &instr_start)
+#define INSTR_OP_END(op) instr_op_end((op), &instr_start)
+
+#else
+
+#define INSTR_ADD(field, n) ((void) 0)
+#define INSTR_OP_BEGIN(op) ((void) 0)
+#define INSTR_OP_END(op) ((void) 0)
+
+#endif
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stddef.h>
+
+/* worst case size of LzCompress output for len bytes of input */
+#define LZ_COMPRESS_BOUND(len) ((len) + (len) / 255 + 16)
+
+/* return the size of compressed data, or 0 if dst_size is not sufficient */
+size_t LzCompress(const char *src, size_t len, char *dst, size_t dst_size);
+/* return the size of decompressed data, or 0 if src is broken or dst_size is
+ * not sufficient */
+size_t LzDecompress(const char *src, size_t len, char *dst, size_t dst_size);
@@ -1,40 +1,459 @@
 #include "rope.h"
+#include "trace.h"
 #include "utils.h"
 
+#include <errno.h>
 #include <ruby.h>
+#include <ruby/io.h>
+#include <ruby/thread.h>
+#include <ruby/util.h>
+#include <ruby/st.h>
 
 static VALUE rb_cRope;
 #define MAX_STR_SIZE 1024*1024
+/* Strings at least this long are borrowed (frozen) instead of copied */
+#define EXTERNAL_MIN_LEN 128
+/* nodes freed when a Rope is collected; the rest of a large rope is left
+ * for later collections or Rope.reclaim, so GC does not pause on it */
+#define DFREE_RECLAIM_BATCH 1024
+
+/* a Rope object; << and compact! replace its rope, and a rope can be held
+ * by more than one object (r[0, r.length], a no-op compact) */
+struct rope_obj {
+	Rope rope;
+};
+
+static struct rope_obj *value2obj(VALUE v);
+static VALUE rope2value(Rope rope);
+
+/*
+ * Operation trace (Rope.trace_start), replayed by bin/replay.
+ * Rope objects are given trace ids keyed by their struct rope_obj, so that
+ * objects sharing a rope are traced apart; objects made before tracing
+ * started are recorded as created when they are first used.
+ */
+static RopeTrace trace;
+static st_table *trace_ids;
+static uint64_t trace_last_id;
 
 static void
-rope_dmark(void *rope) {
-	(void) rope;
+trace_record(RopeTraceOp op, uint64_t a0, uint64_t a1, uint64_t a2,
+             uint64_t a3) {
+	RopeTraceRecord rec = {op, {a0, a1, a2, a3}};
+
+	RopeTraceWrite(trace, &rec);
+}
+
+static uint64_t
+trace_new_id(struct rope_obj *obj) {
+	st_insert(trace_ids, (st_data_t) obj, (st_data_t) ++trace_last_id);
+
+	return trace_last_id;
 }
 
+static uint64_t
+trace_id(struct rope_obj *obj) {
+	st_data_t id;
+	uint64_t new_id;
+
+	if (st_lookup(trace_ids, (st_data_t) obj, &id))
+		return id;
+
+	new_id = trace_new_id(obj);
+	trace_record(ROPE_TRACE_CREATE, new_id, RopeGetLen(obj->rope), 0, 0);
+
+	return new_id;
+}
+
+/* obj is gone, or holds a rope of another id now */
 static void
-rope_dfree(void *rope) {
-	RopeDestroy(rope);
+trace_free(struct rope_obj *obj) {
+	st_data_t key = (st_data_t) obj, id;
+
+	if (trace && st_delete(trace_ids, &key, &id))
+		trace_record(ROPE_TRACE_FREE, id, 0, 0, 0);
+}
+
+/*
+ * Allocation-site profile (Rope.profile_start)
+ *
+ * Each Rope object is attributed to the Ruby line which made it, and
+ * operations on it are counted at that line; like trace ids, sites are
+ * keyed by the struct rope_obj. Rope.profile estimates for each site what its
+ * operations cost on Ropes and on flat Strings, in bytes copied, with the
+ * node and level costs ERope assumes by default.
+ */
+#define PROFILE_NODE_COST 64.0
+#define PROFILE_LEVEL_COST 4.0
+
+struct profile_site {
+	char *name; /* "file:line" */
+	size_t objects, freed, final_len;
+	size_t concats, concat_bytes, appends, append_bytes;
+	/* of appends to ropes: bytes copied into leaves, nodes made */
+	size_t append_copied, append_nodes;
+	size_t indexes, slices, slice_bytes, levels; /* levels descended */
+	size_t flattens, flatten_bytes;
+	size_t live_len; /* of the ropes not freed, set by Rope.profile */
+};
+
+static st_table *profile_sites; /* name -> struct profile_site */
+static st_table *profile_ropes; /* struct rope_obj -> struct profile_site */
+
+/* the site of obj, which is the current line if it is not known yet */
+static struct profile_site *
+profile_site(struct rope_obj *obj) {
+	struct profile_site *site;
+	st_data_t data;
+	char name[1024];
+	const char *file = rb_sourcefile();
+
+	if (st_lookup(profile_ropes, (st_data_t) obj, &data))
+		return (struct profile_site *) data;
+
+	snprintf(name, sizeof(name), "%s:%d", file ? file : "-", rb_sourceline());
+	if (st_lookup(profile_sites, (st_data_t) name, &data))
+		site = (struct profile_site *) data;
+	else {
+		site = ZALLOC(struct profile_site);
+		site->name = ruby_strdup(name);
+		st_insert(profile_sites, (st_data_t) site->name, (st_data_t) site);
+	}
+	site->objects++;
+	st_insert(profile_ropes, (st_data_t) obj, (st_data_t) site);
+
+	return site;
+}
+
+static void
+profile_free(struct rope_obj *obj) {
+	st_data_t key = (st_data_t) obj, data;
+	struct profile_site *site;
+
+	if (!profile_ropes || !st_delete(profile_ropes, &key, &data))
+		return;
+
+	site = (struct profile_site *) data;
+	site->freed++;
+	site->final_len += obj->rope ? RopeGetLen(obj->rope) : 0;
+}
+
+static void
+profile_costs(const struct profile_site *site, double *flat, double *rope) {
+	*flat = site->concat_bytes + site->append_bytes + site->indexes +
+	        site->slice_bytes;
+	*rope = (site->concats + site->append_nodes + site->slices) *
+	            PROFILE_NODE_COST +
+	        site->append_copied + site->levels * PROFILE_LEVEL_COST +
+	        site->flatten_bytes;
+}
+
+static int
+profile_add_live(st_data_t obj, st_data_t site, st_data_t arg) {
+	Rope rope = ((struct rope_obj *) obj)->rope;
+
+	(void) arg;
+	if (rope)
+		((struct profile_site *) site)->live_len += RopeGetLen(rope);
+
+	return ST_CONTINUE;
+}
+
+static int
+profile_push_site(st_data_t name, st_data_t site, st_data_t arg) {
+	struct profile_site ***sites = (struct profile_site ***) arg;
+
+	(void) name;
+	*(*sites)++ = (struct profile_site *) site;
+
+	return ST_CONTINUE;
+}
+
+static double
+profile_saving(const struct profile_site *site) {
+	double flat, rope;
+
+	profile_costs(site, &flat, &rope);
+
+	return flat > rope ? flat - rope : rope - flat;
+}
+
+/* most to be saved first */
+static int
+profile_cmp(const void *a, const void *b) {
+	double sa = profile_saving(*(struct profile_site *const *) a),
+	       sb = profile_saving(*(struct profile_site *const *) b);
+
+	return sa < sb ? 1 : sa > sb ? -1 : 0;
+}
+
+static VALUE
+profile_site_hash(struct profile_site *site) {
+	VALUE hash = rb_hash_new();
+	double flat, rope, ratio;
+	bool flat_p;
+
+	profile_costs(site, &flat, &rope);
+	flat_p = flat < rope;
+	ratio = flat_p ? rope / (flat > 0 ? flat : 1) : flat / (rope > 0 ? rope : 1);
+
+#define SET(name, v) rb_hash_aset(hash, ID2SYM(rb_intern(name)), (v))
+	SET("site", rb_str_new_cstr(site->name));
+	SET("objects", SIZET2NUM(site->objects));
+	SET("live", SIZET2NUM(site->objects - site->freed));
+	SET("concats", SIZET2NUM(site->concats));
+	SET("appends", SIZET2NUM(site->appends));
+	SET("append_bytes", SIZET2NUM(site->append_bytes));
+	SET("indexes", SIZET2NUM(site->indexes));
+	SET("slices", SIZET2NUM(site->slices));
+	SET("slice_bytes", SIZET2NUM(site->slice_bytes));
+	SET("flattens", SIZET2NUM(site->flattens));
+	SET("mean_len", DBL2NUM((double) (site->final_len + site->live_len) /
+	                        site->objects));
+	SET("string_cost", DBL2NUM(flat));
+	SET("rope_cost", DBL2NUM(rope));
+	SET("recommend", flat == rope ? Qnil
+	                 : ID2SYM(rb_intern(flat_p ? "string" : "rope")));
+	SET("advice", flat == rope ? rb_str_new_cstr("no difference")
+	              : rb_sprintf("%s would be %.1fx cheaper here",
+	                           flat_p ? "flat String" : "Rope", ratio));
+#undef SET
+
+	return hash;
+}
+
+/* an Array of a Hash for each site, most to be saved first */
+static VALUE
+profile_report(void) {
+	struct profile_site **sites, **end;
+	size_t n = profile_sites->num_entries;
+	VALUE report = rb_ary_new_capa(n), buf;
+
+	sites = end = ALLOCV_N(struct profile_site *, buf, n ? n : 1);
+	st_foreach(profile_sites, profile_push_site, (st_data_t) &end);
+	for (size_t k = 0; k < n; k++)
+		sites[k]->live_len = 0;
+	st_foreach(profile_ropes, profile_add_live, 0);
+	qsort(sites, n, sizeof(*sites), profile_cmp);
+	for (size_t k = 0; k < n; k++)
+		rb_ary_push(report, profile_site_hash(sites[k]));
+	ALLOCV_END(buf);
+
+	return report;
+}
+
+static int
+profile_free_site(st_data_t name, st_data_t site, st_data_t arg) {
+	(void) name;
+	(void) arg;
+	xfree(((struct profile_site *) site)->name);
+	xfree((void *) site);
+
+	return ST_DELETE;
+}
+
+/* a Rope of RopeSubstr or RopeDelete of rope, which obj holds (or held, as
+ * an iterator does), recorded if tracing or profiling */
+static VALUE
+traced_substr(RopeTraceOp op, struct rope_obj *obj, Rope rope, size_t i,
+              size_t n) {
+	Rope sub = op == ROPE_TRACE_SUBSTR ? RopeSubstr(rope, i, n)
+	                                   : RopeDelete(rope, i, n);
+	uint64_t src = trace ? trace_id(obj) : 0;
+	VALUE rv;
+
+	if (profile_ropes) {
+		struct profile_site *site = profile_site(obj);
+
+		site->slices++;
+		site->slice_bytes += RopeGetLen(sub);
+		site->levels += RopeGetDepth(rope) + 1;
+	}
+	rv = rope2value(sub);
+	if (trace)
+		trace_record(op, trace_new_id(value2obj(rv)), src, i, n);
+
+	return rv;
+}
+
+static char
+traced_index(struct rope_obj *obj, size_t i) {
+	if (trace)
+		trace_record(ROPE_TRACE_INDEX, trace_id(obj), i, 0, 0);
+	if (profile_ropes) {
+		struct profile_site *site = profile_site(obj);
+
+		site->indexes++;
+		site->levels += RopeGetDepth(obj->rope) + 1;
+	}
+
+	return RopeIndex(obj->rope, i);
+}
+
+static void
+traced_to_s(struct rope_obj *obj) {
+	if (trace)
+		trace_record(ROPE_TRACE_TO_S, trace_id(obj), 0, 0, 0);
+	if (profile_ropes) {
+		struct profile_site *site = profile_site(obj);
+
+		site->flattens++;
+		site->flatten_bytes += RopeGetLen(obj->rope);
+	}
+}
+
+static void
+rope_mark_owner(void *owner, void *arg) {
+	(void) arg;
+	rb_gc_mark((VALUE) owner);
+}
+
+static void
+pin_dmark(void *rope) {
+	if (rope)
+		RopeEachExternal(rope, rope_mark_owner, NULL);
+}
+
+static void
+rope_dmark(void *obj) {
+	pin_dmark(((struct rope_obj *) obj)->rope);
+}
+
+static void
+rope_dfree(void *ptr) {
+	struct rope_obj *obj = ptr;
+
+	trace_free(obj);
+	profile_free(obj);
+
+	if (obj->rope) {
+		RopeDestroyDeferred(obj->rope);
+		RopeReclaim(DFREE_RECLAIM_BATCH);
+	}
+	xfree(obj);
 }
 
+/* the root node alone, as GC.stat and ObjectSpace call this for every object;
+ * stats[:size] counts the whole rope */
 static size_t
-rope_dsize(const void *rope) {
-	return RopeGetSize((Rope) rope);
+rope_dsize(const void *ptr) {
+	const struct rope_obj *obj = ptr;
+
+	return sizeof(*obj) + (obj->rope ? RopeGetNodeSize(obj->rope) : 0);
 }
 
 const rb_data_type_t rope_type = {
     "crope", {rope_dmark, rope_dfree, rope_dsize, 0}, 0, 0, 0};
 
-#define value2rope(rope, value) \
-	TypedData_Get_Struct((value), struct rope_tag, &rope_type, (rope))
-#define rope2value(rope) TypedData_Wrap_Struct(rb_cRope, &rope_type, (rope))
-#define value2rope_checked(value) \
-	((Rope) rb_check_typeddata((value), &rope_type))
+static struct rope_obj *
+value2obj(VALUE v) {
+	return rb_check_typeddata(v, &rope_type);
+}
+
+#define value2rope(r, value) ((r) = value2obj(value)->rope)
+#define value2rope_checked(value) (value2obj(value)->rope)
+
+/* wrapped before it is profiled, so that its owners are marked */
+static VALUE
+rope2value(Rope rope) {
+	struct rope_obj *obj;
+	VALUE self = TypedData_Make_Struct(rb_cRope, struct rope_obj, &rope_type,
+	                                   obj);
+
+	obj->rope = rope;
+	if (profile_ropes && rope)
+		profile_site(obj);
+
+	return self;
+}
+
+/*
+ * Operations reading NOGVL_MIN_LEN bytes or more run without the GVL. The
+ * ropes are pinned by references of their own meanwhile, held by hidden
+ * objects which keep marking their external owners, so that other threads
+ * can neither change them in place (<<) nor free them (compact!, GC).
+ * Nothing done without the GVL changes reference counts.
+ *
+ * These operations cannot be interrupted: they pass no unblocking function,
+ * so Thread#raise, Thread#kill and signals are handled once they return.
+ * Each walks ropes already in memory, without I/O or waiting (unlike
+ * Rope.read, which is interruptible), so the delay is bounded by the size
+ * of the ropes.
+ */
+#define NOGVL_MIN_LEN (256 * 1024)
+
+static void
+pin_dfree(void *rope) {
+	if (rope)
+		RopeDestroy(rope);
+}
+
+static const rb_data_type_t pin_type = {
+    "crope_pin", {pin_dmark, pin_dfree, 0, 0}, 0, 0, 0};
+
+struct nogvl_call {
+	void *(*func)(void *);
+	void *arg;
+	VALUE pins[2];
+};
+
+static VALUE
+nogvl_call_body(VALUE arg) {
+	struct nogvl_call *call = (struct nogvl_call *) arg;
+
+	/* not interruptible, see above */
+	rb_thread_call_without_gvl(call->func, call->arg, NULL, NULL);
+
+	return Qnil;
+}
+
+static VALUE
+nogvl_call_unpin(VALUE arg) {
+	struct nogvl_call *call = (struct nogvl_call *) arg;
+
+	for (int k = 0; k < 2; k++)
+		if (call->pins[k]) {
+			pin_dfree(DATA_PTR(call->pins[k]));
+			DATA_PTR(call->pins[k]) = NULL;
+		}
+
+	return Qnil;
+}
+
+/* call func(arg), which reads a and b (or NULL) */
+static void
+call_nogvl(void *(*func)(void *), void *arg, Rope a, Rope b) {
+	struct nogvl_call call = {func, arg, {0, 0}};
+
+	if (RopeGetLen(a) + (b ? RopeGetLen(b) : 0) < NOGVL_MIN_LEN) {
+		func(arg);
+		return;
+	}
+
+	call.pins[0] = TypedData_Wrap_Struct(0, &pin_type, RopeRef(a));
+	if (b)
+		call.pins[1] = TypedData_Wrap_Struct(0, &pin_type, RopeRef(b));
+	rb_ensure(nogvl_call_body, (VALUE) &call, nogvl_call_unpin, (VALUE) &call);
+	RB_GC_GUARD(call.pins[0]);
+	RB_GC_GUARD(call.pins[1]);
+}
 
 static VALUE
 rope_alloc(VALUE klass) {
 	return rope2value(0);
 }
 
+static Rope
+str2rope(VALUE str) {
+	if (RSTRING_LEN(str) >= EXTERNAL_MIN_LEN) {
+		str = rb_str_new_frozen(str);
+		return RopeCreateExternal(RSTRING_PTR(str), RSTRING_LEN(str),
+		                          (void *) str, NULL);
+	}
+
+	return RopeCreate(RSTRING_PTR(str), RSTRING_LEN(str));
+}
+
 static VALUE
 rope_init(int argc, VALUE *argv, VALUE self) {
 	VALUE str = 0;
@@ -45,82 +464,131 @@ rope_init(int argc, VALUE *argv, VALUE self) {
 	/* XXX: empty rope is valid?*/
 	Check_Type(str, T_STRING);
 
-	rope = RopeCreate(rb_string_value_cstr(&str), RSTRING_LEN(str));
-
-	DATA_PTR(self) = rope;
+	rope = str2rope(str);
+	value2obj(self)->rope = rope;
+	if (trace)
+		trace_record(ROPE_TRACE_CREATE, trace_new_id(value2obj(self)),
+		             RopeGetLen(rope), 0, 0);
+	if (profile_ropes)
+		profile_site(value2obj(self));
 
 	return self;
 }
 
-static int
-get_fixnum_checked(VALUE v) {
-	switch (TYPE(v)) {
-		case T_FIXNUM:
-			break;
-		case T_BIGNUM:
-			elog("rope_at: too lange index specified");
-		default:
-			rb_raise(rb_eTypeError, "%s: invalid type argument", __func__);
-			break;
-	}
+/* an Integer argument as a long; a Bignum out of its range raises
+ * RangeError as String#[] does */
+static long
+get_index(VALUE v) {
+	if (!RB_INTEGER_TYPE_P(v))
+		rb_raise(rb_eTypeError, "%s: invalid type argument", __func__);
 
-	return FIX2INT(v);
+	return NUM2LONG(v);
+}
+
+/* resolve a negative start i against len and clip n to the end, return false
+ * if there is nothing at i */
+static bool
+clip_range(long len, long *i, long *n) {
+	if (*n < 0)
+		return false;
+	if (*i < 0)
+		*i += len;
+	if (*i < 0 || *i >= len)
+		return false;
+	if (*n > len - *i)
+		*n = len - *i;
+
+	return true;
 }
 
 static VALUE
 rope_at(VALUE self, VALUE vi) {
 	Rope rope;
-	int i, len;
-	char c[2];
+	long i = get_index(vi), n = 1;
+	char c;
 
-	i = get_fixnum_checked(vi);
 	value2rope(rope, self);
-	len = (int) RopeGetLen(rope);
 
-	if (len <= i)
+	if (!clip_range((long) RopeGetLen(rope), &i, &n))
 		return Qnil;
 
-	if (i >= 0)
-		c[0] = RopeIndex(rope, i);
-	else {
-		int ri = len + i;
+	c = traced_index(value2obj(self), i);
+	return rb_str_new(&c, 1);
+}
+
+/* bytes at integer indexes and ranges as one byte Strings, nil for indexes
+ * out of range; ranges are truncated as in String#[]. Not traced. */
+static VALUE
+rope_values_at(int argc, VALUE *argv, VALUE self) {
+	Rope rope;
+	long len, n = 0, n_valid = 0, beg, rlen;
+	size_t *positions;
+	long *slots;
+	char *out;
+	VALUE rv, is_range, positions_buf, slots_buf, out_buf;
 
-		if (ri < 0)
-			return Qnil;
+	value2rope(rope, self);
+	len = (long) RopeGetLen(rope);
+
+	for (int k = 0; k < argc; k++) {
+		is_range = FIXNUM_P(argv[k])
+		               ? Qfalse
+		               : rb_range_beg_len(argv[k], &beg, &rlen, len, 0);
+		if (is_range == Qfalse)
+			n++;
+		else if (RTEST(is_range))
+			n += rlen;
+	}
+
+	positions = ALLOCV_N(size_t, positions_buf, n);
+	slots = ALLOCV_N(long, slots_buf, n);
+	out = ALLOCV_N(char, out_buf, n);
+	rv = rb_ary_new_capa(n);
 
-		c[0] = RopeIndex(rope, ri);
+	for (int k = 0, slot = 0; k < argc; k++) {
+		is_range = FIXNUM_P(argv[k])
+		               ? Qfalse
+		               : rb_range_beg_len(argv[k], &beg, &rlen, len, 0);
+		if (is_range != Qfalse) {
+			for (long i = 0; RTEST(is_range) && i < rlen; i++) {
+				positions[n_valid] = beg + i;
+				slots[n_valid++] = slot++;
+			}
+			continue;
+		}
+
+		beg = NUM2LONG(argv[k]);
+		if (beg < 0)
+			beg += len;
+		if (beg >= 0 && beg < len) {
+			positions[n_valid] = beg;
+			slots[n_valid++] = slot;
+		}
+		rb_ary_store(rv, slot++, Qnil);
 	}
 
-	c[1] = '\0';
-	return rb_str_new_cstr(c);
+	RopeIndexMany(rope, positions, n_valid, out);
+	for (long k = 0; k < n_valid; k++)
+		rb_ary_store(rv, slots[k], rb_str_new(out + k, 1));
+
+	ALLOCV_END(positions_buf);
+	ALLOCV_END(slots_buf);
+	ALLOCV_END(out_buf);
+
+	return rv;
 }
 
 static VALUE
 rope_substr(VALUE self, VALUE vi, VALUE vn) {
 	Rope rope;
-	int i = get_fixnum_checked(vi), n = get_fixnum_checked(vn), len;
+	long i = get_index(vi), n = get_index(vn);
 
 	value2rope(rope, self);
-	len = (int) RopeGetLen(rope);
 
-	if (len <= i || n < 0)
+	if (!clip_range((long) RopeGetLen(rope), &i, &n))
 		return Qnil;
 
-	if (i >= 0) {
-		if (i + n > len)
-			n = len - i;
-		return rope2value(RopeSubstr(rope, i, n));
-	} else {
-		int ri = len + i;
-
-		if (ri < 0)
-			return Qnil;
-
-		if (ri + n > len)
-			n = len - ri;
-
-		return rope2value(RopeSubstr(rope, ri, n));
-	}
+	return traced_substr(ROPE_TRACE_SUBSTR, value2obj(self), rope, i, n);
 }
 
 static VALUE
@@ -141,97 +609,1398 @@ rope_len(VALUE self) {
 	Rope r;
 	value2rope(r, self);
 
-	return INT2NUM(RopeGetLen(r));
+	return SIZET2NUM(RopeGetLen(r));
 }
 
 static VALUE
 rope_concat(VALUE self, VALUE other) {
-	Rope r1, r2;
+	struct rope_obj *o1 = value2obj(self), *o2 = value2obj(other);
+	Rope rope = RopeConcat(o1->rope, o2->rope);
+	VALUE rv;
+
+	if (profile_ropes) {
+		struct profile_site *site = profile_site(o1);
 
-	value2rope(r1, self);
-	r2 = value2rope_checked(other);
+		site->concats++;
+		site->concat_bytes += RopeGetLen(rope);
+	}
+	rv = rope2value(rope);
+	if (trace) {
+		uint64_t left = trace_id(o1), right = trace_id(o2);
+
+		trace_record(ROPE_TRACE_CONCAT, trace_new_id(value2obj(rv)), left,
+		             right, 0);
+	}
 
-	return rope2value(RopeConcat(r1, r2));
+	return rv;
 }
 
+/* not traced, the result is recorded as created when it is first used */
 static VALUE
-rope_to_s(VALUE self) {
+rope_times(VALUE self, VALUE vcount) {
+	Rope rope, rv;
+	long count = NUM2LONG(vcount);
+
+	if (count < 0)
+		rb_raise(rb_eArgError, "negative argument");
+
+	value2rope(rope, self);
+	if (!(rv = RopeRepeat(rope, count)))
+		rb_raise(rb_eArgError, "argument too big");
+
+	return rope2value(rv);
+}
+
+/*
+ * Byte transforms, not traced: results are recorded as created when they
+ * are first used.
+ */
+static VALUE
+rope_upcase(VALUE self) {
 	Rope rope;
-	char buf[MAX_STR_SIZE];
 
 	value2rope(rope, self);
 
-	if (RopeToString(rope, buf, MAX_STR_SIZE) < 0) {
-		elog("WARNING(rope_to_s): buf too small");
-		return Qnil;
+	return rope2value(RopeUpcase(rope, 1));
+}
+
+static VALUE
+rope_downcase(VALUE self) {
+	Rope rope;
+
+	value2rope(rope, self);
+
+	return rope2value(RopeDowncase(rope, 1));
+}
+
+/* bytes of a String#tr list such as "a-z", ranges and backslash escapes */
+struct tr_iter {
+	const unsigned char *p, *end;
+	int next, last; /* rest of the current range */
+};
+
+static void
+tr_iter_init(struct tr_iter *it, VALUE list) {
+	it->p = (const unsigned char *) RSTRING_PTR(list);
+	it->end = it->p + RSTRING_LEN(list);
+	it->next = 1;
+	it->last = 0;
+}
+
+/* return -1 at the end */
+static int
+tr_iter_next(struct tr_iter *it) {
+	int c;
+
+	if (it->next <= it->last)
+		return it->next++;
+
+	if (it->p == it->end)
+		return -1;
+
+	if (*it->p == '\\' && it->p + 1 < it->end)
+		it->p++;
+	c = *it->p++;
+
+	if (it->end - it->p >= 2 && *it->p == '-') {
+		if (it->p[1] < c)
+			rb_raise(rb_eArgError,
+			         "invalid range \"%c-%c\" in string transliteration", c,
+			         it->p[1]);
+		it->next = c + 1;
+		it->last = it->p[1];
+		it->p += 2;
 	}
 
-	return rb_str_new(buf, RopeGetLen(rope));
+	return c;
 }
 
 static VALUE
-rope_dump(VALUE self) {
+rope_tr(VALUE self, VALUE from, VALUE to) {
 	Rope rope;
+	unsigned char table[256];
+	bool in_from[256] = {false}, negate;
+	struct tr_iter from_it, to_it;
+	int c, t = -1, last = -1;
+
+	StringValue(from);
+	StringValue(to);
+	if (RSTRING_LEN(to) == 0)
+		rb_raise(rb_eArgError, "deleting characters is not supported");
+
+	negate = RSTRING_LEN(from) > 1 && RSTRING_PTR(from)[0] == '^';
+	tr_iter_init(&from_it, from);
+	if (negate)
+		from_it.p++;
+	tr_iter_init(&to_it, to);
+
+	for (c = 0; c < 256; c++)
+		table[c] = c;
+
+	while ((c = tr_iter_next(&from_it)) >= 0) {
+		in_from[c] = true;
+		/* to is padded with its last byte */
+		if (!negate && (t = tr_iter_next(&to_it)) >= 0)
+			last = t;
+		if (!negate)
+			table[c] = last;
+	}
+
+	if (negate) {
+		while ((t = tr_iter_next(&to_it)) >= 0)
+			last = t;
+		for (c = 0; c < 256; c++)
+			if (!in_from[c])
+				table[c] = last;
+	}
+
 	value2rope(rope, self);
 
-	RopeDump(rope);
+	return rope2value(RopeMapBytes(rope, table, 1));
+}
 
-	return self;
+struct compare_call {
+	Rope a, b;
+	bool suffix;
+	size_t rv;
+	RopeDiffEdit *edits; /* RopeDiff */
+	size_t n_edits, cap;
+};
+
+static void *
+common_nogvl(void *arg) {
+	struct compare_call *call = arg;
+
+	call->rv = call->suffix ? RopeCommonSuffix(call->a, call->b)
+	                        : RopeCommonPrefix(call->a, call->b);
+
+	return NULL;
+}
+
+static size_t
+rope_common(VALUE self, VALUE other, bool suffix) {
+	struct compare_call call = {NULL, NULL, suffix, 0, NULL, 0, 0};
+
+	value2rope(call.a, self);
+	call.b = value2rope_checked(other);
+	call_nogvl(common_nogvl, &call, call.a, call.b);
+
+	return call.rv;
 }
 
 static VALUE
-rope_equal_as_string(VALUE self, VALUE other) {
-	Rope my_rope, other_rope;
-	char my_buf[MAX_STR_SIZE], other_buf[MAX_STR_SIZE];
+rope_common_prefix(VALUE self, VALUE other) {
+	return SIZET2NUM(rope_common(self, other, false));
+}
 
-	value2rope(my_rope, self);
-	other_rope = value2rope_checked(other);
+static VALUE
+rope_common_suffix(VALUE self, VALUE other) {
+	return SIZET2NUM(rope_common(self, other, true));
+}
 
-	if (RopeToString(my_rope, my_buf, MAX_STR_SIZE) < 0) {
-		elog("WARNING(rope_to_s): buf too small");
-		return Qnil;
+static void
+rope_diff_push(const RopeDiffEdit *edit, void *arg) {
+	struct compare_call *call = arg;
+
+	if (call->n_edits == call->cap) {
+		RopeDiffEdit *edits;
+
+		call->cap = call->cap ? call->cap * 2 : 16;
+		edits = palloc(sizeof(*edits) * call->cap);
+		if (call->edits) {
+			memcpy(edits, call->edits, sizeof(*edits) * call->n_edits);
+			pfree(call->edits);
+		}
+		call->edits = edits;
 	}
-	if (RopeToString(other_rope, other_buf, MAX_STR_SIZE) < 0) {
-		elog("WARNING(rope_to_s): buf too small");
-		return Qnil;
+	call->edits[call->n_edits++] = *edit;
+}
+
+static void *
+diff_nogvl(void *arg) {
+	struct compare_call *call = arg;
+
+	RopeDiff(call->a, call->b, rope_diff_push, call);
+
+	return NULL;
+}
+
+/* [[pos, len, other_pos, other_len], ...] replacing self[pos, len] with
+ * other[other_pos, other_len] in order makes other */
+static VALUE
+rope_diff(VALUE self, VALUE other) {
+	struct compare_call call = {NULL, NULL, false, 0, NULL, 0, 0};
+	VALUE edits;
+
+	value2rope(call.a, self);
+	call.b = value2rope_checked(other);
+	call_nogvl(diff_nogvl, &call, call.a, call.b);
+
+	edits = rb_ary_new_capa(call.n_edits);
+	for (size_t k = 0; k < call.n_edits; k++) {
+		const RopeDiffEdit *edit = &call.edits[k];
+
+		rb_ary_push(edits, rb_ary_new_from_args(
+		                       4, SIZET2NUM(edit->a_pos), SIZET2NUM(edit->a_len),
+		                       SIZET2NUM(edit->b_pos), SIZET2NUM(edit->b_len)));
 	}
+	if (call.edits)
+		pfree(call.edits);
+
+	return edits;
+}
+
+/*
+ * Gram index (Rope#build_index)
+ *
+ * The RopeGramIndex is held by a hidden object in a hidden instance
+ * variable, so that a search running without the GVL keeps it while <<
+ * replaces it. It refers to the rope, which is hence never changed in
+ * place: << and compact! make a new rope, whose index is rebuilt sharing the
+ * part of the old index for the subtrees they share.
+ */
+static ID id_gram_index;
+
+static void
+gram_index_dfree(void *index) {
+	if (index)
+		RopeIndexFree(index);
+}
+
+static const rb_data_type_t gram_index_type = {
+    "crope_gram_index", {0, gram_index_dfree, 0, 0}, 0, 0, 0};
+
+static RopeGramIndex
+rope_gram_index(VALUE self, VALUE *holder) {
+	*holder = rb_attr_get(self, id_gram_index);
 
-	return strcmp(my_buf, other_buf) == 0 ? Qtrue : Qfalse;
+	return NIL_P(*holder) ? NULL : DATA_PTR(*holder);
 }
 
+/* an empty holder for the index of self once its rope is replaced, or nil
+ * if it has no index; made before the new rope, which would leak if the
+ * allocation raised */
 static VALUE
-rope_delete(int argc, VALUE *argv, VALUE self)
-{
+rope_gram_index_holder(VALUE self) {
+	VALUE holder;
+
+	if (!rope_gram_index(self, &holder))
+		return Qnil;
+
+	return TypedData_Wrap_Struct(0, &gram_index_type, NULL);
+}
+
+/* rebuild the index of self, if any, into new_holder for rope replacing old;
+ * self is not frozen, so this does not raise */
+static void
+rope_gram_index_update(VALUE self, VALUE new_holder, Rope old, Rope rope) {
+	VALUE holder;
+	RopeGramIndex index = rope_gram_index(self, &holder);
+
+	if (index && !NIL_P(new_holder) && rope != old) {
+		DATA_PTR(new_holder) = RopeRebuildIndex(index, rope);
+		rb_ivar_set(self, id_gram_index, new_holder);
+	}
+}
+
+/* k-grams of self, for #index and #include? with patterns of k bytes or
+ * more; kept up to date by <<, and built before self is frozen */
+static VALUE
+rope_build_index(int argc, VALUE *argv, VALUE self) {
 	Rope rope;
-	VALUE vi, vn;
-	int i, n, len;
-	int n_arg = rb_scan_args(argc, argv, "11", &vi, &vn);
+	RopeGramIndex index;
+	VALUE vk;
+	long k = 4;
 
-	n = (n_arg == 1 ? 1 : get_fixnum_checked(vn));
-	i = get_fixnum_checked(vi);
+	rb_scan_args(argc, argv, "01", &vk);
+	if (!NIL_P(vk))
+		k = get_index(vk);
 
 	value2rope(rope, self);
-	len = (int) RopeGetLen(rope);
+	if (k < ROPE_INDEX_MIN_K || k > ROPE_INDEX_MAX_K ||
+	    !(index = RopeBuildIndex(rope, k)))
+		rb_raise(rb_eArgError, "k must be in %d..%d", ROPE_INDEX_MIN_K,
+		         ROPE_INDEX_MAX_K);
+	rb_ivar_set(self, id_gram_index,
+	            TypedData_Wrap_Struct(0, &gram_index_type, index));
 
-	if (len <= i || n < 0)
-		return Qnil;
+	return self;
+}
 
-	/* copied from rope_substr */
-	if (i >= 0) {
-		if (i + n > len)
-			n = len - i;
-		return rope2value(RopeDelete(rope, i, n));
-	} else {
-		int ri = len + i;
+struct rope_find_call {
+	Rope rope;
+	RopeGramIndex index;
+	const char *pattern;
+	size_t len, from;
+	ssize_t rv;
+};
 
-		if (ri < 0)
-			return Qnil;
+static void *
+rope_find_nogvl(void *arg) {
+	struct rope_find_call *call = arg;
 
-		if (ri + n > len)
-			n = len - ri;
+	call->rv = RopeFind(call->rope, call->pattern, call->len, call->from,
+	                    call->index);
 
-		return rope2value(RopeDelete(rope, ri, n));
-	}
+	return NULL;
+}
+
+static ssize_t
+rope_find(VALUE self, VALUE str, long from) {
+	struct rope_find_call call;
+	VALUE holder;
+
+	value2rope(call.rope, self);
+	if (from < 0)
+		from += RopeGetLen(call.rope);
+	if (from < 0)
+		return -1;
+
+	str = rb_str_new_frozen(StringValue(str));
+	call.index = rope_gram_index(self, &holder);
+	call.pattern = RSTRING_PTR(str);
+	call.len = RSTRING_LEN(str);
+	call.from = from;
+	call_nogvl(rope_find_nogvl, &call, call.rope, NULL);
+	RB_GC_GUARD(str);
+	RB_GC_GUARD(holder);
+
+	return call.rv;
+}
+
+/* byte position of the first str at or after from, or nil */
+static VALUE
+rope_index_of(int argc, VALUE *argv, VALUE self) {
+	VALUE str, vfrom;
+	ssize_t pos;
+
+	rb_scan_args(argc, argv, "11", &str, &vfrom);
+	pos = rope_find(self, str, NIL_P(vfrom) ? 0 : get_index(vfrom));
+
+	return pos < 0 ? Qnil : SSIZET2NUM(pos);
+}
+
+static VALUE
+rope_include_p(VALUE self, VALUE str) {
+	return rope_find(self, str, 0) < 0 ? Qfalse : Qtrue;
+}
+
+/* self is modified, unlike + */
+static VALUE
+rope_append(VALUE self, VALUE other) {
+	struct rope_obj *obj = value2obj(self);
+	Rope rope, rv;
+	struct profile_site *site = NULL;
+	VALUE holder;
+
+	rb_check_frozen(self);
+	holder = rope_gram_index_holder(self);
+	rope = obj->rope;
+	if (profile_ropes) {
+		site = profile_site(obj);
+		site->appends++;
+		if (RB_TYPE_P(other, T_STRING)) {
+			site->append_bytes += RSTRING_LEN(other);
+			site->append_copied += RSTRING_LEN(other);
+		} else
+			site->append_bytes += RopeGetLen(value2rope_checked(other));
+	}
+
+	if (!RB_TYPE_P(other, T_STRING)) {
+		struct rope_obj *o2 = value2obj(other);
+
+		rv = RopeConcat(rope, o2->rope);
+		if (trace) {
+			uint64_t left = trace_id(obj), right = trace_id(o2);
+
+			/* obj holds a rope of a new id, the old one is gone */
+			trace_free(obj);
+			trace_record(ROPE_TRACE_CONCAT, trace_new_id(obj), left, right, 0);
+		}
+		RopeDestroy(rope);
+	} else if (trace) {
+		uint64_t src = trace_id(obj);
+		st_data_t key = (st_data_t) obj, id;
+
+		/* consumed by the append, not freed */
+		st_delete(trace_ids, &key, &id);
+		rv = RopeAppendInPlace(rope, RSTRING_PTR(other), RSTRING_LEN(other));
+		trace_record(ROPE_TRACE_APPEND, trace_new_id(obj), src,
+		             RSTRING_LEN(other), 0);
+	} else
+		rv = RopeAppendInPlace(rope, RSTRING_PTR(other), RSTRING_LEN(other));
+
+	/* appended in place unless a node was made */
+	if (site && rv != rope)
+		site->append_nodes++;
+	rope_gram_index_update(self, holder, rope, rv);
+	obj->rope = rv;
+
+	return self;
+}
+
+struct to_s_call {
+	Rope rope;
+	char *buf;
+	ssize_t rv;
+};
+
+static void *
+to_s_nogvl(void *arg) {
+	struct to_s_call *call = arg;
+
+	call->rv = RopeToString(call->rope, call->buf, RopeGetLen(call->rope) + 1);
+
+	return NULL;
+}
+
+static VALUE
+rope_to_s(VALUE self) {
+	Rope rope;
+	struct to_s_call call;
+	VALUE str;
+	const char *ext;
+	void *owner;
+
+	value2rope(rope, self);
+	traced_to_s(value2obj(self));
+
+	/* the borrowed String itself, if rope is the whole of it */
+	if (RopeGetExternal(rope, &ext, &owner) &&
+	    ext == RSTRING_PTR((VALUE) owner) &&
+	    RopeGetLen(rope) == (size_t) RSTRING_LEN((VALUE) owner))
+		return (VALUE) owner;
+
+	/* flattened into the String itself */
+	str = rb_str_new(NULL, RopeGetLen(rope));
+	call.rope = rope;
+	call.buf = RSTRING_PTR(str);
+	call_nogvl(to_s_nogvl, &call, rope, NULL);
+	if (call.rv < 0) {
+		elog("WARNING(rope_to_s): too long");
+		return Qnil;
+	}
+
+	return str;
+}
+
+static VALUE
+rope_dump(VALUE self) {
+	Rope rope;
+	value2rope(rope, self);
+
+	RopeDump(rope);
+
+	return self;
+}
+
+/* compared in place, skipping what the ropes share */
+static VALUE
+rope_equal_as_string(VALUE self, VALUE other) {
+	Rope my_rope, other_rope;
+
+	value2rope(my_rope, self);
+	other_rope = value2rope_checked(other);
+
+	if (RopeGetLen(my_rope) != RopeGetLen(other_rope))
+		return Qfalse;
+
+	return rope_common(self, other, false) == RopeGetLen(my_rope) ? Qtrue
+	                                                              : Qfalse;
+}
+
+static VALUE
+rope_delete(int argc, VALUE *argv, VALUE self)
+{
+	Rope rope;
+	VALUE vi, vn;
+	int n_arg = rb_scan_args(argc, argv, "11", &vi, &vn);
+	long i = get_index(vi), n = (n_arg == 1 ? 1 : get_index(vn));
+
+	value2rope(rope, self);
+
+	if (!clip_range((long) RopeGetLen(rope), &i, &n))
+		return Qnil;
+
+	return traced_substr(ROPE_TRACE_DELETE, value2obj(self), rope, i, n);
+}
+
+/*
+ * Iteration
+ *
+ * Enumerators walk the leaves with RopeScanLeaf and never flatten the rope.
+ * Lines and fields are yielded as sub-Ropes (RopeSubstr), chars and bytes
+ * as one byte Strings and Integers.
+ */
+/*
+ * The rope is pinned (see call_nogvl) while it is iterated, so that a block
+ * replacing the rope of self (<<, compact!) leaves the nodes scanned alive.
+ */
+struct rope_iter {
+	struct rope_obj *obj; /* of self, which may be given another rope */
+	Rope rope;
+	VALUE pin;
+	RopeScanLeaf scan;
+	const char *sep;
+	long sep_len;
+	long *fail; /* KMP failure function of sep */
+	bool is_split;
+	bool as_string; /* each_char rather than each_byte */
+	VALUE ary;      /* split without a block */
+};
+
+static void
+rope_iter_emit(struct rope_iter *it, size_t i, size_t n) {
+	VALUE sub = traced_substr(ROPE_TRACE_SUBSTR, it->obj, it->rope, i, n);
+
+	if (NIL_P(it->ary))
+		rb_yield(sub);
+	else
+		rb_ary_push(it->ary, sub);
+}
+
+/* split drops trailing empty fields, so empty ones are held back */
+static void
+rope_iter_field(struct rope_iter *it, size_t i, size_t n, size_t *n_empty) {
+	if (it->is_split && n == 0) {
+		(*n_empty)++;
+		return;
+	}
+
+	for (; *n_empty > 0; (*n_empty)--)
+		rope_iter_emit(it, i, 0);
+	rope_iter_emit(it, i, n);
+}
+
+static VALUE
+rope_iter_sep(VALUE arg) {
+	struct rope_iter *it = (struct rope_iter *) arg;
+	const char *str;
+	size_t len, pos = 0, start = 0, n_empty = 0;
+	long matched = 0;
+
+	while ((str = RopeScanLeafGetNextLen(it->scan, &len))) {
+		for (size_t k = 0; k < len; k++) {
+			if (matched == 0) {
+				const char *p = memchr(str + k, it->sep[0], len - k);
+
+				if (!p)
+					break;
+				k = p - str;
+			}
+
+			while (matched > 0 && str[k] != it->sep[matched])
+				matched = it->fail[matched - 1];
+			if (str[k] == it->sep[matched])
+				matched++;
+
+			if (matched == it->sep_len) {
+				size_t end = pos + k + 1;
+
+				rope_iter_field(it, start,
+				                end - start - (it->is_split ? it->sep_len : 0),
+				                &n_empty);
+				start = end;
+				matched = 0;
+			}
+		}
+		pos += len;
+	}
+
+	if (start < pos)
+		rope_iter_field(it, start, pos - start, &n_empty);
+
+	return Qnil;
+}
+
+static VALUE
+rope_iter_fini(VALUE arg) {
+	struct rope_iter *it = (struct rope_iter *) arg;
+
+	RopeScanLeafFini(it->scan);
+	if (it->fail)
+		pfree(it->fail);
+	pin_dfree(DATA_PTR(it->pin));
+	DATA_PTR(it->pin) = NULL;
+
+	return Qnil;
+}
+
+static VALUE
+rope_iter_by_sep(VALUE self, VALUE sep, bool is_split, VALUE ary) {
+	struct rope_iter it;
+
+	StringValue(sep);
+	if (RSTRING_LEN(sep) == 0)
+		rb_raise(rb_eArgError, "empty separator is not supported");
+
+	it.obj = value2obj(self);
+	it.rope = it.obj->rope;
+	it.pin = TypedData_Wrap_Struct(0, &pin_type, RopeRef(it.rope));
+	it.sep = RSTRING_PTR(sep);
+	it.sep_len = RSTRING_LEN(sep);
+	it.is_split = is_split;
+	it.ary = ary;
+
+	it.fail = palloc(sizeof(*it.fail) * it.sep_len);
+	it.fail[0] = 0;
+	for (long k = 1, m = 0; k < it.sep_len; k++) {
+		while (m > 0 && it.sep[k] != it.sep[m])
+			m = it.fail[m - 1];
+		if (it.sep[k] == it.sep[m])
+			m++;
+		it.fail[k] = m;
+	}
+
+	it.scan = RopeScanLeafInit(it.rope);
+	rb_ensure(rope_iter_sep, (VALUE) &it, rope_iter_fini, (VALUE) &it);
+	RB_GC_GUARD(sep);
+	RB_GC_GUARD(it.pin);
+
+	return NIL_P(ary) ? self : ary;
+}
+
+static VALUE
+rope_each_line(int argc, VALUE *argv, VALUE self) {
+	VALUE sep;
+
+	RETURN_ENUMERATOR(self, argc, argv);
+	rb_scan_args(argc, argv, "01", &sep);
+
+	return rope_iter_by_sep(self, NIL_P(sep) ? rb_str_new_cstr("\n") : sep,
+	                        false, Qnil);
+}
+
+/* sep is a literal String, unlike String#split */
+static VALUE
+rope_split(VALUE self, VALUE sep) {
+	return rope_iter_by_sep(self, sep, true,
+	                        rb_block_given_p() ? Qnil : rb_ary_new());
+}
+
+static VALUE
+rope_iter_bytes(VALUE arg) {
+	struct rope_iter *it = (struct rope_iter *) arg;
+	const char *str;
+	size_t len;
+
+	while ((str = RopeScanLeafGetNextLen(it->scan, &len)))
+		for (size_t k = 0; k < len; k++)
+			rb_yield(it->as_string ? rb_str_new(str + k, 1)
+			                      : INT2FIX((unsigned char) str[k]));
+
+	return Qnil;
+}
+
+static VALUE
+rope_enum_len(VALUE self, VALUE args, VALUE eobj) {
+	(void) args;
+	(void) eobj;
+
+	return rope_len(self);
+}
+
+static VALUE
+rope_iter_by_byte(VALUE self, bool as_string) {
+	struct rope_iter it;
+
+	it.obj = value2obj(self);
+	it.rope = it.obj->rope;
+	it.fail = NULL;
+	it.as_string = as_string;
+	it.pin = TypedData_Wrap_Struct(0, &pin_type, RopeRef(it.rope));
+	it.scan = RopeScanLeafInit(it.rope);
+	rb_ensure(rope_iter_bytes, (VALUE) &it, rope_iter_fini, (VALUE) &it);
+	RB_GC_GUARD(it.pin);
+
+	return self;
+}
+
+static VALUE
+rope_each_char(VALUE self) {
+	RETURN_SIZED_ENUMERATOR(self, 0, 0, rope_enum_len);
+
+	return rope_iter_by_byte(self, true);
+}
+
+static VALUE
+rope_each_byte(VALUE self) {
+	RETURN_SIZED_ENUMERATOR(self, 0, 0, rope_enum_len);
+
+	return rope_iter_by_byte(self, false);
+}
+
+/* replace the rope of self with reshaped, which has the same contents; what
+ * may raise is done before the rope of self is released */
+static void
+rope_reshape(VALUE self, VALUE holder, Rope rope, Rope reshaped) {
+	/* same contents, so the trace keeps the id of self */
+	rope_gram_index_update(self, holder, rope, reshaped);
+	RopeDestroy(rope);
+	value2obj(self)->rope = reshaped;
+}
+
+static VALUE
+rope_compact_bang(int argc, VALUE *argv, VALUE self) {
+	Rope rope, compact;
+	VALUE vmin, holder;
+	RopeCompactPolicy policy = {ROPE_COMPACT_MIN_LEAF_LEN,
+	                            ROPE_COMPACT_MAX_RATIO};
+
+	rb_scan_args(argc, argv, "01", &vmin);
+	if (!NIL_P(vmin))
+		policy.min_leaf_len = get_index(vmin);
+
+	rb_check_frozen(self);
+	holder = rope_gram_index_holder(self);
+	value2rope(rope, self);
+	compact = RopeCompact(rope, &policy);
+	rope_reshape(self, holder, rope, compact);
+
+	return self;
+}
+
+static VALUE
+rope_rebalance_bang(VALUE self) {
+	Rope rope;
+	VALUE holder;
+
+	rb_check_frozen(self);
+	holder = rope_gram_index_holder(self);
+	value2rope(rope, self);
+	rope_reshape(self, holder, rope, RopeRebalance(rope));
+
+	return self;
+}
+
+/* make the nodes of self immortal, so that workers forked afterwards read
+ * them without copying their pages; << still works, on new nodes */
+static VALUE
+rope_freeze_for_fork(VALUE self) {
+	Rope rope;
+
+	value2rope(rope, self);
+	RopeFreezeForFork(rope);
+
+	return self;
+}
+
+static VALUE
+rope_immortal_p(VALUE self) {
+	Rope rope;
+
+	value2rope(rope, self);
+
+	return RopeIsImmortal(rope) ? Qtrue : Qfalse;
+}
+
+static VALUE
+rope_needs_rebalance(VALUE self) {
+	Rope rope;
+
+	value2rope(rope, self);
+
+	return RopeNeedsRebalance(rope) ? Qtrue : Qfalse;
+}
+
+/*
+ * Rope.read(io, max_bytes = nil) reads the descriptor of io into leaves
+ * directly, after what io has buffered. With a block, a thread reads ahead
+ * and each leaf is yielded as a Rope as soon as it is read. Waiting for
+ * input is done without the GVL, and is interrupted (by Thread#kill,
+ * Thread#raise or a signal) to run the interrupts before it resumes. Not
+ * traced.
+ */
+struct rope_read {
+	RopeReader reader;
+	VALUE rv;
+	int fd;
+	size_t max_bytes;
+	Rope rope; /* read without the GVL */
+	int error;
+	bool interrupted;
+};
+
+static void *
+rope_read_fd_nogvl(void *arg) {
+	struct rope_read *rd = arg;
+
+	if (!(rd->rope = RopeReadFdInterruptible(rd->fd, rd->max_bytes,
+	                                         &rd->interrupted)))
+		rd->error = errno;
+
+	return NULL;
+}
+
+static void *
+rope_read_next_nogvl(void *arg) {
+	struct rope_read *rd = arg;
+
+	rd->rope = RopeReaderNext(rd->reader);
+
+	return NULL;
+}
+
+static void
+rope_read_unblock(void *arg) {
+	RopeReaderInterrupt(((struct rope_read *) arg)->reader);
+}
+
+/* on the right spine of rv, which nothing else refers to, so that the
+ * leaves of a long read make a balanced tree */
+static void
+rope_read_append(VALUE rv, Rope rope) {
+	struct rope_obj *obj = value2obj(rv);
+
+	obj->rope = RopeAppendRope(obj->rope, rope);
+}
+
+static VALUE
+rope_read_yield(VALUE arg) {
+	struct rope_read *rd = (struct rope_read *) arg;
+
+	for (;;) {
+		rb_thread_call_without_gvl(rope_read_next_nogvl, rd, rope_read_unblock,
+		                           rd);
+		if (!rd->rope) {
+			if (RopeReaderAtEnd(rd->reader))
+				break;
+			rb_thread_check_ints();
+			continue;
+		}
+		rope_read_append(rd->rv, rd->rope);
+		rb_yield(rope2value(rd->rope));
+	}
+
+	return Qnil;
+}
+
+static VALUE
+rope_read_finish(VALUE arg) {
+	struct rope_read *rd = (struct rope_read *) arg;
+
+	rd->error = RopeReaderFinish(rd->reader);
+
+	return Qnil;
+}
+
+static VALUE
+rope_s_read(int argc, VALUE *argv, VALUE klass) {
+	VALUE io, vmax, head;
+	rb_io_t *fptr;
+	struct rope_read rd = {NULL, Qnil, -1, 0, NULL, 0, false};
+	Rope head_rope;
+
+	(void) klass;
+	rb_scan_args(argc, argv, "11", &io, &vmax);
+	rd.max_bytes = NIL_P(vmax) ? SIZE_MAX : NUM2SIZET(vmax);
+	io = rb_io_get_io(io);
+	GetOpenFile(io, fptr);
+	rb_io_check_readable(fptr);
+
+	rd.rv = rope2value(RopeCreate((char *) "", 0));
+	/* bytes io has read ahead are not in the descriptor any more */
+	while (rd.max_bytes > 0 && rb_io_read_pending(fptr)) {
+		head = rb_funcall(io, rb_intern("readpartial"), 1,
+		                  SIZET2NUM(rd.max_bytes < MAX_STR_SIZE ? rd.max_bytes
+		                                                        : MAX_STR_SIZE));
+		rd.max_bytes -= RSTRING_LEN(head);
+		head_rope = str2rope(head);
+		rope_read_append(rd.rv, head_rope);
+		RopeDestroy(head_rope);
+	}
+	rd.fd = rb_io_descriptor(io);
+
+	if (!rb_block_given_p()) {
+		for (;;) {
+			rb_thread_call_without_gvl(rope_read_fd_nogvl, &rd, RUBY_UBF_IO,
+			                           NULL);
+			if (!rd.rope) {
+				errno = rd.error;
+				rb_sys_fail("read");
+			}
+			rope_read_append(rd.rv, rd.rope);
+			rd.max_bytes -= RopeGetLen(rd.rope);
+			RopeDestroy(rd.rope);
+			if (!rd.interrupted || rd.max_bytes == 0)
+				return rd.rv;
+			rb_thread_check_ints();
+		}
+	}
+
+	if (!(rd.reader = RopeReaderStart(rd.fd, rd.max_bytes)))
+		rb_raise(rb_eRuntimeError, "cannot start a reader thread");
+	rb_ensure(rope_read_yield, (VALUE) &rd, rope_read_finish, (VALUE) &rd);
+	if (rd.error) {
+		errno = rd.error;
+		rb_sys_fail("read");
+	}
+
+	return rd.rv;
+}
+
+static VALUE
+rope_s_set_rebalance_steps(VALUE klass, VALUE steps) {
+	(void) klass;
+	RopeSetRebalanceSteps(NUM2SIZET(steps));
+
+	return steps;
+}
+
+/* bytes of flattened ropes kept for later to_s, [] and comparisons, 0 for
+ * none */
+static VALUE
+rope_s_set_flat_cache(VALUE klass, VALUE budget) {
+	(void) klass;
+	RopeSetFlatCache(NUM2SIZET(budget), ROPE_FLAT_CACHE_MIN_LEN);
+
+	return budget;
+}
+
+static VALUE
+rope_s_flat_cache_size(VALUE klass) {
+	(void) klass;
+
+	return SIZET2NUM(RopeFlatCacheSize());
+}
+
+/* free at most max_nodes (all if nil) nodes of collected ropes, return the
+ * number freed */
+static VALUE
+rope_s_reclaim(int argc, VALUE *argv, VALUE klass) {
+	VALUE vmax;
+
+	(void) klass;
+	rb_scan_args(argc, argv, "01", &vmax);
+
+	return SIZET2NUM(RopeReclaim(NIL_P(vmax) ? SIZE_MAX : NUM2SIZET(vmax)));
+}
+
+struct stats_call {
+	Rope rope;
+	RopeGramIndex index; /* or NULL */
+	RopeStats *stats;
+};
+
+static void *
+stats_nogvl(void *arg) {
+	struct stats_call *call = arg;
+
+	if (call->index)
+		RopeIndexGetStats(call->index, call->stats);
+	else
+		RopeGetStats(call->rope, call->stats);
+
+	return NULL;
+}
+
+static VALUE
+rope_stats(VALUE self) {
+	Rope rope;
+	RopeStats stats;
+	struct stats_call call;
+	VALUE hash = rb_hash_new(), hist = rb_ary_new(), holder;
+	int last = 0;
+
+	value2rope(rope, self);
+	call.rope = rope;
+	call.index = rope_gram_index(self, &holder);
+	call.stats = &stats;
+	call_nogvl(stats_nogvl, &call, rope, NULL);
+	RB_GC_GUARD(holder);
+
+	for (int i = 0; i < ROPE_STATS_HIST_SIZE; i++)
+		if (stats.leaf_hist[i])
+			last = i;
+	for (int i = 0; i <= last; i++)
+		rb_ary_push(hist, SIZET2NUM(stats.leaf_hist[i]));
+
+	rb_hash_aset(hash, ID2SYM(rb_intern("len")), SIZET2NUM(stats.len));
+	rb_hash_aset(hash, ID2SYM(rb_intern("depth")), SIZET2NUM(stats.depth));
+	rb_hash_aset(hash, ID2SYM(rb_intern("nodes")), SIZET2NUM(stats.n_nodes));
+	rb_hash_aset(hash, ID2SYM(rb_intern("leaves")), SIZET2NUM(stats.n_leaves));
+	rb_hash_aset(hash, ID2SYM(rb_intern("compressed_leaves")),
+	             SIZET2NUM(stats.n_compressed));
+	rb_hash_aset(hash, ID2SYM(rb_intern("external_size")),
+	             SIZET2NUM(stats.external_size));
+	rb_hash_aset(hash, ID2SYM(rb_intern("size")), SIZET2NUM(stats.size));
+	rb_hash_aset(hash, ID2SYM(rb_intern("shared_size")),
+	             SIZET2NUM(stats.shared_size));
+	rb_hash_aset(hash, ID2SYM(rb_intern("exclusive_size")),
+	             SIZET2NUM(stats.exclusive_size));
+	rb_hash_aset(hash, ID2SYM(rb_intern("leaf_histogram")), hist);
+	if (call.index)
+		rb_hash_aset(hash, ID2SYM(rb_intern("index_size")),
+		             SIZET2NUM(stats.index_size));
+
+	return hash;
+}
+
+static VALUE
+rope_s_instrumentation(VALUE klass) {
+	RopeInstrStats stats;
+	VALUE hash, calls, latency;
+
+	(void) klass;
+
+	if (!RopeInstrSnapshot(&stats))
+		return Qnil;
+
+	hash = rb_hash_new();
+	calls = rb_hash_new();
+	latency = rb_hash_new();
+
+	for (int op = 0; op < ROPE_N_OPS; op++) {
+		VALUE name = ID2SYM(rb_intern(RopeInstrOpName(op))),
+		      hist = rb_ary_new();
+
+		for (int i = 0; i < ROPE_INSTR_HIST_SIZE; i++)
+			rb_ary_push(hist, SIZET2NUM(stats.latency_hist[op][i]));
+
+		rb_hash_aset(calls, name, SIZET2NUM(stats.n_calls[op]));
+		rb_hash_aset(latency, name, hist);
+	}
+
+	rb_hash_aset(hash, ID2SYM(rb_intern("allocs")), SIZET2NUM(stats.n_alloc));
+	rb_hash_aset(hash, ID2SYM(rb_intern("frees")), SIZET2NUM(stats.n_free));
+	rb_hash_aset(hash, ID2SYM(rb_intern("alloc_bytes")),
+	             SIZET2NUM(stats.alloc_bytes));
+	rb_hash_aset(hash, ID2SYM(rb_intern("index_nodes_visited")),
+	             SIZET2NUM(stats.index_nodes_visited));
+	rb_hash_aset(hash, ID2SYM(rb_intern("create_bytes")),
+	             SIZET2NUM(stats.create_bytes));
+	rb_hash_aset(hash, ID2SYM(rb_intern("to_string_bytes")),
+	             SIZET2NUM(stats.to_string_bytes));
+	rb_hash_aset(hash, ID2SYM(rb_intern("calls")), calls);
+	/* latency[op][i] is the number of calls which took [2^i, 2^(i+1)) ns */
+	rb_hash_aset(hash, ID2SYM(rb_intern("latency")), latency);
+
+	return hash;
+}
+
+static VALUE
+rope_s_reset_instrumentation(VALUE klass) {
+	(void) klass;
+	RopeInstrReset();
+
+	return Qnil;
+}
+
+static VALUE
+rope_s_trace_start(VALUE klass, VALUE path) {
+	(void) klass;
+
+	if (trace)
+		rb_raise(rb_eRuntimeError, "trace already started");
+
+	if (!(trace = RopeTraceOpenWrite(StringValueCStr(path))))
+		rb_sys_fail(StringValueCStr(path));
+
+	trace_ids = st_init_numtable();
+	trace_last_id = 0;
+
+	return Qtrue;
+}
+
+static VALUE
+rope_s_trace_stop(VALUE klass) {
+	(void) klass;
+
+	if (!trace)
+		return Qfalse;
+
+	RopeTraceClose(trace);
+	trace = NULL;
+	st_free_table(trace_ids);
+	trace_ids = NULL;
+
+	return Qtrue;
+}
+
+static VALUE
+rope_s_profile_start(VALUE klass) {
+	(void) klass;
+
+	if (profile_ropes)
+		rb_raise(rb_eRuntimeError, "profile already started");
+
+	profile_sites = st_init_strtable();
+	profile_ropes = st_init_numtable();
+
+	return Qtrue;
+}
+
+/* the report so far, nil if not profiling */
+static VALUE
+rope_s_profile(VALUE klass) {
+	(void) klass;
+
+	return profile_ropes ? profile_report() : Qnil;
+}
+
+/* the final report, nil if not profiling */
+static VALUE
+rope_s_profile_stop(VALUE klass) {
+	VALUE report;
+
+	(void) klass;
+
+	if (!profile_ropes)
+		return Qnil;
+
+	report = profile_report();
+	st_free_table(profile_ropes);
+	profile_ropes = NULL;
+	st_foreach(profile_sites, profile_free_site, 0);
+	st_free_table(profile_sites);
+	profile_sites = NULL;
+
+	return report;
+}
+
+/*
+ * Rope::Matcher
+ *
+ * Patterns compiled once by RopePatternSetCompile, searched for in any
+ * number of Ropes (or Strings) at one pass each. The set is read only, so
+ * searches run without the GVL unless they yield.
+ */
+static VALUE rb_cMatcher;
+
+struct matcher {
+	RopePatternSet set;
+	VALUE patterns; /* frozen Array of frozen Strings */
+};
+
+static void
+matcher_dmark(void *ptr) {
+	rb_gc_mark(((struct matcher *) ptr)->patterns);
+}
+
+static void
+matcher_dfree(void *ptr) {
+	struct matcher *m = ptr;
+
+	if (m->set)
+		RopePatternSetFree(m->set);
+	xfree(m);
+}
+
+static const rb_data_type_t matcher_type = {
+    "crope_matcher", {matcher_dmark, matcher_dfree, 0, 0}, 0, 0, 0};
+
+static VALUE
+matcher_alloc(VALUE klass) {
+	struct matcher *m;
+	VALUE self = TypedData_Make_Struct(klass, struct matcher, &matcher_type, m);
+
+	m->patterns = Qnil;
+	return self;
+}
+
+static struct matcher *
+value2matcher(VALUE self) {
+	struct matcher *m;
+
+	TypedData_Get_Struct(self, struct matcher, &matcher_type, m);
+	if (!m->set)
+		rb_raise(rb_eArgError, "uninitialized Rope::Matcher");
+
+	return m;
+}
+
+static VALUE
+matcher_init(VALUE self, VALUE patterns) {
+	struct matcher *m;
+	const char **strs;
+	size_t *lens;
+	long n;
+	VALUE strs_buf, lens_buf;
+
+	TypedData_Get_Struct(self, struct matcher, &matcher_type, m);
+	if (m->set)
+		rb_raise(rb_eArgError, "Rope::Matcher is initialized already");
+
+	patterns = rb_ary_dup(rb_Array(patterns));
+	n = RARRAY_LEN(patterns);
+	strs = ALLOCV_N(const char *, strs_buf, n);
+	lens = ALLOCV_N(size_t, lens_buf, n);
+	for (long k = 0; k < n; k++) {
+		VALUE str = RARRAY_AREF(patterns, k);
+
+		str = rb_str_new_frozen(StringValue(str));
+		rb_ary_store(patterns, k, str);
+		strs[k] = RSTRING_PTR(str);
+		lens[k] = RSTRING_LEN(str);
+	}
+
+	m->set = RopePatternSetCompile(strs, lens, n);
+	ALLOCV_END(strs_buf);
+	ALLOCV_END(lens_buf);
+	if (!m->set)
+		rb_raise(rb_eArgError, "empty pattern");
+	m->patterns = rb_ary_freeze(patterns);
+
+	return self;
+}
+
+static VALUE
+matcher_patterns(VALUE self) {
+	return value2matcher(self)->patterns;
+}
+
+struct find_call {
+	RopePatternSet set;
+	Rope rope;
+	bool first_only;
+	RopeMatch *matches;
+	size_t n_matches, cap;
+};
+
+static bool
+find_push(const RopeMatch *match, void *arg) {
+	struct find_call *call = arg;
+
+	if (call->n_matches == call->cap) {
+		RopeMatch *matches;
+
+		call->cap = call->cap ? call->cap * 2 : 16;
+		matches = palloc(sizeof(*matches) * call->cap);
+		if (call->matches) {
+			memcpy(matches, call->matches, sizeof(*matches) * call->n_matches);
+			pfree(call->matches);
+		}
+		call->matches = matches;
+	}
+	call->matches[call->n_matches++] = *match;
+
+	return !call->first_only;
+}
+
+static void *
+find_nogvl(void *arg) {
+	struct find_call *call = arg;
+
+	RopeFindAll(call->set, call->rope, find_push, call);
+
+	return NULL;
+}
+
+/* a Rope argument, or a String taken as one */
+static VALUE
+matcher_subject(VALUE v) {
+	return RB_TYPE_P(v, T_STRING) ? rope2value(str2rope(v)) : v;
+}
+
+/* [[pos, index], ...] of every match by end position, longest first, or
+ * yields pos and index of each */
+static VALUE
+matcher_find_all(VALUE self, VALUE subject) {
+	struct matcher *m = value2matcher(self);
+	struct find_call call = {m->set, NULL, false, NULL, 0, 0};
+	VALUE rope = matcher_subject(subject), rv;
+
+	call.rope = value2rope_checked(rope);
+	call_nogvl(find_nogvl, &call, call.rope, NULL);
+	RB_GC_GUARD(self);
+	RB_GC_GUARD(rope);
+
+	rv = rb_ary_new_capa(call.n_matches);
+	for (size_t k = 0; k < call.n_matches; k++)
+		rb_ary_push(rv, rb_assoc_new(SIZET2NUM(call.matches[k].pos),
+		                             SIZET2NUM(call.matches[k].pattern)));
+	if (call.matches)
+		pfree(call.matches);
+
+	/* yielded once all are found, so that the block cannot leave the search
+	 * half done */
+	if (rb_block_given_p()) {
+		for (long k = 0; k < RARRAY_LEN(rv); k++)
+			rb_yield_values2(2, RARRAY_CONST_PTR(RARRAY_AREF(rv, k)));
+		return self;
+	}
+
+	return rv;
+}
+
+static VALUE
+matcher_match_p(VALUE self, VALUE subject) {
+	struct matcher *m = value2matcher(self);
+	struct find_call call = {m->set, NULL, true, NULL, 0, 0};
+	VALUE rope = matcher_subject(subject);
+
+	call.rope = value2rope_checked(rope);
+	call_nogvl(find_nogvl, &call, call.rope, NULL);
+	RB_GC_GUARD(self);
+	RB_GC_GUARD(rope);
+	if (call.matches)
+		pfree(call.matches);
+
+	return call.n_matches ? Qtrue : Qfalse;
+}
+
+/*
+ * Rope::Appender
+ *
+ * A RopeAppender which threads append Strings to and take Rope snapshots
+ * of. Strings of NOGVL_MIN_LEN bytes or more are copied without the GVL.
+ */
+static VALUE rb_cAppender;
+
+static void
+appender_dfree(void *ptr) {
+	if (ptr)
+		RopeAppenderDestroy(ptr);
+}
+
+static const rb_data_type_t appender_type = {
+    "crope_appender", {0, appender_dfree, 0, 0}, 0, 0, 0};
+
+static VALUE
+appender_alloc(VALUE klass) {
+	return TypedData_Wrap_Struct(klass, &appender_type, RopeAppenderCreate());
+}
+
+struct appender_call {
+	RopeAppender app;
+	const char *str;
+	size_t len;
+};
+
+static void *
+appender_append_nogvl(void *ptr) {
+	struct appender_call *call = ptr;
+
+	RopeAppenderAppend(call->app, call->str, call->len);
+	return NULL;
+}
+
+static VALUE
+appender_append(VALUE self, VALUE str) {
+	struct appender_call call;
+
+	TypedData_Get_Struct(self, struct rope_appender_tag, &appender_type,
+	                     call.app);
+	str = rb_str_new_frozen(StringValue(str));
+	call.str = RSTRING_PTR(str);
+	call.len = RSTRING_LEN(str);
+	if (call.len < NOGVL_MIN_LEN)
+		appender_append_nogvl(&call);
+	else
+		rb_thread_call_without_gvl(appender_append_nogvl, &call, NULL, NULL);
+	RB_GC_GUARD(self);
+	RB_GC_GUARD(str);
+
+	return self;
+}
+
+static VALUE
+appender_snapshot(VALUE self) {
+	RopeAppender app;
+
+	TypedData_Get_Struct(self, struct rope_appender_tag, &appender_type, app);
+
+	return rope2value(RopeAppenderSnapshot(app));
 }
 
 void
@@ -241,18 +2010,71 @@ Init_Rope(void) {
 	rb_cRope = rb_define_class("Rope", rb_cData);
 
 	rb_define_alloc_func(rb_cRope, rope_alloc);
+	id_gram_index = rb_intern("gram_index");
 	rb_define_private_method(rb_cRope, "initialize", rope_init, -1);
 	rb_define_method(rb_cRope, "eql?", rope_equal_as_string, 1);
 	rb_define_method(rb_cRope, "+", rope_concat, 1);
 	rb_define_method(rb_cRope, "concat", rope_concat, 1);
+	rb_define_method(rb_cRope, "<<", rope_append, 1);
+	rb_define_method(rb_cRope, "*", rope_times, 1);
+	rb_define_method(rb_cRope, "upcase", rope_upcase, 0);
+	rb_define_method(rb_cRope, "downcase", rope_downcase, 0);
+	rb_define_method(rb_cRope, "tr", rope_tr, 2);
+	rb_define_method(rb_cRope, "common_prefix", rope_common_prefix, 1);
+	rb_define_method(rb_cRope, "common_suffix", rope_common_suffix, 1);
+	rb_define_method(rb_cRope, "diff", rope_diff, 1);
 	rb_define_method(rb_cRope, "length", rope_len, 0);
 	rb_define_method(rb_cRope, "size", rope_len, 0);
 	rb_define_method(rb_cRope, "[]", rope_slice, -1);
 	rb_define_method(rb_cRope, "delete_at", rope_delete, -1);
 	rb_define_method(rb_cRope, "slice", rope_slice, -1);
 	rb_define_method(rb_cRope, "at", rope_at, 1);
+	rb_define_method(rb_cRope, "values_at", rope_values_at, -1);
 	rb_define_method(rb_cRope, "to_s", rope_to_s, 0);
 	rb_define_method(rb_cRope, "to_str", rope_to_s, 0);
 	rb_define_method(rb_cRope, "inspect", rope_dump, 0);
 	rb_define_method(rb_cRope, "dump", rope_dump, 0);
+	rb_define_method(rb_cRope, "each_line", rope_each_line, -1);
+	rb_define_method(rb_cRope, "split", rope_split, 1);
+	rb_define_method(rb_cRope, "each_char", rope_each_char, 0);
+	rb_define_method(rb_cRope, "each_byte", rope_each_byte, 0);
+	rb_define_method(rb_cRope, "compact!", rope_compact_bang, -1);
+	rb_define_method(rb_cRope, "rebalance!", rope_rebalance_bang, 0);
+	rb_define_method(rb_cRope, "needs_rebalance?", rope_needs_rebalance, 0);
+	rb_define_method(rb_cRope, "freeze_for_fork", rope_freeze_for_fork, 0);
+	rb_define_method(rb_cRope, "immortal?", rope_immortal_p, 0);
+	rb_define_method(rb_cRope, "stats", rope_stats, 0);
+	rb_define_method(rb_cRope, "build_index", rope_build_index, -1);
+	rb_define_method(rb_cRope, "index", rope_index_of, -1);
+	rb_define_method(rb_cRope, "include?", rope_include_p, 1);
+	rb_define_singleton_method(rb_cRope, "instrumentation",
+	                           rope_s_instrumentation, 0);
+	rb_define_singleton_method(rb_cRope, "reset_instrumentation",
+	                           rope_s_reset_instrumentation, 0);
+	rb_define_singleton_method(rb_cRope, "rebalance_steps=",
+	                           rope_s_set_rebalance_steps, 1);
+	rb_define_singleton_method(rb_cRope, "flat_cache=", rope_s_set_flat_cache,
+	                           1);
+	rb_define_singleton_method(rb_cRope, "flat_cache_size",
+	                           rope_s_flat_cache_size, 0);
+	rb_define_singleton_method(rb_cRope, "read", rope_s_read, -1);
+	rb_define_singleton_method(rb_cRope, "reclaim", rope_s_reclaim, -1);
+	rb_define_singleton_method(rb_cRope, "trace_start", rope_s_trace_start, 1);
+	rb_define_singleton_method(rb_cRope, "trace_stop", rope_s_trace_stop, 0);
+	rb_define_singleton_method(rb_cRope, "profile_start", rope_s_profile_start,
+	                           0);
+	rb_define_singleton_method(rb_cRope, "profile", rope_s_profile, 0);
+	rb_define_singleton_method(rb_cRope, "profile_stop", rope_s_profile_stop, 0);
+
+	rb_cMatcher = rb_define_class_under(rb_cRope, "Matcher", rb_cObject);
+	rb_define_alloc_func(rb_cMatcher, matcher_alloc);
+	rb_define_private_method(rb_cMatcher, "initialize", matcher_init, 1);
+	rb_define_method(rb_cMatcher, "patterns", matcher_patterns, 0);
+	rb_define_method(rb_cMatcher, "find_all", matcher_find_all, 1);
+	rb_define_method(rb_cMatcher, "match?", matcher_match_p, 1);
+
+	rb_cAppender = rb_define_class_under(rb_cRope, "Appender", rb_cObject);
+	rb_define_alloc_func(rb_cAppender, appender_alloc);
+	rb_define_method(rb_cAppender, "<<", appender_append, 1);
+	rb_define_method(rb_cAppender, "snapshot", appender_snapshot, 0);
 }
@@ -1,26 +1,296 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <sys/types.h>
 
 typedef struct rope_tag *Rope;
 
 Rope RopeCreate(char str[], size_t size);
 void RopeDestroy(Rope rope);
+/* return another reference to rope, released by RopeDestroy; nothing under
+ * a rope referred to more than once is changed in place */
+Rope RopeRef(const Rope rope);
+
+/* make rope and every node under it immortal, return the number of nodes
+ * which were not: they are never counted, changed nor freed any more, so
+ * processes forked afterwards share their pages without copying them */
+size_t RopeFreezeForFork(const Rope rope);
+bool RopeIsImmortal(const Rope rope);
+
+/* like RopeDestroy, but the nodes it would free are queued, to be freed by
+ * RopeReclaim or the reclaim thread */
+void RopeDestroyDeferred(Rope rope);
+/* free at most max_nodes queued nodes, return the number freed */
+size_t RopeReclaim(size_t max_nodes);
+/* return the number of nodes known to be queued; the children of a queued
+ * node are counted once it is freed */
+size_t RopeReclaimPending(void);
+/* free queued nodes on a thread, at most batch nodes at a time, return false
+ * if it is running already or cannot be started; release functions of
+ * external leaves are then called on that thread */
+bool RopeReclaimThreadStart(size_t batch);
+/* stop the reclaim thread once the queue is empty */
+void RopeReclaimThreadStop(void);
+
+typedef void (*RopeReleaseFunc)(void *owner);
+
+/* return a leaf which refers to str instead of copying it, release (if not
+ * NULL) is called with owner when the leaf is destroyed */
+Rope RopeCreateExternal(const char *str, size_t len, void *owner,
+                        RopeReleaseFunc release);
+/* return true and the bytes and owner of rope if it is an external leaf, or
+ * a substring of one */
+bool RopeGetExternal(const Rope rope, const char **str, void **owner);
+/* call func with the owner of each external leaf in rope once */
+void RopeEachExternal(const Rope rope, void (*func)(void *owner, void *arg),
+                      void *arg);
 
 /* return the size of a written string, or -1 if buf_size is not sufficient */
-int RopeToString(const Rope rope, char *ret_buf, size_t buf_size);
+ssize_t RopeToString(const Rope rope, char *ret_buf, size_t buf_size);
 void RopeDump(const Rope rope);
 size_t RopeGetLen(const Rope rope);
+/* return the number of concat levels above the deepest leaf, 0 for a leaf */
+size_t RopeGetDepth(const Rope rope);
+/* return the memory used by rope, counting each shared node once */
 size_t RopeGetSize(const Rope rope);
+/* return the memory of the root node of rope alone, in O(1): all of it for a
+ * leaf */
+size_t RopeGetNodeSize(const Rope rope);
+
+#define ROPE_FLAT_CACHE_MIN_LEN 4096
+
+/* keep the bytes of ropes of at least min_len bytes flattened by
+ * RopeToString, and of the subtrees shared with other ropes flattened with
+ * them, up to budget bytes in all (0, the default, for none), the least
+ * recently used evicted first; RopeToString, RopeIndex and comparisons read
+ * a cached rope, or subtree, as one array */
+void RopeSetFlatCache(size_t budget, size_t min_len);
+/* return the bytes held by the flat cache */
+size_t RopeFlatCacheSize(void);
+
+#define ROPE_STATS_HIST_SIZE 40
+
+typedef struct {
+	size_t len;
+	size_t depth;
+	size_t n_nodes; /* distinct nodes, including leaves */
+	size_t n_leaves;
+	size_t n_compressed;   /* leaves stored LZ compressed */
+	size_t external_size;  /* bytes of leaves referring to external memory */
+	size_t size;           /* == RopeGetSize() */
+	size_t shared_size;    /* bytes of nodes reachable by several paths */
+	size_t exclusive_size; /* bytes of nodes only this rope refers to */
+	/* number of leaves whose len is in [2^i, 2^(i+1)), the first bucket
+	 * also counts empty leaves and the last one all larger leaves */
+	size_t leaf_hist[ROPE_STATS_HIST_SIZE];
+	size_t index_size; /* bytes of a RopeGramIndex, set by RopeIndexGetStats */
+} RopeStats;
+
+void RopeGetStats(const Rope rope, RopeStats *stats);
 
 Rope RopeConcat(const Rope left, const Rope right);
 Rope RopeSubstr(const Rope rope, size_t i, size_t n);
 Rope RopeDelete(const Rope rope, size_t i, size_t n);
 char RopeIndex(const Rope rope, size_t i);
+/* out[k] = the byte at positions[k] for each k; positions need not be sorted
+ * but are read fastest when they are */
+void RopeIndexMany(const Rope rope, const size_t *positions, size_t n,
+                   char *out);
+/* copy [starts[k], starts[k] + lens[k]) for each k into out one after
+ * another */
+void RopeGatherRanges(const Rope rope, const size_t *starts, const size_t *lens,
+                      size_t n, char *out);
+/* return rope repeated count times, without copying it */
+Rope RopeRepeat(const Rope rope, size_t count);
+/* return rope with str appended, consuming the caller's reference to rope;
+ * it is modified in place if nothing else refers to it */
+Rope RopeAppendInPlace(Rope rope, const char *str, size_t len);
+/* return rope with other appended, consuming the caller's reference to rope;
+ * the right spine of a rope nothing else refers to is extended in place, so
+ * that ropes appended one by one make a balanced tree */
+Rope RopeAppendRope(Rope rope, const Rope other);
+/* return rope with [i, i + n) replaced by str, consuming the caller's
+ * reference to rope; a run of small edits near each other to a rope owned by
+ * the caller alone is made in place (see RopeAppendInPlace) */
+Rope RopeSpliceInPlace(Rope rope, size_t i, size_t n, const char *str,
+                       size_t len);
+
+/* an append-only rope shared by threads: appends do not wait for each other
+ * unless they fill a chunk, and snapshots do not wait for appends */
+typedef struct rope_appender_tag *RopeAppender;
+
+RopeAppender RopeAppenderCreate(void);
+/* append str, which stays contiguous, whatever other threads append */
+void RopeAppenderAppend(RopeAppender app, const char *str, size_t len);
+/* return a rope of the bytes of the appends which have returned, unchanged
+ * by later appends, in O(log n) */
+Rope RopeAppenderSnapshot(RopeAppender app);
+/* no append may be running; snapshots stay valid */
+void RopeAppenderDestroy(RopeAppender app);
+
+/* return a rope of the bytes read from fd up to the end or max_bytes
+ * (SIZE_MAX for no limit), or NULL with errno set if read() fails */
+Rope RopeReadFd(int fd, size_t max_bytes);
+/* like RopeReadFd, but a read() or wait interrupted by a signal returns what
+ * has been read so far with *interrupted set, so that the caller can handle
+ * the signal and read the rest with another call */
+Rope RopeReadFdInterruptible(int fd, size_t max_bytes, bool *interrupted);
+
+/* reads fd on a thread of its own, so that leaves already read can be used
+ * while the rest is being read */
+typedef struct rope_reader_tag *RopeReader;
+
+/* return NULL if the thread cannot be started */
+RopeReader RopeReaderStart(int fd, size_t max_bytes);
+/* return the next leaf read, waiting for it, or NULL at the end or once
+ * RopeReaderInterrupt is called */
+Rope RopeReaderNext(RopeReader reader);
+/* make a RopeReaderNext waiting, or the next one to wait, return NULL; may
+ * be called from another thread */
+void RopeReaderInterrupt(RopeReader reader);
+/* return true if RopeReaderNext has returned every leaf */
+bool RopeReaderAtEnd(RopeReader reader);
+/* free reader with the leaves not taken, and return errno if read() failed
+ * or 0; a thread still blocked in read() frees its part when it returns */
+int RopeReaderFinish(RopeReader reader);
+
+#define ROPE_COMPACT_MIN_LEAF_LEN 4096
+#define ROPE_COMPACT_MAX_RATIO 75
+
+typedef struct {
+	size_t min_leaf_len; /* leaves shorter than this are left as they are */
+	int max_ratio;       /* keep a leaf compressed only if it shrinks to this % */
+} RopeCompactPolicy;
+
+/* return a rope whose large leaves are compressed (policy NULL for default) */
+Rope RopeCompact(const Rope rope, const RopeCompactPolicy *policy);
+/* release buffers used to decode compressed leaves on the calling thread,
+ * which are also released when it exits */
+void RopeDecodeCacheFlush(void);
+
+/* Instrumentation, counted only when built with -DROPE_INSTRUMENT (or
+ * -DROPE_INSTRUMENT_ALLOC for the allocation counters alone) */
+typedef enum {
+	ROPE_OP_CREATE,
+	ROPE_OP_CONCAT,
+	ROPE_OP_SUBSTR,
+	ROPE_OP_DELETE,
+	ROPE_OP_INDEX,
+	ROPE_OP_TO_STRING,
+	ROPE_OP_APPEND,
+	ROPE_OP_INDEX_MANY, /* RopeIndexMany and RopeGatherRanges */
+	ROPE_OP_SPLICE,
+	ROPE_OP_FIND_ALL,
+	ROPE_OP_FIND,
+	ROPE_N_OPS,
+} RopeOp;
+
+#define ROPE_INSTR_HIST_SIZE 40
+
+typedef struct {
+	size_t n_alloc, n_free, alloc_bytes;
+	size_t n_calls[ROPE_N_OPS];
+	size_t index_nodes_visited; /* nodes descended by RopeIndex(Many) */
+	size_t create_bytes;        /* bytes copied by RopeCreate */
+	size_t to_string_bytes;     /* bytes written by RopeToString */
+	/* number of calls which took [2^i, 2^(i+1)) ns */
+	size_t latency_hist[ROPE_N_OPS][ROPE_INSTR_HIST_SIZE];
+} RopeInstrStats;
+
+/* return false (and zeros) if instrumentation is not compiled in */
+bool RopeInstrSnapshot(RopeInstrStats *stats);
+void RopeInstrReset(void);
+const char *RopeInstrOpName(RopeOp op);
+
+/* rebalancing merges leaves shorter than this, into leaves up to MAX_LEAF */
+#define ROPE_REBALANCE_MIN_LEAF_LEN 64
+#define ROPE_REBALANCE_MAX_LEAF_LEN 1024
+
+/* return true if rope is much deeper than a balanced one, or is mostly of
+ * short leaves */
+bool RopeNeedsRebalance(const Rope rope);
+/* return a balanced rope of the same leaves with short ones merged */
+Rope RopeRebalance(const Rope rope);
+/* let each RopeConcat spend up to steps rotations and merges of short
+ * leaves on keeping its result balanced (0, the default, for none) */
+void RopeSetRebalanceSteps(size_t steps);
+
+#define ROPE_MAP_MAX_THREADS 64
+
+/* return rope with each byte b replaced by table[b]. Leaves and subtrees
+ * the table does not change are shared with rope. Large ropes are mapped
+ * by up to n_threads threads. */
+Rope RopeMapBytes(const Rope rope, const unsigned char table[256],
+                  int n_threads);
+/* RopeMapBytes converting the case of ASCII letters */
+Rope RopeUpcase(const Rope rope, int n_threads);
+Rope RopeDowncase(const Rope rope, int n_threads);
+
+/* return the length of the common prefix (suffix) of a and b, skipping
+ * subtrees they share without comparing bytes */
+size_t RopeCommonPrefix(const Rope a, const Rope b);
+size_t RopeCommonSuffix(const Rope a, const Rope b);
+
+/* a[a_pos, a_pos + a_len) is replaced by b[b_pos, b_pos + b_len) */
+typedef struct {
+	size_t a_pos, a_len;
+	size_t b_pos, b_len;
+} RopeDiffEdit;
+
+/* call func with the edits from a to b in order, which are not minimal:
+ * subtrees shared by a and b are kept, and the rest is compared bytewise
+ * only at the ends of each gap between them */
+void RopeDiff(const Rope a, const Rope b,
+              void (*func)(const RopeDiffEdit *edit, void *arg), void *arg);
+
+/* compiled patterns (Aho-Corasick automaton), read only once compiled, so
+ * one set can search any number of ropes on any number of threads */
+typedef struct rope_pattern_set_tag *RopePatternSet;
+
+typedef struct {
+	size_t pos;     /* of the first byte of the match */
+	size_t len;
+	size_t pattern; /* index given to RopePatternSetCompile */
+} RopeMatch;
+
+/* return NULL if a pattern is empty or the patterns are too long in total */
+RopePatternSet RopePatternSetCompile(const char *const *patterns,
+                                     const size_t *lens, size_t n);
+void RopePatternSetFree(RopePatternSet set);
+/* call func with every match of every pattern in rope, overlapping ones
+ * included, by end position and longest first for the same end, until func
+ * returns false; return the number of matches reported */
+size_t RopeFindAll(const RopePatternSet set, const Rope rope,
+                   bool (*func)(const RopeMatch *match, void *arg), void *arg);
+
+#define ROPE_INDEX_MIN_K 2
+#define ROPE_INDEX_MAX_K 8
+
+/* the positions of each k-gram of a rope, read only once built */
+typedef struct rope_gram_index_tag *RopeGramIndex;
+
+/* return NULL unless k is in [ROPE_INDEX_MIN_K, ROPE_INDEX_MAX_K]; the index
+ * keeps a reference to rope */
+RopeGramIndex RopeBuildIndex(const Rope rope, size_t k);
+/* return an index of rope, an edited version of the rope of old, sharing the
+ * part of old for the subtrees the ropes share */
+RopeGramIndex RopeRebuildIndex(const RopeGramIndex old, const Rope rope);
+void RopeIndexFree(RopeGramIndex index);
+/* RopeGetStats of the rope of index, with index_size */
+void RopeIndexGetStats(const RopeGramIndex index, RopeStats *stats);
+/* return the position of the first occurrence of pattern in rope at or after
+ * from, or -1; index, if it is an index of rope, is used for patterns of at
+ * least k bytes, and may be NULL */
+ssize_t RopeFind(const Rope rope, const char *pattern, size_t len, size_t from,
+                 const RopeGramIndex index);
 
 typedef struct rope_scan_leaf_tag *RopeScanLeaf;
 RopeScanLeaf RopeScanLeafInit(const Rope rope);
 char *RopeScanLeafGetNext(RopeScanLeaf scan);
+/* same as RopeScanLeafGetNext but without copying external leaves, and the
+ * result is not NUL terminated */
+const char *RopeScanLeafGetNextLen(RopeScanLeaf scan, size_t *len);
 void RopeScanLeafFini(RopeScanLeaf scan);
 
 typedef struct rope_scan_char_tag *RopeScanChar;
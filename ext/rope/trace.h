@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Binary trace of rope operations, recorded by the Ruby extension and
+ * replayed by bin/replay. Ropes are identified by ids assigned by the
+ * recorder; 0 is never used.
+ */
+
+typedef enum {
+	ROPE_TRACE_CREATE, /* id, len */
+	ROPE_TRACE_CONCAT, /* id, left, right */
+	ROPE_TRACE_SUBSTR, /* id, src, i, n */
+	ROPE_TRACE_DELETE, /* id, src, i, n */
+	ROPE_TRACE_INDEX,  /* src, i */
+	ROPE_TRACE_TO_S,   /* src */
+	ROPE_TRACE_FREE,   /* id */
+	ROPE_TRACE_APPEND, /* id, src, len (src is consumed) */
+	ROPE_TRACE_N_OPS,
+} RopeTraceOp;
+
+typedef struct {
+	RopeTraceOp op;
+	uint64_t args[4];
+} RopeTraceRecord;
+
+typedef struct rope_trace_tag *RopeTrace;
+
+/* return NULL if path cannot be opened (or is not a trace for reading) */
+RopeTrace RopeTraceOpenWrite(const char *path);
+RopeTrace RopeTraceOpenRead(const char *path);
+void RopeTraceClose(RopeTrace trace);
+
+void RopeTraceWrite(RopeTrace trace, const RopeTraceRecord *rec);
+/* return false at the end of trace, or if the trace is broken */
+bool RopeTraceRead(RopeTrace trace, RopeTraceRecord *rec);
+
+const char *RopeTraceOpName(RopeTraceOp op);
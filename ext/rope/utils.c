@@ -1,10 +1,14 @@
 #include "utils.h"
+#include "instr.h"
 #include <stddef.h>
 #include <stdlib.h>
 
 void *
 palloc(size_t size) {
 	void *ptr = malloc(size);
+
+	INSTR_ALLOC_ADD(n_alloc, 1);
+	INSTR_ALLOC_ADD(alloc_bytes, size);
 	if (!ptr)
 		elog("malloc failed");
 
@@ -15,5 +19,6 @@ void
 pfree(void *ptr) {
 	if (!ptr)
 		elog("free: empty ptr");
+	INSTR_ALLOC_ADD(n_free, 1);
 	free(ptr);
 }
@@ -0,0 +1,485 @@
+#include "rope.h"
+#include "utils.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Benchmark of the rope library against a flat char * baseline.
+ *
+ * usage: bench [max_size]
+ *
+ * Results are written to stdout as JSON, progress to stderr. Allocation
+ * counts need -DROPE_INSTRUMENT_ALLOC (rake bench sets it), and are null
+ * otherwise.
+ */
+
+#define CHUNK 64             /* leaf size of appended pieces */
+#define N_OPS (1 << 16)      /* repetition of index and substr */
+#define N_INSERTS 256        /* repetition of prepend and random insert */
+#define N_PATTERNS 256       /* keywords searched for by find_all */
+#define FLATTEN_BYTES (1 << 24)
+#define DEFAULT_MAX_SIZE ((size_t) 1 << 22)
+
+static char chunk[CHUNK + 1];
+static volatile char sink;
+static unsigned long long rand_state = 88172645463325252ull;
+static bool first_result = true;
+
+typedef struct {
+	struct timespec time;
+	size_t n_alloc;
+} bench_mark;
+
+static unsigned long long
+xorshift(void) {
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 7;
+	rand_state ^= rand_state << 17;
+	return rand_state;
+}
+
+static void
+mark(bench_mark *m) {
+	RopeInstrStats stats;
+
+	RopeInstrSnapshot(&stats);
+	m->n_alloc = stats.n_alloc;
+	clock_gettime(CLOCK_MONOTONIC, &m->time);
+}
+
+static void
+report(const char *op, const char *impl, size_t size, size_t ops,
+       const bench_mark *start) {
+	bench_mark end;
+	RopeInstrStats stats;
+	double ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &end.time);
+	ns = (end.time.tv_sec - start->time.tv_sec) * 1e9 +
+	     (end.time.tv_nsec - start->time.tv_nsec);
+
+	printf("%s\n    {\"op\": \"%s\", \"impl\": \"%s\", \"size\": %zu, "
+	       "\"ops\": %zu, \"ns_per_op\": %.2f, \"allocs_per_op\": ",
+	       first_result ? "" : ",", op, impl, size, ops, ns / ops);
+	first_result = false;
+
+	if (RopeInstrSnapshot(&stats))
+		printf("%.2f}", (double) (stats.n_alloc - start->n_alloc) / ops);
+	else
+		printf("null}");
+}
+
+/* rope is destroyed unless it is base, which the caller keeps using */
+static Rope
+append(Rope rope, Rope base) {
+	Rope leaf = RopeCreate(chunk, CHUNK), rv = RopeConcat(rope, leaf);
+
+	if (rope != base)
+		RopeDestroy(rope);
+	RopeDestroy(leaf);
+
+	return rv;
+}
+
+static Rope
+prepend(Rope rope, Rope base) {
+	Rope leaf = RopeCreate(chunk, CHUNK), rv = RopeConcat(leaf, rope);
+
+	if (rope != base)
+		RopeDestroy(rope);
+	RopeDestroy(leaf);
+
+	return rv;
+}
+
+/* return a rope of size bytes built by appending CHUNK bytes at a time */
+static Rope
+bench_append(size_t size, char **flat_ret) {
+	bench_mark m;
+	Rope rope, inplace;
+	char *flat = NULL;
+	size_t cap = 0, len = 0;
+
+	mark(&m);
+	rope = RopeCreate(chunk, CHUNK);
+	for (size_t n = CHUNK; n < size; n += CHUNK)
+		rope = append(rope, NULL);
+	report("append", "rope", size, size / CHUNK, &m);
+
+	mark(&m);
+	inplace = RopeCreate(chunk, CHUNK);
+	for (size_t n = CHUNK; n < size; n += CHUNK)
+		inplace = RopeAppendInPlace(inplace, chunk, CHUNK);
+	report("append", "rope_inplace", size, size / CHUNK, &m);
+	RopeDestroy(inplace);
+
+	mark(&m);
+	for (; len < size; len += CHUNK) {
+		if (len + CHUNK + 1 > cap) {
+			char *buf;
+
+			cap = cap ? cap * 2 : CHUNK + 1;
+			buf = palloc(cap);
+			if (flat) {
+				memcpy(buf, flat, len);
+				pfree(flat);
+			}
+			flat = buf;
+		}
+		memcpy(flat + len, chunk, CHUNK);
+	}
+	flat[len] = '\0';
+	report("append", "flat", size, size / CHUNK, &m);
+
+	*flat_ret = flat;
+	return rope;
+}
+
+static void
+bench_prepend(Rope rope, const char *flat, size_t size) {
+	bench_mark m;
+	Rope cur = rope;
+	char *buf = palloc(size + N_INSERTS * CHUNK + 1);
+	size_t len = size;
+
+	mark(&m);
+	for (int k = 0; k < N_INSERTS; k++)
+		cur = prepend(cur, rope);
+	report("prepend", "rope", size, N_INSERTS, &m);
+	RopeDestroy(cur);
+
+	memcpy(buf, flat, size);
+	mark(&m);
+	for (int k = 0; k < N_INSERTS; k++, len += CHUNK) {
+		memmove(buf + CHUNK, buf, len);
+		memcpy(buf, chunk, CHUNK);
+	}
+	report("prepend", "flat", size, N_INSERTS, &m);
+	pfree(buf);
+}
+
+static void
+bench_doubling(size_t size) {
+	bench_mark m;
+	Rope rope;
+	char *flat;
+	size_t ops = 0, len;
+
+	mark(&m);
+	rope = RopeCreate(chunk, CHUNK);
+	for (len = CHUNK; len < size; len *= 2, ops++) {
+		Rope doubled = RopeConcat(rope, rope);
+
+		RopeDestroy(rope);
+		rope = doubled;
+	}
+	report("doubling", "rope", size, ops ? ops : 1, &m);
+	RopeDestroy(rope);
+
+	mark(&m);
+	flat = palloc(CHUNK);
+	memcpy(flat, chunk, CHUNK);
+	for (len = CHUNK; len < size; len *= 2) {
+		char *buf = palloc(len * 2);
+
+		memcpy(buf, flat, len);
+		memcpy(buf + len, flat, len);
+		pfree(flat);
+		flat = buf;
+	}
+	report("doubling", "flat", size, ops ? ops : 1, &m);
+	pfree(flat);
+}
+
+static void
+bench_random_insert(Rope rope, const char *flat, size_t size) {
+	bench_mark m;
+	Rope cur = rope;
+	char *buf = palloc(size + N_INSERTS * CHUNK + 1);
+	size_t len = size;
+
+	mark(&m);
+	for (int k = 0; k < N_INSERTS; k++, len += CHUNK) {
+		size_t pos = xorshift() % (len + 1);
+		Rope l, r;
+
+		if (pos == 0 || pos == len) {
+			cur = pos ? append(cur, rope) : prepend(cur, rope);
+			continue;
+		}
+
+		l = append(RopeSubstr(cur, 0, pos), NULL);
+		r = RopeSubstr(cur, pos, len - pos);
+		if (cur != rope)
+			RopeDestroy(cur);
+		cur = RopeConcat(l, r);
+		RopeDestroy(l);
+		RopeDestroy(r);
+	}
+	report("random_insert", "rope", size, N_INSERTS, &m);
+	RopeDestroy(cur);
+
+	memcpy(buf, flat, size);
+	len = size;
+	mark(&m);
+	for (int k = 0; k < N_INSERTS; k++, len += CHUNK) {
+		size_t pos = xorshift() % (len + 1);
+
+		memmove(buf + pos + CHUNK, buf + pos, len - pos);
+		memcpy(buf + pos, chunk, CHUNK);
+	}
+	report("random_insert", "flat", size, N_INSERTS, &m);
+	pfree(buf);
+}
+
+/* single byte inserts at a cursor in the middle of a balanced rope */
+static void
+bench_typing(Rope base, const char *flat, size_t size) {
+	bench_mark m;
+	Rope rope = RopeRebalance(base), cur = rope, edited;
+	char *buf = palloc(size + N_OPS + 1);
+	size_t pos = size / 2;
+
+	mark(&m);
+	for (size_t k = 0; k < N_OPS; k++) {
+		Rope l = RopeSubstr(cur, 0, pos + k), r, leaf = RopeCreate(chunk, 1),
+		     lx = RopeConcat(l, leaf);
+
+		r = RopeSubstr(cur, pos + k, size - pos);
+		if (cur != rope)
+			RopeDestroy(cur);
+		cur = RopeConcat(lx, r);
+		RopeDestroy(l);
+		RopeDestroy(leaf);
+		RopeDestroy(lx);
+		RopeDestroy(r);
+	}
+	report("typing", "rope", size, N_OPS, &m);
+	RopeDestroy(cur);
+
+	edited = RopeSubstr(rope, 0, size);
+	mark(&m);
+	for (size_t k = 0; k < N_OPS; k++)
+		edited = RopeSpliceInPlace(edited, pos + k, 0, chunk, 1);
+	report("typing", "rope_inplace", size, N_OPS, &m);
+	RopeDestroy(edited);
+	RopeDestroy(rope);
+
+	memcpy(buf, flat, size);
+	mark(&m);
+	for (size_t k = 0; k < N_OPS; k++) {
+		memmove(buf + pos + k + 1, buf + pos + k, size - pos);
+		buf[pos + k] = chunk[0];
+	}
+	report("typing", "flat", size, N_OPS, &m);
+	pfree(buf);
+}
+
+static void
+bench_index(Rope rope, const char *flat, size_t size) {
+	bench_mark m;
+	char c = 0;
+
+	mark(&m);
+	for (size_t k = 0; k < N_OPS; k++)
+		c ^= RopeIndex(rope, k % size);
+	report("index_seq", "rope", size, N_OPS, &m);
+
+	mark(&m);
+	for (size_t k = 0; k < N_OPS; k++)
+		c ^= flat[k % size];
+	report("index_seq", "flat", size, N_OPS, &m);
+
+	mark(&m);
+	for (size_t k = 0; k < N_OPS; k++)
+		c ^= RopeIndex(rope, xorshift() % size);
+	report("index_random", "rope", size, N_OPS, &m);
+
+	mark(&m);
+	for (size_t k = 0; k < N_OPS; k++)
+		c ^= flat[xorshift() % size];
+	report("index_random", "flat", size, N_OPS, &m);
+
+	sink = c;
+}
+
+static void
+bench_substr(Rope rope, const char *flat, size_t size) {
+	bench_mark m;
+	size_t n = size < CHUNK ? size : CHUNK;
+
+	mark(&m);
+	for (size_t k = 0; k < N_OPS; k++) {
+		Rope sub = RopeSubstr(rope, xorshift() % (size - n + 1), n);
+
+		RopeDestroy(sub);
+	}
+	report("substr", "rope", size, N_OPS, &m);
+
+	mark(&m);
+	for (size_t k = 0; k < N_OPS; k++) {
+		char *sub = palloc(n + 1);
+
+		memcpy(sub, flat + xorshift() % (size - n + 1), n);
+		sub[n] = '\0';
+		sink = sub[0];
+		pfree(sub);
+	}
+	report("substr", "flat", size, N_OPS, &m);
+}
+
+static void
+bench_scan(Rope rope, const char *flat, size_t size) {
+	bench_mark m;
+	RopeScanChar scan;
+	char c = 0;
+
+	mark(&m);
+	scan = RopeScanCharInit(rope);
+	for (size_t k = 0; k < size; k++)
+		c ^= RopeScanCharGetNext(scan);
+	RopeScanCharFini(scan);
+	report("scan", "rope", size, size, &m);
+
+	mark(&m);
+	for (size_t k = 0; k < size; k++)
+		c ^= flat[k];
+	report("scan", "flat", size, size, &m);
+
+	sink = c;
+}
+
+static void
+bench_flatten(Rope rope, const char *flat, size_t size) {
+	bench_mark m;
+	size_t reps = size < FLATTEN_BYTES ? FLATTEN_BYTES / size : 1;
+	char *buf = palloc(size + 1);
+
+	mark(&m);
+	for (size_t k = 0; k < reps; k++)
+		RopeToString(rope, buf, size + 1);
+	report("flatten", "rope", size, reps, &m);
+
+	RopeSetFlatCache(size, 0);
+	mark(&m);
+	for (size_t k = 0; k < reps; k++)
+		RopeToString(rope, buf, size + 1);
+	report("flatten", "rope_cached", size, reps, &m);
+	RopeSetFlatCache(0, ROPE_FLAT_CACHE_MIN_LEN);
+
+	mark(&m);
+	for (size_t k = 0; k < reps; k++) {
+		memcpy(buf, flat, size);
+		buf[size] = '\0';
+	}
+	report("flatten", "flat", size, reps, &m);
+
+	pfree(buf);
+}
+
+static bool
+count_match(const RopeMatch *match, void *arg) {
+	(void) match;
+	(*(size_t *) arg)++;
+	return true;
+}
+
+/* N_PATTERNS keywords of 8 bytes, one of which occurs in every chunk */
+static void
+bench_find(Rope rope, const char *flat, size_t size) {
+	bench_mark m;
+	char keywords[N_PATTERNS][9];
+	const char *patterns[N_PATTERNS];
+	size_t lens[N_PATTERNS], n = 0;
+	RopePatternSet set;
+
+	for (int k = 0; k < N_PATTERNS; k++) {
+		for (int i = 0; i < 8; i++)
+			keywords[k][i] = 'a' + xorshift() % 26;
+		keywords[k][8] = '\0';
+		patterns[k] = keywords[k];
+		lens[k] = 8;
+	}
+	memcpy(keywords[0], chunk + 3, 8);
+	set = RopePatternSetCompile(patterns, lens, N_PATTERNS);
+
+	mark(&m);
+	RopeFindAll(set, rope, count_match, &n);
+	report("find_all", "rope", size, size, &m);
+	RopePatternSetFree(set);
+
+	mark(&m);
+	for (int k = 0; k < N_PATTERNS; k++)
+		for (const char *p = flat; (p = strstr(p, keywords[k])); p++)
+			n++;
+	report("find_all", "flat", size, size, &m);
+	sink = n;
+}
+
+/* drop a rope of size bytes built by appends, one node per CHUNK */
+static void
+bench_destroy(const char *flat, size_t size) {
+	bench_mark m;
+	Rope rope = RopeCreate(chunk, CHUNK);
+	char *buf;
+
+	for (size_t n = CHUNK; n < size; n += CHUNK)
+		rope = append(rope, NULL);
+	mark(&m);
+	RopeDestroy(rope);
+	report("destroy", "rope", size, 1, &m);
+
+	rope = RopeCreate(chunk, CHUNK);
+	for (size_t n = CHUNK; n < size; n += CHUNK)
+		rope = append(rope, NULL);
+	mark(&m);
+	RopeDestroyDeferred(rope);
+	report("destroy", "rope_deferred", size, 1, &m);
+	RopeReclaim(SIZE_MAX);
+
+	buf = palloc(size + 1);
+	memcpy(buf, flat, size + 1);
+	mark(&m);
+	pfree(buf);
+	report("destroy", "flat", size, 1, &m);
+}
+
+int
+main(int argc, char *argv[]) {
+	size_t max_size = argc > 1 ? strtoull(argv[1], NULL, 0) : DEFAULT_MAX_SIZE;
+
+	for (int i = 0; i < CHUNK; i++)
+		chunk[i] = 'a' + i % 26;
+
+	printf("{\n  \"chunk\": %d,\n  \"max_size\": %zu,\n  \"results\": [",
+	       CHUNK, max_size);
+
+	for (size_t size = CHUNK; size <= max_size; size *= 16) {
+		Rope rope;
+		char *flat;
+
+		fprintf(stderr, "size=%zu\n", size);
+
+		rope = bench_append(size, &flat);
+		bench_prepend(rope, flat, size);
+		bench_doubling(size);
+		bench_random_insert(rope, flat, size);
+		bench_typing(rope, flat, size);
+		bench_index(rope, flat, size);
+		bench_substr(rope, flat, size);
+		bench_scan(rope, flat, size);
+		bench_flatten(rope, flat, size);
+		bench_find(rope, flat, size);
+		bench_destroy(flat, size);
+
+		RopeDestroy(rope);
+		pfree(flat);
+	}
+
+	printf("\n  ]\n}\n");
+
+	return 0;
+}
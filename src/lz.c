@@ -0,0 +1,172 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * A small LZ77 codec in the spirit of LZ4.
+ *
+ * Compressed data is a sequence of
+ *   token, [literal length], literals, offset(2 bytes, LE), [match length]
+ * where the upper 4 bits of token is the number of literals and the lower 4
+ * bits is (match length - LZ_MIN_MATCH). A field holding 15 continues in the
+ * following bytes, each of which is added until a byte other than 255.
+ * The last sequence has literals only.
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+static unsigned
+lz_hash(const unsigned char *p) {
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static unsigned char *
+lz_put_len(unsigned char *op, unsigned char *oend, size_t n) {
+	for (; n >= 255; n -= 255) {
+		if (op >= oend)
+			return NULL;
+		*op++ = 255;
+	}
+	if (op >= oend)
+		return NULL;
+	*op++ = (unsigned char) n;
+
+	return op;
+}
+
+/* match_len == 0 means the last sequence */
+static unsigned char *
+lz_put_seq(unsigned char *op, unsigned char *oend, const unsigned char *lit,
+           size_t lit_len, size_t match_len, size_t offset) {
+	size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+	if (op >= oend)
+		return NULL;
+	*op++ = (unsigned char) (((lit_len < 15 ? lit_len : 15) << 4) |
+	                         (ml < 15 ? ml : 15));
+
+	if (lit_len >= 15 && !(op = lz_put_len(op, oend, lit_len - 15)))
+		return NULL;
+
+	if ((size_t)(oend - op) < lit_len)
+		return NULL;
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+
+	if (!match_len)
+		return op;
+
+	if (oend - op < 2)
+		return NULL;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+
+	if (ml >= 15 && !(op = lz_put_len(op, oend, ml - 15)))
+		return NULL;
+
+	return op;
+}
+
+size_t
+LzCompress(const char *src, size_t len, char *dst, size_t dst_size) {
+	const unsigned char *in = (const unsigned char *) src;
+	unsigned char *op = (unsigned char *) dst, *oend = op + dst_size;
+	size_t table[1 << LZ_HASH_BITS];
+	size_t anchor = 0, ip = 0;
+
+	memset(table, 0, sizeof(table));
+
+	while (ip + LZ_MIN_MATCH <= len) {
+		unsigned h = lz_hash(in + ip);
+		size_t cand = table[h], match_len;
+
+		table[h] = ip;
+
+		if (cand >= ip || ip - cand > LZ_MAX_OFFSET ||
+		    memcmp(in + cand, in + ip, LZ_MIN_MATCH) != 0) {
+			ip++;
+			continue;
+		}
+
+		match_len = LZ_MIN_MATCH;
+		while (ip + match_len < len && in[cand + match_len] == in[ip + match_len])
+			match_len++;
+
+		op = lz_put_seq(op, oend, in + anchor, ip - anchor, match_len, ip - cand);
+		if (!op)
+			return 0;
+
+		ip += match_len;
+		anchor = ip;
+	}
+
+	op = lz_put_seq(op, oend, in + anchor, len - anchor, 0, 0);
+	if (!op)
+		return 0;
+
+	return op - (unsigned char *) dst;
+}
+
+static const unsigned char *
+lz_get_len(const unsigned char *ip, const unsigned char *iend, size_t *n) {
+	unsigned char b;
+
+	do {
+		if (ip >= iend)
+			return NULL;
+		b = *ip++;
+		*n += b;
+	} while (b == 255);
+
+	return ip;
+}
+
+size_t
+LzDecompress(const char *src, size_t len, char *dst, size_t dst_size) {
+	const unsigned char *ip = (const unsigned char *) src, *iend = ip + len;
+	unsigned char *op = (unsigned char *) dst, *oend = op + dst_size;
+
+	while (ip < iend) {
+		unsigned token = *ip++;
+		size_t lit_len = token >> 4, match_len = token & 15, offset;
+
+		if (lit_len == 15 && !(ip = lz_get_len(ip, iend, &lit_len)))
+			return 0;
+		if ((size_t)(iend - ip) < lit_len || (size_t)(oend - op) < lit_len)
+			return 0;
+		memcpy(op, ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return 0;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		if (match_len == 15 && !(ip = lz_get_len(ip, iend, &match_len)))
+			return 0;
+		match_len += LZ_MIN_MATCH;
+
+		if (offset == 0 || offset > (size_t)(op - (unsigned char *) dst) ||
+		    (size_t)(oend - op) < match_len)
+			return 0;
+
+		if (offset >= match_len)
+			memcpy(op, op - offset, match_len);
+		else /* overlapping copy repeats the last offset bytes */
+			for (size_t k = 0; k < match_len; k++)
+				op[k] = op[k - offset];
+		op += match_len;
+	}
+
+	return op - (unsigned char *) dst;
+}
@@ -1,8 +1,16 @@
 #include "rope.h"
+#include "trace.h"
 #include "utils.h"
 #include <stdio.h>
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 char left[] = "test ", right[] = "desu.", left_right[] = "test desu.";
 
@@ -89,6 +97,57 @@ test_scan(void) {
 	RopeDestroy(moredeep);
 }
 
+/* a scan holding a reference reads on while the handle is reshaped, as the
+ * iterators of the extension do when their block calls compact! */
+static void
+test_scan_reshape(void) {
+	RopeCompactPolicy policy = {1000, ROPE_COMPACT_MAX_RATIO};
+	char expected[300], got[300], piece[12];
+	size_t len = 50;
+
+	memset(expected, 'a', len);
+	for (int i = 0; i < 20; i++) {
+		snprintf(piece, sizeof(piece), "b%02d\nb%02d\nb%02d", i, i, i);
+		memcpy(expected + len, piece, 10);
+		len += 10;
+	}
+
+	for (int compact = 0; compact < 2; compact++) {
+		Rope rope = RopeCreate(expected, 50), pin, next, part;
+		RopeScanLeaf scan;
+		const char *str;
+		size_t n, got_len = 0;
+		int leaves = 0;
+
+		for (size_t i = 50; i < len; i += 10) {
+			part = RopeCreate(expected + i, 10);
+			next = RopeConcat(rope, part);
+			RopeDestroy(part);
+			RopeDestroy(rope);
+			rope = next;
+		}
+
+		pin = RopeRef(rope);
+		scan = RopeScanLeafInit(pin);
+		while ((str = RopeScanLeafGetNextLen(scan, &n))) {
+			memcpy(got + got_len, str, n);
+			got_len += n;
+			if (++leaves == 5) {
+				next = compact ? RopeCompact(rope, &policy)
+				               : RopeRebalance(rope);
+				RopeDestroy(rope);
+				rope = next;
+			}
+		}
+		RopeScanLeafFini(scan);
+		RopeDestroy(pin);
+
+		assert(got_len == len && memcmp(got, expected, len) == 0);
+		assert(RopeGetLen(rope) == len);
+		RopeDestroy(rope);
+	}
+}
+
 static void
 test_substr(void) {
 	Rope lrope = RopeCreate(left, strlen(left)),
@@ -112,11 +171,1445 @@ test_substr(void) {
 	RopeDestroy(bsub);
 }
 
+/* index a compressed rope and exit without RopeDecodeCacheFlush, whose
+ * decode cache is freed with the thread (a leak under -fsanitize=address
+ * otherwise) */
+static void *
+test_compact_thread(void *compact) {
+	return (void *) (intptr_t) RopeIndex(compact, 12345);
+}
+
+static void
+test_compact(void) {
+	static char big[10000], buf[sizeof(big) * 2 + 1];
+	Rope lrope, concat, compact, sub;
+	RopeCompactPolicy policy = {1000, ROPE_COMPACT_MAX_RATIO};
+
+	for (size_t i = 0; i < sizeof(big); i++)
+		big[i] = "compress me "[i % 12] + (i / 1000);
+
+	lrope = RopeCreate(big, sizeof(big));
+	concat = RopeConcat(lrope, lrope);
+	compact = RopeCompact(concat, &policy);
+	elog("compact");
+	RopeDump(compact);
+
+	assert(RopeToString(compact, buf, sizeof(buf)) == (ssize_t) sizeof(big) * 2);
+	assert(memcmp(buf, big, sizeof(big)) == 0);
+	assert(memcmp(buf + sizeof(big), big, sizeof(big)) == 0);
+
+	for (size_t i = 0; i < sizeof(big) * 2; i += 7)
+		assert(RopeIndex(compact, i) == big[i % sizeof(big)]);
+
+	{
+		RopeScanLeaf scan = RopeScanLeafInit(compact);
+
+		assert(memcmp(RopeScanLeafGetNext(scan), big, sizeof(big)) == 0);
+		assert(memcmp(RopeScanLeafGetNext(scan), big, sizeof(big)) == 0);
+		assert(RopeScanLeafGetNext(scan) == NULL);
+		RopeScanLeafFini(scan);
+	}
+
+	{
+		pthread_t thread;
+		void *c;
+
+		assert(pthread_create(&thread, NULL, test_compact_thread, compact) == 0);
+		assert(pthread_join(thread, &c) == 0);
+		assert((char) (intptr_t) c == big[12345 % sizeof(big)]);
+	}
+
+	sub = RopeSubstr(compact, 9990, 20);
+	assert(RopeToString(sub, buf, sizeof(buf)) == 20);
+	assert(memcmp(buf, big + 9990, 10) == 0);
+	assert(memcmp(buf + 10, big, 10) == 0);
+
+	RopeDestroy(sub);
+	RopeDestroy(compact);
+	RopeDestroy(concat);
+	RopeDestroy(lrope);
+	RopeDecodeCacheFlush();
+}
+
+static void
+test_stats(void) {
+	Rope lrope = RopeCreate(left, strlen(left)),
+	     rrope = RopeCreate(right, strlen(right)),
+	     concat = RopeConcat(lrope, rrope), deep = RopeConcat(concat, concat);
+	RopeStats stats;
+
+	RopeGetStats(deep, &stats);
+
+	assert(stats.len == 2 * strlen(left_right));
+	assert(stats.n_nodes == 4);
+	assert(stats.n_leaves == 2);
+	assert(stats.depth == 2);
+	assert(stats.leaf_hist[2] == 2);
+	assert(stats.size == RopeGetSize(deep));
+	assert(stats.size == stats.shared_size + stats.exclusive_size);
+	assert(stats.size > RopeGetSize(concat));
+	assert(stats.shared_size >= RopeGetSize(concat));
+
+	RopeDestroy(lrope);
+	RopeDestroy(rrope);
+	RopeDestroy(concat);
+	RopeDestroy(deep);
+}
+
+static void
+test_instr(void) {
+	Rope lrope, rrope, concat;
+	RopeInstrStats stats;
+	char buf[100];
+
+	RopeInstrReset();
+	lrope = RopeCreate(left, strlen(left));
+	rrope = RopeCreate(right, strlen(right));
+	concat = RopeConcat(lrope, rrope);
+	assert(RopeIndex(concat, 7) == left_right[7]);
+	RopeToString(concat, buf, sizeof(buf));
+
+	if (!RopeInstrSnapshot(&stats)) {
+		elog("instrumentation is not compiled in");
+		assert(stats.n_calls[ROPE_OP_CREATE] == 0);
+	} else {
+		size_t n_index = 0;
+
+		assert(stats.n_calls[ROPE_OP_CREATE] == 2);
+		assert(stats.n_calls[ROPE_OP_CONCAT] == 1);
+		assert(stats.n_calls[ROPE_OP_INDEX] == 1);
+		assert(stats.index_nodes_visited == 2);
+		assert(stats.create_bytes == strlen(left_right));
+		assert(stats.to_string_bytes == strlen(left_right));
+		assert(stats.n_alloc == 3);
+
+		for (int i = 0; i < ROPE_INSTR_HIST_SIZE; i++)
+			n_index += stats.latency_hist[ROPE_OP_INDEX][i];
+		assert(n_index == 1);
+	}
+
+	RopeDestroy(lrope);
+	RopeDestroy(rrope);
+	RopeDestroy(concat);
+}
+
+static void
+test_trace(void) {
+	const char *path = "test_trace.tmp";
+	RopeTraceRecord recs[] = {
+	    {ROPE_TRACE_CREATE, {1, 5}},
+	    {ROPE_TRACE_CONCAT, {2, 1, 1}},
+	    {ROPE_TRACE_SUBSTR, {3, 2, 300, (uint64_t) 1 << 40}},
+	    {ROPE_TRACE_INDEX, {2, 7}},
+	    {ROPE_TRACE_FREE, {3}},
+	};
+	RopeTraceRecord rec;
+	RopeTrace trace = RopeTraceOpenWrite(path);
+
+	assert(trace);
+	for (size_t i = 0; i < sizeof(recs) / sizeof(recs[0]); i++)
+		RopeTraceWrite(trace, &recs[i]);
+	RopeTraceClose(trace);
+
+	trace = RopeTraceOpenRead(path);
+	assert(trace);
+	for (size_t i = 0; i < sizeof(recs) / sizeof(recs[0]); i++) {
+		assert(RopeTraceRead(trace, &rec));
+		assert(rec.op == recs[i].op);
+		assert(memcmp(rec.args, recs[i].args, sizeof(rec.args)) == 0);
+	}
+	assert(!RopeTraceRead(trace, &rec));
+	RopeTraceClose(trace);
+
+	remove(path);
+}
+
+static void
+test_append(void) {
+	static char expected[1000];
+	char buf[sizeof(expected)];
+	Rope rope = RopeCreate("", 0), shared, leaf;
+	size_t len = 0;
+	RopeStats stats;
+
+	for (int k = 0; len + 10 < sizeof(expected); k++) {
+		const char *piece = k % 3 ? left : right;
+
+		memcpy(expected + len, piece, strlen(piece));
+		len += strlen(piece);
+		rope = RopeAppendInPlace(rope, piece, strlen(piece));
+	}
+	assert(RopeToString(rope, buf, sizeof(buf)) == (ssize_t) len);
+	assert(memcmp(buf, expected, len) == 0);
+	RopeGetStats(rope, &stats);
+	assert(stats.n_leaves < 10 && stats.depth < 10);
+
+	/* a shared rope is not modified */
+	shared = RopeConcat(rope, NULL);
+	rope = RopeAppendInPlace(rope, "!", 1);
+	assert(RopeGetLen(shared) == len && RopeGetLen(rope) == len + 1);
+	assert(RopeIndex(rope, len) == '!');
+	RopeDestroy(shared);
+
+	/* nor is a leaf referred to by another rope */
+	leaf = RopeCreate(left, strlen(left));
+	shared = RopeSubstr(leaf, 0, strlen(left));
+	leaf = RopeAppendInPlace(leaf, right, strlen(right));
+	test_to_string(shared, left);
+	test_to_string(leaf, left_right);
+
+	RopeDestroy(shared);
+	RopeDestroy(leaf);
+	RopeDestroy(rope);
+}
+
+static void
+test_repeat(void) {
+	static char expected[5 * 1000 + 1], buf[sizeof(expected)];
+	Rope lrope = RopeCreate(left, strlen(left)),
+	     rrope = RopeCreate(right, strlen(right)),
+	     concat = RopeConcat(lrope, rrope), rep = RopeRepeat(lrope, 1000),
+	     rep2 = RopeRepeat(concat, 3), big, sub;
+	size_t len = strlen(left);
+
+	for (size_t i = 0; i < sizeof(expected) - 1; i++)
+		expected[i] = left[i % len];
+
+	assert(RopeGetLen(rep) == len * 1000);
+	assert(RopeToString(rep, buf, sizeof(buf)) == (ssize_t) (len * 1000));
+	assert(memcmp(buf, expected, len * 1000) == 0);
+	assert(RopeIndex(rep, 2003) == left[2003 % len]);
+	test_to_string(rep2, "test desu.test desu.test desu.");
+
+	for (size_t i = 0; i < 40; i += 3)
+		for (size_t n = 0; n < 60; n += 7) {
+			sub = RopeSubstr(rep, i, n);
+			assert(RopeToString(sub, buf, sizeof(buf)) == (ssize_t) n);
+			assert(memcmp(buf, expected + i, n) == 0);
+			RopeDestroy(sub);
+		}
+
+	{
+		RopeScanChar scan = RopeScanCharInit(rep2);
+
+		for (int i = 0; i < 30; i++)
+			assert(RopeScanCharGetNext(scan) == left_right[i % 10]);
+		assert(RopeScanCharGetNext(scan) == 0);
+		RopeScanCharFini(scan);
+	}
+
+	/* (x * a) * b is folded into one node */
+	big = RopeRepeat(rep, (size_t) 1 << 40);
+	assert(RopeGetLen(big) == (len * 1000) << 40);
+	assert(RopeIndex(big, RopeGetLen(big) - 1) == left[len - 1]);
+	sub = RopeSubstr(big, ((size_t) 1 << 41) + 3, 7);
+	test_to_string(sub, "test te");
+
+	RopeDestroy(sub);
+	RopeDestroy(big);
+	RopeDestroy(rep2);
+	RopeDestroy(rep);
+	RopeDestroy(concat);
+	RopeDestroy(rrope);
+	RopeDestroy(lrope);
+}
+
+/* a left deep chain of n leaves of left or right */
+static Rope
+test_chain(int n, char *expected) {
+	Rope rope = RopeCreate(left, strlen(left));
+
+	strcpy(expected, left);
+	for (int k = 1; k < n; k++) {
+		char *piece = k % 2 ? right : left;
+		Rope leaf = RopeCreate(piece, strlen(piece)), concat;
+
+		concat = RopeConcat(rope, leaf);
+		RopeDestroy(rope);
+		RopeDestroy(leaf);
+		rope = concat;
+		strcat(expected, piece);
+	}
+
+	return rope;
+}
+
+static void
+test_rebalance(void) {
+	static char expected[5 * 2000 + 1], buf[sizeof(expected)];
+	Rope chain = test_chain(2000, expected), balanced;
+	RopeStats stats;
+
+	assert(RopeNeedsRebalance(chain));
+	balanced = RopeRebalance(chain);
+	assert(!RopeNeedsRebalance(balanced));
+	assert(RopeToString(balanced, buf, sizeof(buf)) == 5 * 2000);
+	assert(strcmp(buf, expected) == 0);
+	RopeGetStats(balanced, &stats);
+	assert(stats.n_leaves == 10 && stats.depth <= 4);
+	RopeDestroy(balanced);
+	RopeDestroy(chain);
+
+	/* incremental: RopeConcat keeps the chain balanced as it grows */
+	RopeSetRebalanceSteps(8);
+	chain = test_chain(2000, expected);
+	RopeSetRebalanceSteps(0);
+	assert(!RopeNeedsRebalance(chain));
+	assert(RopeToString(chain, buf, sizeof(buf)) == 5 * 2000);
+	assert(strcmp(buf, expected) == 0);
+	for (size_t i = 0; i < 5 * 2000; i += 37)
+		assert(RopeIndex(chain, i) == expected[i]);
+	RopeDestroy(chain);
+}
+
+static void
+test_map(void) {
+	static char big[1 << 16];
+	unsigned char rot13[256];
+	char upper[] = "TEST ", mixed[] = "Mixed Case 123, and so ON!";
+	Rope urope = RopeCreate(upper, strlen(upper)),
+	     rrope = RopeCreate(right, strlen(right)),
+	     concat = RopeConcat(urope, rrope), mapped, rope = NULL;
+	RopeStats stats;
+
+	mapped = RopeUpcase(concat, 1);
+	test_to_string(mapped, "TEST DESU.");
+	/* "TEST " is not changed, and shared with concat */
+	RopeGetStats(mapped, &stats);
+	assert(stats.shared_size > 0 && stats.exclusive_size > 0);
+	RopeDestroy(mapped);
+
+	mapped = RopeDowncase(concat, 1);
+	test_to_string(mapped, left_right);
+	RopeDestroy(mapped);
+
+	RopeDestroy(concat);
+	concat = RopeCreate(mixed, strlen(mixed));
+	mapped = RopeUpcase(concat, 1);
+	test_to_string(mapped, "MIXED CASE 123, AND SO ON!");
+	RopeDestroy(mapped);
+	mapped = RopeDowncase(concat, 1);
+	test_to_string(mapped, "mixed case 123, and so on!");
+	RopeDestroy(mapped);
+
+	for (int c = 0; c < 256; c++)
+		rot13[c] = c >= 'a' && c <= 'z' ? 'a' + (c - 'a' + 13) % 26 : c;
+	mapped = RopeMapBytes(concat, rot13, 1);
+	test_to_string(mapped, "Mvkrq Cnfr 123, naq fb ON!");
+	RopeDestroy(mapped);
+
+	/* large enough to be mapped in parallel */
+	for (size_t i = 0; i < sizeof(big); i++)
+		big[i] = "abcXYZ \xff"[i % 8];
+	for (int k = 0; k < 32; k++) {
+		Rope leaf = RopeCreate(big, sizeof(big));
+
+		if (rope) {
+			Rope next = RopeConcat(rope, leaf);
+
+			RopeDestroy(rope);
+			RopeDestroy(leaf);
+			rope = next;
+		} else
+			rope = leaf;
+	}
+	mapped = RopeUpcase(rope, 4);
+	for (size_t i = 0; i < RopeGetLen(rope); i += 4093) {
+		char c = big[i % sizeof(big)];
+
+		assert(RopeIndex(mapped, i) == (c >= 'a' && c <= 'z' ? c - 32 : c));
+	}
+	RopeDestroy(mapped);
+	RopeDestroy(rope);
+
+	RopeDestroy(concat);
+	RopeDestroy(rrope);
+	RopeDestroy(urope);
+}
+
+static int n_released;
+
+static void
+test_release(void *owner) {
+	assert(strcmp(owner, "owner") == 0);
+	n_released++;
+}
+
+static void
+test_count_owner(void *owner, void *arg) {
+	(void) owner;
+	(*(int *) arg)++;
+}
+
+static void
+test_external(void) {
+	static char data[] = "borrowed\0bytes";
+	char buf[100];
+	const char *str;
+	void *owner;
+	int n_owners = 0;
+	Rope ext = RopeCreateExternal(data, sizeof(data) - 1, "owner", test_release),
+	     lrope = RopeCreate(left, strlen(left)),
+	     concat = RopeConcat(lrope, ext), sub = RopeSubstr(concat, 10, 9);
+	RopeStats stats;
+
+	elog("external");
+	RopeDump(concat);
+
+	assert(RopeGetExternal(ext, &str, &owner) && str == data);
+	assert(RopeGetExternal(sub, &str, &owner));
+	assert(str == data + 10 - strlen(left) && strcmp(owner, "owner") == 0);
+	assert(!RopeGetExternal(concat, &str, &owner));
+
+	assert(RopeToString(sub, buf, sizeof(buf)) == 9);
+	assert(memcmp(buf, data + 10 - strlen(left), 9) == 0);
+	assert(RopeIndex(concat, strlen(left) + 9) == 'b');
+
+	{
+		RopeScanChar scan = RopeScanCharInit(concat);
+
+		for (size_t i = 0; i < RopeGetLen(concat); i++)
+			assert(RopeScanCharGetNext(scan) ==
+			       (i < strlen(left) ? left[i] : data[i - strlen(left)]));
+		RopeScanCharFini(scan);
+	}
+
+	RopeEachExternal(concat, test_count_owner, &n_owners);
+	assert(n_owners == 1);
+	RopeGetStats(concat, &stats);
+	assert(stats.external_size == sizeof(data) - 1);
+
+	RopeDestroy(ext);
+	RopeDestroy(concat);
+	RopeDestroy(lrope);
+	assert(n_released == 0);
+	RopeDestroy(sub);
+	assert(n_released == 1);
+}
+
+struct test_patch {
+	Rope a, b, result;
+	size_t a_pos, n_edits, edit_len;
+};
+
+/* build b from a and the edits */
+static void
+test_apply_edit(const RopeDiffEdit *edit, void *arg) {
+	struct test_patch *patch = arg;
+	Rope kept = RopeSubstr(patch->a, patch->a_pos, edit->a_pos - patch->a_pos),
+	     added = RopeSubstr(patch->b, edit->b_pos, edit->b_len),
+	     result = RopeConcat(patch->result, kept);
+
+	RopeDestroy(patch->result);
+	patch->result = RopeConcat(result, added);
+	RopeDestroy(result);
+	RopeDestroy(kept);
+	RopeDestroy(added);
+
+	patch->a_pos = edit->a_pos + edit->a_len;
+	patch->n_edits++;
+	patch->edit_len += edit->a_len + edit->b_len;
+}
+
+static struct test_patch
+test_patch(Rope a, Rope b) {
+	struct test_patch patch = {a, b, RopeCreate((char *) "", 0), 0, 0, 0};
+	Rope rest, result;
+	size_t len = RopeGetLen(b);
+	char *expected = palloc(len + 1), *buf = palloc(len + 1);
+
+	RopeDiff(a, b, test_apply_edit, &patch);
+	rest = RopeSubstr(a, patch.a_pos, RopeGetLen(a) - patch.a_pos);
+	result = RopeConcat(patch.result, rest);
+	assert(RopeGetLen(result) == len);
+	RopeToString(b, expected, len + 1);
+	RopeToString(result, buf, len + 1);
+	assert(memcmp(buf, expected, len) == 0);
+
+	RopeDestroy(rest);
+	RopeDestroy(result);
+	RopeDestroy(patch.result);
+	pfree(expected);
+	pfree(buf);
+
+	return patch;
+}
+
+static void
+test_diff(void) {
+	char buf[64], x[] = "XYZ";
+	Rope a = NULL, b, c, d, l, r, ins = RopeCreate(x, strlen(x));
+	struct test_patch patch;
+
+	/* a document of 256 lines, each of which is a leaf */
+	for (int k = 0; k < 256; k++) {
+		Rope leaf, next;
+
+		snprintf(buf, sizeof(buf), "line %03d of the document\n", k);
+		leaf = RopeCreate(buf, strlen(buf));
+		next = a ? RopeConcat(a, leaf) : leaf;
+		if (a) {
+			RopeDestroy(a);
+			RopeDestroy(leaf);
+		}
+		a = next;
+	}
+
+	/* insert x in the middle, delete near the end */
+	l = RopeSubstr(a, 0, 3000);
+	r = RopeSubstr(a, 3000, RopeGetLen(a) - 3000);
+	c = RopeConcat(l, ins);
+	b = RopeConcat(c, r);
+	RopeDestroy(l);
+	RopeDestroy(r);
+	RopeDestroy(c);
+	c = RopeDelete(b, 6000, 10);
+
+	assert(RopeCommonPrefix(a, b) == 3000);
+	assert(RopeCommonSuffix(a, b) == RopeGetLen(a) - 3000);
+	assert(RopeCommonPrefix(a, a) == RopeGetLen(a));
+	assert(RopeCommonSuffix(b, c) == RopeGetLen(c) - 6000);
+
+	patch = test_patch(a, b);
+	assert(patch.n_edits == 1 && patch.edit_len == 3);
+	patch = test_patch(a, c);
+	assert(patch.n_edits == 2 && patch.edit_len == 13);
+	patch = test_patch(c, a);
+	assert(patch.n_edits == 2 && patch.edit_len == 13);
+	patch = test_patch(a, ins);
+	patch = test_patch(ins, a);
+	patch = test_patch(a, a);
+	assert(patch.n_edits == 0);
+
+	/* equal contents of different shapes, and repeats */
+	d = RopeRepeat(ins, 100);
+	RopeDestroy(b);
+	b = RopeCreate(buf, snprintf(buf, sizeof(buf), "%s%s%s", x, x, x));
+	assert(RopeCommonPrefix(d, b) == 9);
+	assert(RopeCommonSuffix(b, d) == 9);
+	patch = test_patch(d, b);
+	assert(patch.edit_len == 291);
+	RopeDestroy(b);
+	b = RopeRepeat(ins, 101);
+	assert(RopeCommonPrefix(d, b) == 300);
+	patch = test_patch(b, d);
+	assert(patch.n_edits == 1 && patch.edit_len == 3);
+
+	RopeDestroy(a);
+	RopeDestroy(b);
+	RopeDestroy(c);
+	RopeDestroy(d);
+	RopeDestroy(ins);
+}
+
+static void
+test_index_many(void) {
+	char buf[64], out[256], expected[256];
+	size_t positions[256], lens[4] = {30, 0, 1, 100}, starts[4];
+	Rope a = NULL, rep;
+
+	for (int k = 0; k < 64; k++) {
+		Rope leaf, next;
+
+		snprintf(buf, sizeof(buf), "leaf %02d, ", k);
+		leaf = RopeCreate(buf, strlen(buf));
+		next = a ? RopeConcat(a, leaf) : leaf;
+		if (a) {
+			RopeDestroy(a);
+			RopeDestroy(leaf);
+		}
+		a = next;
+	}
+	rep = RopeRepeat(a, 3);
+
+	/* unsorted, with duplicates */
+	for (size_t k = 0; k < 256; k++)
+		positions[k] = (k * 7919) % RopeGetLen(rep);
+	positions[255] = positions[0];
+	RopeIndexMany(rep, positions, 256, out);
+	for (size_t k = 0; k < 256; k++)
+		assert(out[k] == RopeIndex(rep, positions[k]));
+
+	/* ranges across leaves and repetitions */
+	starts[0] = RopeGetLen(a) - 15;
+	starts[1] = 5;
+	starts[2] = 3;
+	starts[3] = 2 * RopeGetLen(a) - 50;
+	RopeGatherRanges(rep, starts, lens, 4, out);
+	for (size_t k = 0, n = 0; k < 4; k++)
+		for (size_t i = 0; i < lens[k]; i++)
+			expected[n++] = RopeIndex(rep, starts[k] + i);
+	assert(memcmp(out, expected, 131) == 0);
+
+	RopeDestroy(rep);
+	RopeDestroy(a);
+}
+
+struct test_matches {
+	RopeMatch matches[64];
+	size_t n, max;
+};
+
+static bool
+test_add_match(const RopeMatch *match, void *arg) {
+	struct test_matches *m = arg;
+
+	if (m->n < sizeof(m->matches) / sizeof(m->matches[0]))
+		m->matches[m->n] = *match;
+	return ++m->n < m->max;
+}
+
+static void
+test_find_all(void) {
+	const char *patterns[] = {"he", "she", "his", "hers", "she", "aab", "ba"};
+	size_t lens[7], n_expected = 0;
+	static char flat[3 * 40 + 1];
+	struct test_matches m = {.max = SIZE_MAX};
+	Rope us = RopeCreate("us", 2), he = RopeCreate("he", 2),
+	     rs = RopeCreate("rs", 2), ushe = RopeConcat(us, he),
+	     ushers = RopeConcat(ushe, rs), ab = NULL, rep;
+	RopePatternSet set;
+
+	for (int k = 0; k < 7; k++)
+		lens[k] = strlen(patterns[k]);
+	set = RopePatternSetCompile(patterns, lens, 7);
+
+	/* by end, longest first; the leaves are split inside every match */
+	assert(RopeFindAll(set, ushers, test_add_match, &m) == 4);
+	assert(m.matches[0].pos == 1 && m.matches[0].pattern == 1);
+	assert(m.matches[1].pos == 1 && m.matches[1].pattern == 4);
+	assert(m.matches[2].pos == 2 && m.matches[2].pattern == 0);
+	assert(m.matches[3].pos == 2 && m.matches[3].pattern == 3 &&
+	       m.matches[3].len == 4);
+
+	m.n = 0;
+	m.max = 2;
+	assert(RopeFindAll(set, ushers, test_add_match, &m) == 2);
+
+	/* against a naive search, over leaves and repetitions */
+	for (int k = 0; k < 40; k++) {
+		Rope leaf = RopeCreate(k % 3 ? "a" : "b", 1), next;
+
+		next = ab ? RopeConcat(ab, leaf) : RopeRef(leaf);
+		if (ab)
+			RopeDestroy(ab);
+		RopeDestroy(leaf);
+		ab = next;
+	}
+	rep = RopeRepeat(ab, 3);
+	RopeToString(rep, flat, sizeof(flat));
+	for (size_t i = 0; i < sizeof(flat) - 1; i++)
+		for (int k = 0; k < 7; k++)
+			if (i + lens[k] < sizeof(flat) &&
+			    memcmp(flat + i, patterns[k], lens[k]) == 0)
+				n_expected++;
+	m.n = 0;
+	m.max = SIZE_MAX;
+	assert(RopeFindAll(set, rep, test_add_match, &m) == n_expected);
+	for (size_t k = 0; k < m.n && k < 64; k++) {
+		const RopeMatch *match = &m.matches[k];
+
+		assert(memcmp(flat + match->pos, patterns[match->pattern],
+		              match->len) == 0);
+		assert(k == 0 || match->pos + match->len >=
+		                     m.matches[k - 1].pos + m.matches[k - 1].len);
+	}
+
+	lens[0] = 0;
+	assert(!RopePatternSetCompile(patterns, lens, 7));
+
+	RopePatternSetFree(set);
+	RopeDestroy(rep);
+	RopeDestroy(ab);
+	RopeDestroy(ushers);
+	RopeDestroy(ushe);
+	RopeDestroy(rs);
+	RopeDestroy(he);
+	RopeDestroy(us);
+}
+
+/* check rope against flat through RopeIndex, RopeScanChar and RopeToString */
+static void
+test_same(Rope rope, const char *flat, size_t len) {
+	char buf[1024];
+	RopeScanChar scan;
+
+	assert(RopeGetLen(rope) == len && len < sizeof(buf));
+	for (size_t i = 0; i < len; i++)
+		assert(RopeIndex(rope, i) == flat[i]);
+	scan = RopeScanCharInit(rope);
+	for (size_t i = 0; i < len; i++)
+		assert(RopeScanCharGetNext(scan) == flat[i]);
+	RopeScanCharFini(scan);
+	RopeToString(rope, buf, sizeof(buf));
+	assert(memcmp(buf, flat, len) == 0 && buf[len] == '\0');
+}
+
+static void
+test_splice(void) {
+	char flat[1024], *text = "the quick brown fox jumps over the lazy dog";
+	size_t len = strlen(text), cursor = 10;
+	Rope rope = NULL, shared, prev;
+
+	for (size_t i = 0; i < len; i += 8) {
+		Rope leaf = RopeCreate(text + i, len - i < 8 ? len - i : 8), next;
+
+		next = rope ? RopeConcat(rope, leaf) : leaf;
+		if (rope) {
+			RopeDestroy(rope);
+			RopeDestroy(leaf);
+		}
+		rope = next;
+	}
+	memcpy(flat, text, len);
+
+	/* typing and backspacing at a cursor */
+	for (int k = 0; k < 200; k++) {
+		if (k % 5 == 4) {
+			rope = RopeSpliceInPlace(rope, cursor - 1, 1, "", 0);
+			memmove(flat + cursor - 1, flat + cursor, len - cursor);
+			cursor--;
+			len--;
+		} else {
+			char c = 'A' + k % 26;
+
+			prev = rope;
+			rope = RopeSpliceInPlace(rope, cursor, 0, &c, 1);
+			/* rebuilt once, then edited in place */
+			assert(k < 2 || rope == prev);
+			memmove(flat + cursor + 1, flat + cursor, len - cursor);
+			flat[cursor++] = c;
+			len++;
+		}
+		if (k % 50 == 0)
+			test_same(rope, flat, len);
+	}
+	test_same(rope, flat, len);
+
+	/* a shared rope is not changed */
+	shared = RopeConcat(rope, rope);
+	rope = RopeSpliceInPlace(rope, 3, 5, "XY", 2);
+	memcpy(flat + len, flat, len);
+	test_same(shared, flat, 2 * len);
+	memmove(flat + 5, flat + 8, len - 8);
+	memcpy(flat + 3, "XY", 2);
+	len -= 3;
+	test_same(rope, flat, len);
+
+	/* across leaves, and at both ends */
+	rope = RopeSpliceInPlace(rope, 0, len, "abc", 3);
+	test_same(rope, "abc", 3);
+	rope = RopeSpliceInPlace(rope, 3, 0, "def", 3);
+	rope = RopeSpliceInPlace(rope, 0, 0, "_", 1);
+	test_same(rope, "_abcdef", 7);
+
+	RopeDestroy(shared);
+	RopeDestroy(rope);
+}
+
+static void
+test_read(void) {
+	static char data[200000];
+	FILE *file = tmpfile();
+	int fd = fileno(file), fds[2];
+	Rope rope, leaf;
+	RopeReader reader;
+	size_t n_leaves;
+
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = 'a' + (i * 7) % 26;
+	assert(fwrite(data, 1, sizeof(data), file) == sizeof(data));
+	fflush(file);
+
+	lseek(fd, 0, SEEK_SET);
+	rope = RopeReadFd(fd, SIZE_MAX);
+	assert(RopeGetLen(rope) == sizeof(data));
+	for (size_t i = 0; i < sizeof(data); i += 997)
+		assert(RopeIndex(rope, i) == data[i]);
+	RopeDestroy(rope);
+
+	lseek(fd, 0, SEEK_SET);
+	rope = RopeReadFd(fd, 10000);
+	assert(RopeGetLen(rope) == 10000 && RopeIndex(rope, 9999) == data[9999]);
+	RopeDestroy(rope);
+
+	/* leaves are taken while the rest is read */
+	lseek(fd, 0, SEEK_SET);
+	reader = RopeReaderStart(fd, SIZE_MAX);
+	rope = RopeCreate((char *) "", 0);
+	while ((leaf = RopeReaderNext(reader))) {
+		rope = RopeAppendRope(rope, leaf);
+		RopeDestroy(leaf);
+	}
+	assert(RopeReaderFinish(reader) == 0);
+	assert(RopeGetLen(rope) == sizeof(data));
+	for (size_t i = 0; i < sizeof(data); i += 991)
+		assert(RopeIndex(rope, i) == data[i]);
+	RopeDestroy(rope);
+
+	/* leaves appended one by one make a balanced tree */
+	for (int k = 0; k < 64; k++)
+		assert(fwrite(data, 1, sizeof(data), file) == sizeof(data));
+	fflush(file);
+	lseek(fd, 0, SEEK_SET);
+	reader = RopeReaderStart(fd, SIZE_MAX);
+	rope = RopeCreate((char *) "", 0);
+	n_leaves = 0;
+	while ((leaf = RopeReaderNext(reader))) {
+		/* taken by the caller too, as Rope.read yields them */
+		rope = RopeAppendRope(rope, leaf);
+		RopeDestroy(leaf);
+		n_leaves++;
+	}
+	assert(RopeReaderFinish(reader) == 0);
+	assert(RopeGetLen(rope) == sizeof(data) * 65);
+	assert(n_leaves > 150);
+	assert(RopeGetDepth(rope) <= 2 * 8 + 1);
+	for (size_t i = 0; i < sizeof(data) * 65; i += 99991)
+		assert(RopeIndex(rope, i) == data[i % sizeof(data)]);
+	RopeDestroy(rope);
+	fclose(file);
+
+	/* short reads from a pipe, and an empty input */
+	assert(pipe(fds) == 0);
+	assert(write(fds[1], "te", 2) == 2 && write(fds[1], "st", 2) == 2);
+	close(fds[1]);
+	rope = RopeReadFd(fds[0], SIZE_MAX);
+	test_to_string(rope, "test");
+	RopeDestroy(rope);
+	rope = RopeReadFd(fds[0], SIZE_MAX);
+	assert(RopeGetLen(rope) == 0);
+	RopeDestroy(rope);
+	close(fds[0]);
+
+	assert(!RopeReadFd(-1, SIZE_MAX) && errno == EBADF);
+}
+
+static void
+test_on_signal(int sig) {
+	(void) sig;
+}
+
+struct test_interrupter {
+	pthread_t target;
+	atomic_bool done;
+};
+
+/* signal target until it is done, so that a signal sent before it blocks
+ * is not the only one */
+static void *
+test_interrupter_main(void *arg) {
+	struct test_interrupter *intr = arg;
+
+	while (!atomic_load(&intr->done)) {
+		usleep(10000);
+		pthread_kill(intr->target, SIGUSR1);
+	}
+
+	return NULL;
+}
+
+static void
+test_read_interrupt(void) {
+	struct sigaction sa, old_sa;
+	struct test_interrupter intr;
+	pthread_t thread;
+	RopeReader reader;
+	Rope rope, leaf;
+	bool interrupted;
+	int fds[2];
+
+	/* no SA_RESTART: read() fails with EINTR */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = test_on_signal;
+	sigemptyset(&sa.sa_mask);
+	assert(sigaction(SIGUSR1, &sa, &old_sa) == 0);
+
+	/* what has been read is returned, and the rest by the next call */
+	assert(pipe(fds) == 0);
+	assert(write(fds[1], "te", 2) == 2);
+	intr.target = pthread_self();
+	atomic_init(&intr.done, false);
+	assert(pthread_create(&thread, NULL, test_interrupter_main, &intr) == 0);
+	rope = RopeReadFdInterruptible(fds[0], SIZE_MAX, &interrupted);
+	atomic_store(&intr.done, true);
+	pthread_join(thread, NULL);
+	assert(interrupted);
+	test_to_string(rope, "te");
+	RopeDestroy(rope);
+	assert(write(fds[1], "st", 2) == 2);
+	close(fds[1]);
+	rope = RopeReadFdInterruptible(fds[0], SIZE_MAX, &interrupted);
+	assert(!interrupted);
+	test_to_string(rope, "st");
+	RopeDestroy(rope);
+	close(fds[0]);
+
+	/* a reader interrupted before the end is not at the end */
+	assert(pipe(fds) == 0);
+	reader = RopeReaderStart(fds[0], SIZE_MAX);
+	RopeReaderInterrupt(reader);
+	assert(!RopeReaderNext(reader));
+	assert(!RopeReaderAtEnd(reader));
+	assert(write(fds[1], "test", 4) == 4);
+	close(fds[1]);
+	leaf = RopeReaderNext(reader);
+	test_to_string(leaf, "test");
+	RopeDestroy(leaf);
+	assert(!RopeReaderNext(reader));
+	assert(RopeReaderAtEnd(reader));
+	assert(RopeReaderFinish(reader) == 0);
+	close(fds[0]);
+
+	assert(sigaction(SIGUSR1, &old_sa, NULL) == 0);
+}
+
+/* positions past 4GB, on repeated content so nothing is flattened */
+static void
+test_large(void) {
+	const size_t n = (size_t) 600 * 1000 * 1000, big_len = n * 10;
+	const size_t positions[] = {(size_t) 1 << 32, ((size_t) 1 << 32) + 7, 3,
+	                            big_len + 2};
+	Rope leaf = RopeCreate(left_right, 10), tail = RopeCreate(right, 5),
+	     big = RopeRepeat(leaf, n), rope = RopeConcat(big, tail), sub;
+	char out[4], buf[1];
+
+	assert(RopeGetLen(rope) == big_len + 5);
+	assert(RopeIndex(rope, big_len - 1) == '.');
+	assert(RopeIndex(rope, big_len + 1) == 'e');
+	assert(RopeIndex(rope, ((size_t) 1 << 32) + 5) == left_right[1]);
+	assert(RopeToString(rope, buf, sizeof(buf)) < 0);
+	assert(RopeToString(tail, buf, 0) < 0);
+
+	RopeIndexMany(rope, positions, 4, out);
+	assert(memcmp(out, "etts", 4) == 0);
+
+	sub = RopeSubstr(rope, ((size_t) 1 << 32) - 6, 20);
+	test_to_string(sub, "test desu.test desu.");
+	RopeDestroy(sub);
+	sub = RopeSubstr(rope, big_len - 5, 10);
+	test_to_string(sub, "desu.desu.");
+	RopeDestroy(sub);
+
+	/* deleting either end keeps the other */
+	sub = RopeDelete(rope, 0, big_len);
+	test_to_string(sub, "desu.");
+	RopeDestroy(sub);
+	sub = RopeDelete(rope, big_len, 5);
+	assert(RopeGetLen(sub) == big_len);
+	assert(RopeIndex(sub, big_len - 10) == 't');
+	RopeDestroy(sub);
+	sub = RopeDelete(rope, (size_t) 1 << 32, big_len - ((size_t) 1 << 32));
+	assert(RopeGetLen(sub) == ((size_t) 1 << 32) + 5);
+	assert(RopeIndex(sub, ((size_t) 1 << 32) - 1) == left_right[5]);
+	assert(RopeIndex(sub, ((size_t) 1 << 32)) == 'd');
+	RopeDestroy(sub);
+
+	RopeDestroy(rope);
+	RopeDestroy(big);
+	RopeDestroy(tail);
+	RopeDestroy(leaf);
+}
+
+/* a chain of n concat nodes over leaf, one level per node */
+static Rope
+test_deep_chain(Rope leaf, size_t n) {
+	Rope rope = RopeRef(leaf), next;
+
+	for (size_t k = 0; k < n; k++) {
+		next = RopeConcat(rope, leaf);
+		RopeDestroy(rope);
+		rope = next;
+	}
+
+	return rope;
+}
+
+/* stats of a rope too deep to walk by recursion */
+static void
+test_stats_deep(void) {
+	Rope leaf = RopeCreate(left_right, 10),
+	     rope = test_deep_chain(leaf, 1000 * 1000);
+	RopeStats stats;
+
+	RopeGetStats(rope, &stats);
+	assert(stats.len == 10 * (1000 * 1000 + 1));
+	assert(stats.n_leaves == 1);
+	assert(stats.depth == 1000 * 1000);
+	assert(stats.size == RopeGetSize(rope));
+	assert(RopeGetNodeSize(rope) < stats.size);
+	assert(RopeGetNodeSize(leaf) == RopeGetSize(leaf));
+
+	RopeDestroy(rope);
+	RopeDestroy(leaf);
+}
+
+static void
+test_destroy(void) {
+	Rope leaf = RopeCreate(left, strlen(left)), ext, rope;
+	int released = n_released;
+
+	/* deeper than the stack would allow a recursive free */
+	RopeDestroy(test_deep_chain(leaf, 1000 * 1000));
+
+	/* bounded batches, leaving the shared leaf alone */
+	rope = test_deep_chain(leaf, 1000);
+	RopeDestroyDeferred(rope);
+	assert(RopeReclaimPending() == 1);
+	assert(RopeReclaim(10) == 10);
+	assert(RopeReclaimPending() == 1);
+	assert(RopeReclaim(SIZE_MAX) == 990);
+	assert(RopeReclaimPending() == 0 && RopeReclaim(SIZE_MAX) == 0);
+	test_to_string(leaf, left);
+
+	/* a rope still referred to is not queued */
+	rope = RopeRef(leaf);
+	RopeDestroyDeferred(rope);
+	assert(RopeReclaimPending() == 0);
+
+	/* the thread drains the queue, calling release functions */
+	assert(RopeReclaimThreadStart(64));
+	assert(!RopeReclaimThreadStart(64));
+	ext = RopeCreateExternal("owner", 5, "owner", test_release);
+	rope = RopeConcat(leaf, ext);
+	RopeDestroy(ext);
+	RopeDestroyDeferred(rope);
+	for (int k = 0; k < 100; k++)
+		RopeDestroyDeferred(test_deep_chain(leaf, 1000));
+	RopeReclaimThreadStop();
+	assert(RopeReclaimPending() == 0);
+	assert(n_released == released + 1);
+	test_to_string(leaf, left);
+
+	RopeDestroy(leaf);
+}
+
+#define TEST_APPEND_THREADS 8
+#define TEST_APPEND_LINES 20000
+#define TEST_APPEND_BIG (100 * 1000)
+
+struct test_appender_arg {
+	RopeAppender app;
+	int id;
+};
+
+static void *
+test_appender_thread(void *p) {
+	struct test_appender_arg *arg = p;
+	char line[16], *big;
+
+	for (int k = 0; k < TEST_APPEND_LINES; k++) {
+		snprintf(line, sizeof(line), "t%d-%05d\n", arg->id, k);
+		RopeAppenderAppend(arg->app, line, strlen(line));
+		if (arg->id == 0 && k == TEST_APPEND_LINES / 2) {
+			/* larger than a chunk */
+			big = palloc(TEST_APPEND_BIG);
+			memset(big, 'x', TEST_APPEND_BIG - 1);
+			big[TEST_APPEND_BIG - 1] = '\n';
+			RopeAppenderAppend(arg->app, big, TEST_APPEND_BIG);
+			pfree(big);
+		}
+	}
+
+	return NULL;
+}
+
+static void
+test_appender(void) {
+	RopeAppender app = RopeAppenderCreate();
+	struct test_appender_arg args[TEST_APPEND_THREADS];
+	pthread_t threads[TEST_APPEND_THREADS];
+	int next[TEST_APPEND_THREADS] = {0}, id, k, n_big = 0, n_owners = 0;
+	size_t len, last_len = 0, total;
+	Rope rope, first = NULL;
+	const char *str;
+	void *owner;
+	char *buf, *line, *end;
+
+	rope = RopeAppenderSnapshot(app);
+	assert(RopeGetLen(rope) == 0);
+	RopeDestroy(rope);
+
+	for (int t = 0; t < TEST_APPEND_THREADS; t++) {
+		args[t].app = app;
+		args[t].id = t;
+		assert(pthread_create(&threads[t], NULL, test_appender_thread,
+		                      &args[t]) == 0);
+	}
+
+	/* snapshots grow, end at a line and do not change */
+	for (int n = 0; n < 200; n++) {
+		rope = RopeAppenderSnapshot(app);
+		len = RopeGetLen(rope);
+		assert(len >= last_len);
+		assert(len == 0 || RopeIndex(rope, len - 1) == '\n');
+		last_len = len;
+		if (!first && len > 0)
+			first = rope;
+		else
+			RopeDestroy(rope);
+	}
+
+	for (int t = 0; t < TEST_APPEND_THREADS; t++)
+		pthread_join(threads[t], NULL);
+
+	rope = RopeAppenderSnapshot(app);
+	RopeAppenderDestroy(app);
+	total = TEST_APPEND_THREADS * TEST_APPEND_LINES * 9 + TEST_APPEND_BIG;
+	assert(RopeGetLen(rope) == total);
+
+	/* each thread's lines are whole and in order */
+	buf = palloc(total + 1);
+	assert(RopeToString(rope, buf, total + 1) == (ssize_t) total);
+	for (line = buf; line < buf + total; line = end + 1) {
+		end = strchr(line, '\n');
+		if (line[0] == 'x') {
+			assert(end - line == TEST_APPEND_BIG - 1);
+			n_big++;
+			continue;
+		}
+		assert(end - line == 8 && sscanf(line, "t%d-%d", &id, &k) == 2);
+		assert(id >= 0 && id < TEST_APPEND_THREADS && k == next[id]++);
+	}
+	for (int t = 0; t < TEST_APPEND_THREADS; t++)
+		assert(next[t] == TEST_APPEND_LINES);
+	assert(n_big == 1);
+
+	/* the first snapshot is a prefix of the last */
+	if (first) {
+		len = RopeGetLen(first);
+		assert(RopeCommonPrefix(first, rope) == len);
+		assert(RopeIndex(first, len - 1) == '\n');
+		RopeDestroy(first);
+	}
+
+	/* the chunks are not external to the caller */
+	RopeEachExternal(rope, test_count_owner, &n_owners);
+	assert(n_owners == 0);
+	first = RopeSubstr(rope, total - 5, 5);
+	assert(!RopeGetExternal(first, &str, &owner));
+	RopeDestroy(first);
+	RopeDestroy(rope);
+	pfree(buf);
+}
+
+static void
+test_flat_cache(void) {
+	char buf[400], expected[400];
+	Rope leaf = RopeCreate(left_right, 10), rope = test_deep_chain(leaf, 19),
+	     flat, outer, owned = RopeCreate("", 0);
+	size_t len = 0;
+
+	for (int k = 0; k < 20; k++)
+		memcpy(expected + k * 10, left_right, 10);
+	flat = RopeCreate(expected, 200);
+	RopeSetFlatCache(1000, 16);
+
+	/* cached on the first flatten, read from it by the next ones */
+	assert(RopeToString(rope, buf, sizeof(buf)) == 200);
+	assert(RopeFlatCacheSize() == 200);
+	assert(RopeToString(rope, buf, sizeof(buf)) == 200);
+	assert(memcmp(buf, expected, 200) == 0);
+	for (size_t i = 0; i < 200; i += 7)
+		assert(RopeIndex(rope, i) == expected[i]);
+	assert(RopeCommonPrefix(rope, flat) == 200);
+	assert(RopeCommonSuffix(flat, rope) == 200);
+
+	/* and as a subtree of another rope */
+	outer = RopeConcat(leaf, rope);
+	assert(RopeToString(outer, buf, sizeof(buf)) == 210);
+	assert(memcmp(buf + 10, expected, 200) == 0);
+	assert(RopeIndex(outer, 15) == expected[5]);
+	assert(RopeFlatCacheSize() == 410);
+	assert(RopeCommonPrefix(outer, rope) == 200);
+	RopeDestroy(flat);
+	expected[123] = '!';
+	flat = RopeCreate(expected, 200);
+	expected[123] = left_right[3];
+	assert(RopeCommonPrefix(rope, flat) == 123);
+	assert(RopeCommonSuffix(rope, flat) == 76);
+
+	/* the least recently used is evicted */
+	RopeSetFlatCache(300, 16);
+	assert(RopeFlatCacheSize() == 200);
+	assert(RopeToString(outer, buf, sizeof(buf)) == 210);
+	assert(RopeFlatCacheSize() == 210);
+	RopeDestroy(outer);
+	assert(RopeFlatCacheSize() == 0);
+
+	/* a rope changed in place is not read from the cache */
+	for (int k = 0; k < 30; k++) {
+		owned = RopeAppendInPlace(owned, left, 5);
+		memcpy(expected + len, left, 5);
+		len += 5;
+	}
+	assert(RopeToString(owned, buf, sizeof(buf)) == (ssize_t) len);
+	assert(RopeFlatCacheSize() == len);
+	owned = RopeAppendInPlace(owned, "!", 1);
+	expected[len++] = '!';
+	assert(RopeIndex(owned, len - 1) == '!');
+	assert(RopeToString(owned, buf, sizeof(buf)) == (ssize_t) len);
+	assert(memcmp(buf, expected, len) == 0);
+	RopeDestroy(owned);
+
+	/* a shared subtree flattened through a parent is cached with it, and
+	 * read from the cache through another parent, which makes it the most
+	 * recently used */
+	RopeSetFlatCache(0, 16);
+	RopeSetFlatCache(1000, 16);
+	{
+		Rope shared = test_deep_chain(leaf, 4),
+		     first = RopeConcat(leaf, shared), second = RopeConcat(shared, leaf);
+
+		for (int k = 0; k < 6; k++)
+			memcpy(expected + k * 10, left_right, 10);
+		assert(RopeToString(first, buf, sizeof(buf)) == 60);
+		assert(RopeFlatCacheSize() == 110);
+		RopeSetFlatCache(150, 16);
+		assert(RopeToString(second, buf, sizeof(buf)) == 60);
+		assert(memcmp(buf, expected, 60) == 0);
+		assert(RopeFlatCacheSize() == 110);
+		assert(RopeIndex(second, 42) == expected[42]);
+		RopeDestroy(first);
+		RopeDestroy(second);
+		RopeDestroy(shared);
+	}
+
+	RopeSetFlatCache(0, ROPE_FLAT_CACHE_MIN_LEN);
+	assert(RopeFlatCacheSize() == 0);
+	RopeDestroy(flat);
+	RopeDestroy(rope);
+	RopeDestroy(leaf);
+}
+
+/* the first occurrence of pattern in str at or after from, or -1 */
+static ssize_t
+test_find_naive(const char *str, size_t len, const char *pattern,
+                size_t pattern_len, size_t from) {
+	for (size_t i = from; i + pattern_len <= len; i++)
+		if (memcmp(str + i, pattern, pattern_len) == 0)
+			return i;
+
+	return -1;
+}
+
+static void
+test_find_index(void) {
+	size_t len = 300000, chunk = 1000, probes[] = {0, 65535, 65530, 131070,
+	                                               299980, 150000, 777};
+	char *str = palloc(len + 1), *edited;
+	Rope rope = RopeCreate("", 0), edit, part, ab, repeat, with_repeat;
+	RopeGramIndex index, old;
+	RopeStats stats;
+	uint32_t seed = 7;
+
+	/* text over a small alphabet, so grams repeat */
+	for (size_t i = 0; i < len; i++) {
+		seed = seed * 1103515245 + 12345;
+		str[i] = "abcd"[seed >> 16 & 3];
+	}
+	for (size_t i = 0; i < len; i += chunk) {
+		Rope next;
+
+		part = RopeCreate(str + i, chunk);
+		next = RopeConcat(rope, part);
+		RopeDestroy(part);
+		RopeDestroy(rope);
+		rope = next;
+	}
+
+	/* plain search */
+	assert(RopeFind(rope, "", 0, 5, NULL) == 5);
+	assert(RopeFind(rope, "x", 1, 0, NULL) == -1);
+	assert(RopeFind(rope, str, 10, len, NULL) == -1);
+	assert(RopeFind(rope, str + 995, 10, 0, NULL) ==
+	       test_find_naive(str, len, str + 995, 10, 0));
+
+	assert(!RopeBuildIndex(rope, 1));
+	assert(!RopeBuildIndex(rope, ROPE_INDEX_MAX_K + 1));
+	index = RopeBuildIndex(rope, 4);
+	RopeIndexGetStats(index, &stats);
+	assert(stats.len == len);
+	assert(stats.index_size > len);
+
+	/* the index gives the same matches, including across pieces */
+	for (size_t i = 0; i < sizeof(probes) / sizeof(probes[0]); i++)
+		for (size_t n = 2; n <= 12; n += 5)
+			for (size_t from = 0; from < len; from += 40000) {
+				const char *pattern = str + probes[i];
+
+				assert(RopeFind(rope, pattern, n, from, index) ==
+				       test_find_naive(str, len, pattern, n, from));
+				assert(RopeFind(rope, pattern, n, from, NULL) ==
+				       test_find_naive(str, len, pattern, n, from));
+			}
+	assert(RopeFind(rope, "abcde", 5, 0, index) == -1);
+
+	/* an edit shares the index of the subtrees it leaves alone */
+	edit = RopeSpliceInPlace(RopeRef(rope), 200000, 4, "xyzw", 4);
+	edited = palloc(len + 1);
+	memcpy(edited, str, len);
+	memcpy(edited + 200000, "xyzw", 4);
+	old = index;
+	index = RopeRebuildIndex(old, edit);
+	RopeIndexFree(old);
+	assert(RopeFind(edit, "yzw", 3, 0, index) == 200001);
+	assert(RopeFind(edit, edited + 199998, 8, 0, index) ==
+	       test_find_naive(edited, len, edited + 199998, 8, 0));
+	assert(RopeFind(rope, "yzw", 3, 0, index) == -1);
+	RopeIndexFree(index);
+
+	/* a large repeat node is scanned */
+	ab = RopeCreate("abcdx", 5);
+	repeat = RopeRepeat(ab, 40000);
+	with_repeat = RopeConcat(repeat, edit);
+	index = RopeBuildIndex(with_repeat, 3);
+	assert(RopeFind(with_repeat, "dxa", 3, 0, index) == 3);
+	assert(RopeFind(with_repeat, "xyzw", 4, 0, index) == 400000);
+	for (size_t from = 0; from < 400000; from += 66666) {
+		const char *patterns[] = {"dxa", "xabcd", "dxab", "xdd", "dxdcba"};
+
+		for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++)
+			assert(RopeFind(with_repeat, patterns[i], strlen(patterns[i]),
+			                from, index) ==
+			       RopeFind(with_repeat, patterns[i], strlen(patterns[i]),
+			                from, NULL));
+	}
+	assert(RopeFind(with_repeat, edited, 6, 0, index) == 200000);
+	RopeIndexFree(index);
+
+	/* more pieces than are sampled to choose the gram */
+	{
+		size_t big_len = 130 * 66000;
+		char *big = palloc(big_len);
+		Rope many = RopeCreate("", 0);
+
+		for (size_t i = 0; i < big_len; i++) {
+			seed = seed * 1103515245 + 12345;
+			big[i] = 'a' + (seed >> 16) % 26;
+		}
+		for (size_t i = 0; i < big_len; i += 66000) {
+			Rope next;
+
+			part = RopeCreate(big + i, 66000);
+			next = RopeConcat(many, part);
+			RopeDestroy(part);
+			RopeDestroy(many);
+			many = next;
+		}
+		index = RopeBuildIndex(many, 4);
+		for (size_t at = 17; at < big_len; at += big_len / 7)
+			for (size_t from = 0; from < big_len; from += big_len / 3)
+				assert(RopeFind(many, big + at, 9, from, index) ==
+				       RopeFind(many, big + at, 9, from, NULL));
+		assert(RopeFind(many, big + big_len - 10, 10, 0, index) ==
+		       (ssize_t) (big_len - 10));
+		RopeIndexFree(index);
+		RopeDestroy(many);
+		pfree(big);
+	}
+
+	RopeDestroy(with_repeat);
+	RopeDestroy(repeat);
+	RopeDestroy(ab);
+	RopeDestroy(edit);
+	RopeDestroy(rope);
+	pfree(edited);
+	pfree(str);
+}
+
+/* held to the end, as immortal nodes are never freed */
+static Rope frozen;
+
+static void
+test_freeze_for_fork(void) {
+	char buf[400], expected[400];
+	Rope leaf = RopeCreate(left_right, 10), chain = test_deep_chain(leaf, 19),
+	     repeat = RopeRepeat(leaf, 4), concat, appended;
+	size_t n;
+	pid_t pid;
+	int status;
+
+	for (int k = 0; k < 24; k++)
+		memcpy(expected + k * 10, left_right, 10);
+	frozen = RopeConcat(chain, repeat);
+	RopeDestroy(chain);
+	RopeDestroy(repeat);
+	RopeSetFlatCache(1000, 16);
+	assert(RopeToString(frozen, buf, sizeof(buf)) == 240);
+	assert(RopeFlatCacheSize() > 0);
+
+	n = RopeFreezeForFork(frozen);
+	assert(n > 20);
+	assert(RopeIsImmortal(frozen) && RopeIsImmortal(leaf));
+	assert(RopeFreezeForFork(frozen) == 0);
+	assert(RopeFlatCacheSize() == 0);
+
+	/* neither counted nor freed, nor cached, nor changed in place */
+	for (int k = 0; k < 3; k++)
+		RopeDestroy(RopeRef(frozen));
+	RopeDestroy(frozen);
+	RopeDestroy(leaf);
+	concat = RopeConcat(frozen, frozen);
+	assert(!RopeIsImmortal(concat));
+	RopeDestroy(concat);
+	assert(RopeToString(frozen, buf, sizeof(buf)) == 240);
+	assert(RopeFlatCacheSize() == 0);
+	appended = RopeAppendInPlace(frozen, "!", 1);
+	assert(appended != frozen);
+	assert(RopeGetLen(frozen) == 240 && RopeGetLen(appended) == 241);
+	RopeDestroy(appended);
+
+	/* and the same in a worker */
+	fflush(stdout);
+	pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		bool ok;
+
+		concat = RopeConcat(frozen, leaf);
+		ok = RopeToString(concat, buf, sizeof(buf)) == 250 &&
+		     memcmp(buf, expected, 240) == 0 && RopeIsImmortal(frozen);
+		RopeDestroy(concat);
+		RopeDestroy(frozen);
+		_exit(ok ? 0 : 1);
+	}
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	assert(RopeToString(frozen, buf, sizeof(buf)) == 240);
+	assert(memcmp(buf, expected, 240) == 0);
+	RopeSetFlatCache(0, ROPE_FLAT_CACHE_MIN_LEN);
+}
+
 int
 main(int argc, char *argv[]) {
 	test_concat();
 	test_scan();
+	test_scan_reshape();
 	test_substr();
+	test_compact();
+	test_stats();
+	test_instr();
+	test_trace();
+	test_external();
+	test_append();
+	test_repeat();
+	test_rebalance();
+	test_map();
+	test_diff();
+	test_index_many();
+	test_find_all();
+	test_splice();
+	test_read();
+	test_read_interrupt();
+	test_large();
+	test_destroy();
+	test_stats_deep();
+	test_appender();
+	test_flat_cache();
+	test_find_index();
+	test_freeze_for_fork();
 
 	(void) argc;
 	(void) argv;
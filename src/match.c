@@ -0,0 +1,205 @@
+#include "rope.h"
+#include "utils.h"
+#include "instr.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Multi-pattern search (Aho-Corasick)
+ *
+ * The trie of the patterns is completed into a DFA: every state has a
+ * transition for every byte class, so each input byte costs one table load
+ * whatever the number of patterns. Bytes which occur in no pattern share
+ * class 0, which keeps a row to a few dozen entries for typical keywords.
+ * The state is carried from leaf to leaf, so matches spanning leaves are
+ * found without joining them.
+ */
+
+#define MATCH_NONE UINT32_MAX
+
+struct rope_pattern_set_tag {
+	uint16_t classes[256]; /* byte -> class */
+	uint32_t n_classes;
+	uint32_t n_states;
+	uint32_t *delta;       /* n_states * n_classes transitions */
+	uint8_t *accept;       /* the state or a suffix of it ends a pattern */
+	uint32_t *first;       /* first pattern ending at the state, or NONE */
+	uint32_t *next;        /* next pattern ending at the same state, or NONE */
+	/* the longest proper suffix of the state ending a pattern, 0 for none */
+	uint32_t *dict;
+	size_t *lens; /* of each pattern */
+	size_t n_patterns;
+};
+
+RopePatternSet
+RopePatternSetCompile(const char *const *patterns, const size_t *lens,
+                      size_t n) {
+	RopePatternSet set;
+	uint32_t *delta, *fail, *queue, *last, head = 0, tail = 0;
+	size_t max_states = 1;
+
+	for (size_t k = 0; k < n; k++) {
+		if (lens[k] == 0)
+			return NULL;
+		max_states += lens[k];
+	}
+	if (max_states >= MATCH_NONE || n >= MATCH_NONE)
+		return NULL;
+
+	set = palloc(sizeof(*set));
+	memset(set->classes, 0, sizeof(set->classes));
+	set->n_classes = 1;
+	for (size_t k = 0; k < n; k++)
+		for (size_t i = 0; i < lens[k]; i++) {
+			uint16_t *cls = &set->classes[(unsigned char) patterns[k][i]];
+
+			if (!*cls)
+				*cls = set->n_classes++;
+		}
+
+	/* the trie, where 0 (the root) means no child */
+	delta = palloc(sizeof(*delta) * max_states * set->n_classes);
+	memset(delta, 0, sizeof(*delta) * set->n_classes);
+	set->first = palloc(sizeof(*set->first) * max_states);
+	set->first[0] = MATCH_NONE;
+	set->next = palloc(sizeof(*set->next) * (n ? n : 1));
+	set->lens = palloc(sizeof(*set->lens) * (n ? n : 1));
+	last = palloc(sizeof(*last) * max_states);
+	set->n_states = 1;
+	set->n_patterns = n;
+
+	for (size_t k = 0; k < n; k++) {
+		uint32_t s = 0;
+
+		for (size_t i = 0; i < lens[k]; i++) {
+			uint32_t *t = &delta[(size_t) s * set->n_classes +
+			                     set->classes[(unsigned char) patterns[k][i]]];
+
+			if (!*t) {
+				*t = set->n_states++;
+				memset(&delta[(size_t) *t * set->n_classes], 0,
+				       sizeof(*delta) * set->n_classes);
+				set->first[*t] = MATCH_NONE;
+			}
+			s = *t;
+		}
+
+		/* duplicates are reported in order of index */
+		set->next[k] = MATCH_NONE;
+		if (set->first[s] == MATCH_NONE)
+			set->first[s] = k;
+		else
+			set->next[last[s]] = k;
+		last[s] = k;
+		set->lens[k] = lens[k];
+	}
+	pfree(last);
+
+	/* complete the trie breadth first: a missing child of s is the child of
+	 * the fail state of s, which is shallower and so complete already */
+	set->delta = palloc(sizeof(*delta) * set->n_states * set->n_classes);
+	memcpy(set->delta, delta, sizeof(*delta) * set->n_states * set->n_classes);
+	pfree(delta);
+	delta = set->delta;
+	fail = palloc(sizeof(*fail) * set->n_states);
+	queue = palloc(sizeof(*queue) * set->n_states);
+	set->dict = palloc(sizeof(*set->dict) * set->n_states);
+	set->accept = palloc(set->n_states);
+	fail[0] = set->dict[0] = 0;
+	set->accept[0] = false;
+
+	for (uint32_t c = 0; c < set->n_classes; c++) {
+		uint32_t t = delta[c];
+
+		if (t) {
+			fail[t] = set->dict[t] = 0;
+			queue[tail++] = t;
+		}
+	}
+
+	while (head < tail) {
+		uint32_t s = queue[head++], *row = &delta[(size_t) s * set->n_classes],
+		         *frow = &delta[(size_t) fail[s] * set->n_classes];
+
+		set->accept[s] = set->first[s] != MATCH_NONE || set->dict[s];
+
+		for (uint32_t c = 0; c < set->n_classes; c++) {
+			uint32_t t = row[c], f = frow[c];
+
+			if (!t) {
+				row[c] = f;
+				continue;
+			}
+			fail[t] = f;
+			set->dict[t] = set->first[f] != MATCH_NONE ? f : set->dict[f];
+			queue[tail++] = t;
+		}
+	}
+
+	pfree(fail);
+	pfree(queue);
+
+	return set;
+}
+
+void
+RopePatternSetFree(RopePatternSet set) {
+	pfree(set->delta);
+	pfree(set->accept);
+	pfree(set->first);
+	pfree(set->dict);
+	pfree(set->next);
+	pfree(set->lens);
+	pfree(set);
+}
+
+/* report the patterns ending at state s at end (exclusive), return false if
+ * func asks to stop */
+static bool
+match_report(const RopePatternSet set, uint32_t s, size_t end, size_t *n,
+             bool (*func)(const RopeMatch *match, void *arg), void *arg) {
+	RopeMatch match;
+
+	for (; s; s = set->dict[s])
+		for (uint32_t k = set->first[s]; k != MATCH_NONE; k = set->next[k]) {
+			match.pattern = k;
+			match.len = set->lens[k];
+			match.pos = end - match.len;
+			(*n)++;
+			if (!func(&match, arg))
+				return false;
+		}
+
+	return true;
+}
+
+size_t
+RopeFindAll(const RopePatternSet set, const Rope rope,
+            bool (*func)(const RopeMatch *match, void *arg), void *arg) {
+	RopeScanLeaf scan;
+	const uint32_t *delta = set->delta, n_classes = set->n_classes;
+	const uint16_t *classes = set->classes;
+	const uint8_t *accept = set->accept;
+	const unsigned char *str;
+	size_t len, pos = 0, n = 0;
+	uint32_t s = 0;
+	bool go_on = true;
+	INSTR_OP_BEGIN(ROPE_OP_FIND_ALL);
+
+	scan = RopeScanLeafInit(rope);
+	while (go_on && (str = (const unsigned char *) RopeScanLeafGetNextLen(
+	                     scan, &len))) {
+		for (size_t i = 0; i < len; i++) {
+			s = delta[(size_t) s * n_classes + classes[str[i]]];
+			if (accept[s] &&
+			    !(go_on = match_report(set, s, pos + i + 1, &n, func, arg)))
+				break;
+		}
+		pos += len;
+	}
+	RopeScanLeafFini(scan);
+
+	INSTR_OP_END(ROPE_OP_FIND_ALL);
+	return n;
+}
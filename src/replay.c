@@ -0,0 +1,187 @@
+#include "rope.h"
+#include "trace.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Replay a trace recorded by Rope.trace_start against the library.
+ *
+ * usage: replay trace_file
+ *
+ * Created ropes are filled with synthetic bytes of the recorded size.
+ * Timing per operation is written to stdout as JSON.
+ */
+
+struct replay {
+	Rope *ropes; /* indexed by trace id */
+	size_t n_ropes;
+	char *buf; /* source of RopeCreate, and destination of RopeToString */
+	size_t buf_size;
+	size_t n_skipped; /* records referring to unknown ropes */
+	size_t count[ROPE_TRACE_N_OPS];
+	double ns[ROPE_TRACE_N_OPS];
+};
+
+static void
+replay_reserve_buf(struct replay *r, size_t size) {
+	if (r->buf_size >= size)
+		return;
+
+	if (r->buf)
+		pfree(r->buf);
+	r->buf_size = size * 2;
+	r->buf = palloc(r->buf_size);
+	for (size_t i = 0; i < r->buf_size; i++)
+		r->buf[i] = 'a' + i % 26;
+}
+
+static Rope
+replay_get(struct replay *r, uint64_t id) {
+	return id < r->n_ropes ? r->ropes[id] : NULL;
+}
+
+static void
+replay_set(struct replay *r, uint64_t id, Rope rope) {
+	if (id >= r->n_ropes) {
+		size_t n = r->n_ropes ? r->n_ropes : 1024;
+		Rope *ropes;
+
+		while (n <= id)
+			n *= 2;
+		ropes = palloc(sizeof(*ropes) * n);
+		memset(ropes, 0, sizeof(*ropes) * n);
+		if (r->ropes) {
+			memcpy(ropes, r->ropes, sizeof(*ropes) * r->n_ropes);
+			pfree(r->ropes);
+		}
+		r->ropes = ropes;
+		r->n_ropes = n;
+	}
+
+	if (r->ropes[id])
+		RopeDestroy(r->ropes[id]);
+	r->ropes[id] = rope;
+}
+
+/* return false if rec refers to a rope which does not exist */
+static bool
+replay_record(struct replay *r, const RopeTraceRecord *rec) {
+	const uint64_t *a = rec->args;
+	Rope src, src2;
+
+	switch (rec->op) {
+		case ROPE_TRACE_CREATE:
+			replay_reserve_buf(r, a[1]);
+			replay_set(r, a[0], RopeCreate(r->buf, a[1]));
+			return true;
+		case ROPE_TRACE_FREE:
+			if (!replay_get(r, a[0]))
+				return false;
+			replay_set(r, a[0], NULL);
+			return true;
+		default:
+			break;
+	}
+
+	src = replay_get(r, rec->op == ROPE_TRACE_INDEX || rec->op == ROPE_TRACE_TO_S
+	                        ? a[0]
+	                        : a[1]);
+	if (!src)
+		return false;
+
+	switch (rec->op) {
+		case ROPE_TRACE_CONCAT:
+			if (!(src2 = replay_get(r, a[2])))
+				return false;
+			replay_set(r, a[0], RopeConcat(src, src2));
+			break;
+		case ROPE_TRACE_SUBSTR:
+		case ROPE_TRACE_DELETE:
+			if (a[2] + a[3] > RopeGetLen(src))
+				return false;
+			replay_set(r, a[0], rec->op == ROPE_TRACE_SUBSTR
+			                        ? RopeSubstr(src, a[2], a[3])
+			                        : RopeDelete(src, a[2], a[3]));
+			break;
+		case ROPE_TRACE_APPEND:
+			replay_reserve_buf(r, a[2]);
+			r->ropes[a[1]] = NULL;
+			replay_set(r, a[0], RopeAppendInPlace(src, r->buf, a[2]));
+			break;
+		case ROPE_TRACE_INDEX:
+			if (a[1] >= RopeGetLen(src))
+				return false;
+			r->buf[0] = RopeIndex(src, a[1]);
+			break;
+		case ROPE_TRACE_TO_S:
+			replay_reserve_buf(r, RopeGetLen(src) + 1);
+			RopeToString(src, r->buf, r->buf_size);
+			break;
+		default:
+			break;
+	}
+
+	return true;
+}
+
+int
+main(int argc, char *argv[]) {
+	struct replay r;
+	RopeTraceRecord rec;
+	RopeTrace trace;
+	size_t n_records = 0;
+	double total_ns = 0;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s trace_file\n", argv[0]);
+		return 1;
+	}
+
+	if (!(trace = RopeTraceOpenRead(argv[1]))) {
+		fprintf(stderr, "%s: cannot open %s\n", argv[0], argv[1]);
+		return 1;
+	}
+
+	memset(&r, 0, sizeof(r));
+	replay_reserve_buf(&r, 4096);
+
+	while (RopeTraceRead(trace, &rec)) {
+		struct timespec start, end;
+		double ns;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (!replay_record(&r, &rec)) {
+			r.n_skipped++;
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+		r.count[rec.op]++;
+		r.ns[rec.op] += ns;
+		total_ns += ns;
+		n_records++;
+	}
+	RopeTraceClose(trace);
+
+	printf("{\n  \"trace\": \"%s\",\n  \"records\": %zu,\n  \"skipped\": %zu,\n"
+	       "  \"total_ns\": %.0f,\n  \"ops\": {",
+	       argv[1], n_records, r.n_skipped, total_ns);
+	for (int op = 0; op < ROPE_TRACE_N_OPS; op++)
+		printf("%s\n    \"%s\": {\"count\": %zu, \"ns\": %.0f, \"ns_per_op\": %.2f}",
+		       op ? "," : "", RopeTraceOpName(op), r.count[op], r.ns[op],
+		       r.count[op] ? r.ns[op] / r.count[op] : 0.0);
+	printf("\n  }\n}\n");
+
+	for (size_t id = 0; id < r.n_ropes; id++)
+		if (r.ropes[id])
+			RopeDestroy(r.ropes[id]);
+	if (r.ropes)
+		pfree(r.ropes);
+	pfree(r.buf);
+
+	return 0;
+}
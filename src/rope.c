@@ -1,314 +1,3888 @@
 #include "rope.h"
-#include "string.h"
 #include "utils.h"
-#include <stdbool.h>
+#include "instr.h"
+#include "lz.h"
+
+#include <assert.h>
+#include <errno.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* initial depth of the scan stack, which grows for deeper ropes */
+#define ROPE_SCAN_MAX_DEPTH 64
+/* spare capacity given to a leaf made by RopeAppendInPlace is at most this */
+#define ROPE_APPEND_MAX_SLACK (64 * 1024)
+/* leaves up to this long are rebuilt with a gap by RopeSpliceInPlace */
+#define ROPE_GAP_MAX_LEAF_LEN (4 * 1024)
+/* size of the gap of a leaf rebuilt by RopeSpliceInPlace */
+#define ROPE_GAP_SLACK 128
+/* leaves read from a file descriptor start at MIN and double up to MAX */
+#define ROPE_READ_MIN_LEAF_LEN (4 * 1024)
+#define ROPE_READ_MAX_LEAF_LEN (64 * 1024)
+/* subtrees up to this long are a piece of a gram index, and longer leaves
+ * are cut into pieces of this size */
+#define ROPE_GRAM_PIECE_LEN (64 * 1024)
+/* grams of a pattern RopeFind compares the frequency of, in up to
+ * SAMPLE_SPANS pieces */
+#define ROPE_GRAM_MAX_PROBES 32
+#define ROPE_GRAM_SAMPLE_SPANS 64
+/* size of the chunks RopeAppenderAppend writes into */
+#define ROPE_APPENDER_CHUNK (64 * 1024)
+/* leaves a RopeReader reads ahead of its consumer */
+#define ROPE_READER_QUEUE_LEN 16
+
+#ifdef __GNUC__
+#define ROPE_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define ROPE_PREFETCH(p) ((void) 0)
+#endif
+
+typedef enum {
+	ROPE_CONCAT,
+	ROPE_LEAF,
+	ROPE_LEAF_LZ,  /* str holds LZ compressed bytes */
+	ROPE_LEAF_EXT, /* bytes are borrowed, str holds RopeReleaseFunc */
+	ROPE_REPEAT,   /* rep.child repeated rep.count times */
+} rope_kind;
 
 struct rope_tag {
-	size_t len; /* w/o NUL */
-	bool is_leaf;
-	int ref_count;
-	Rope left, right;
+	union {
+		size_t len;     /* w/o NUL */
+		Rope next_dead; /* list of nodes to free, once ref_count is 0 */
+	};
+	unsigned char kind : 4; /* rope_kind */
+	bool has_external : 1;  /* ROPE_LEAF_EXT is in this subtree */
+	bool has_gap : 1;       /* a ROPE_LEAF with an open gap is in this subtree */
+	atomic_bool flat;       /* the bytes are in the flat cache */
+	unsigned short depth;   /* height, saturated at USHRT_MAX */
+	atomic_int ref_count;
+	union {
+		struct {
+			Rope left, right;
+		};
+		struct {
+			size_t cap; /* bytes str can hold w/o NUL */
+			size_t gap; /* bytes before the gap, len if it is closed */
+		}; /* ROPE_LEAF */
+		struct {
+			Rope child;
+			size_t count;
+		} rep;
+		struct {
+			size_t clen;      /* size of compressed str */
+			unsigned long id; /* key for decode cache, never reused */
+		} lz;
+		struct {
+			const char *ptr; /* not NUL terminated */
+			void *owner;
+		} ext;
+	};
 	char str[];
 };
 
+static inline bool
+rope_is_leaf(const Rope rope) {
+	return rope->kind != ROPE_CONCAT && rope->kind != ROPE_REPEAT;
+}
+
+/*
+ * A ROPE_LEAF edited by RopeSpliceInPlace keeps its spare capacity as a gap
+ * at the last edit, so that the next edit nearby moves only the bytes in
+ * between. The gap is closed (moved to the end) when the bytes are read as
+ * a string and when the subtree is shared, so shared nodes never change.
+ */
+static void
+rope_gap_move(Rope leaf, size_t pos) {
+	size_t size = leaf->cap - leaf->len;
+
+	if (pos < leaf->gap)
+		memmove(leaf->str + pos + size, leaf->str + pos, leaf->gap - pos);
+	else
+		memmove(leaf->str + leaf->gap, leaf->str + leaf->gap + size,
+		        pos - leaf->gap);
+	leaf->gap = pos;
+}
+
+static void
+rope_close_gaps(Rope rope) {
+	if (!rope || !rope->has_gap)
+		return;
+
+	if (rope->kind == ROPE_LEAF) {
+		rope_gap_move(rope, rope->len);
+		rope->str[rope->len] = '\0';
+	} else if (rope->kind == ROPE_CONCAT) {
+		rope_close_gaps(rope->left);
+		rope_close_gaps(rope->right);
+	}
+	rope->has_gap = false;
+}
+
+/*
+ * ref_count is the number of parents and handles referring to the node
+ * itself, so a node whose path from a handle is all counted 1 is owned by
+ * that handle alone (see RopeAppendInPlace). It is atomic so that the reclaim
+ * thread can release children shared with ropes still in use. A count of
+ * ROPE_IMMORTAL or more (see RopeFreezeForFork) is neither changed nor
+ * dropped, so that immortal nodes are only ever read.
+ */
+#define ROPE_IMMORTAL (INT_MAX / 2)
+
+static bool
+rope_is_immortal(const Rope rope) {
+	return atomic_load_explicit(&((Rope) rope)->ref_count,
+	                            memory_order_relaxed) >= ROPE_IMMORTAL;
+}
+
 static Rope
 rope_ref(Rope rope) {
+	int count;
+
+	if (!rope)
+		return NULL;
+
 	assert(rope->ref_count > 0);
 
-	if (rope->ref_count == INT_MAX) {
-		elog("ref_count reaches INT_MAX");
+	count = atomic_load_explicit(&rope->ref_count, memory_order_relaxed);
+	if (count >= ROPE_IMMORTAL)
+		return rope;
+	if (count == ROPE_IMMORTAL - 1) {
+		elog("ref_count reaches ROPE_IMMORTAL");
 		return NULL;
 	}
 
-	rope->ref_count++;
-
-	if (rope->left)
-		rope_ref(rope->left);
-	if (rope->right)
-		rope_ref(rope->right);
+	rope_close_gaps(rope);
+	atomic_fetch_add_explicit(&rope->ref_count, 1, memory_order_relaxed);
 
 	return rope;
 }
 
+/*
+ * A node losing its last reference is pushed on a list threaded through
+ * next_dead, and its children are released when it is popped, so that
+ * freeing takes no stack however deep the rope is.
+ */
 static void
-rope_deref(Rope rope) {
+rope_release(Rope rope, Rope *dead) {
+	if (!rope)
+		return;
+
 	assert(rope->ref_count > 0);
 
-	rope->ref_count--;
-	if (rope->left)
-		rope_deref(rope->left);
-	if (rope->right)
-		rope_deref(rope->right);
+	if (rope_is_immortal(rope) ||
+	    atomic_fetch_sub_explicit(&rope->ref_count, 1, memory_order_acq_rel) > 1)
+		return;
 
-	if (rope->ref_count == 0)
-		pfree(rope);
+	rope->next_dead = *dead;
+	*dead = rope;
 }
 
-Rope
-RopeConcat(Rope left, Rope right) {
+static void rope_flat_drop(const Rope node);
+
+/* free the first node of *dead, pushing the children dying with it */
+static void
+rope_free_dead(Rope *dead) {
+	Rope rope = *dead;
+	RopeReleaseFunc release;
+
+	*dead = rope->next_dead;
+	rope_flat_drop(rope);
+
+	switch (rope->kind) {
+		case ROPE_CONCAT:
+			rope_release(rope->left, dead);
+			rope_release(rope->right, dead);
+			break;
+		case ROPE_REPEAT:
+			rope_release(rope->rep.child, dead);
+			break;
+		case ROPE_LEAF_EXT:
+			memcpy(&release, rope->str, sizeof(release));
+			if (release)
+				release(rope->ext.owner);
+			break;
+	}
+	pfree(rope);
+}
+
+static void
+rope_deref(Rope rope) {
+	Rope dead = NULL;
+
+	rope_release(rope, &dead);
+	while (dead)
+		rope_free_dead(&dead);
+}
+
+static unsigned short
+rope_depth(const Rope rope) {
+	return rope ? rope->depth : 0;
+}
+
+static void
+rope_set_depth(Rope rope, size_t child_depth) {
+	rope->depth = child_depth < USHRT_MAX ? child_depth + 1 : USHRT_MAX;
+}
+
+/* a concat node taking over the references to left and right */
+static Rope
+rope_concat_without_rec_ref(const Rope left, const Rope right) {
 	Rope rope = palloc(sizeof(*rope));
+	unsigned short ldepth = rope_depth(left), rdepth = rope_depth(right);
 
-	rope->is_leaf = false;
-	rope->ref_count = 1;
+	rope->kind = ROPE_CONCAT;
+	atomic_init(&rope->ref_count, 1);
+	atomic_init(&rope->flat, false);
 	rope->len = 0;
-	if (left)
+	rope->has_external = rope->has_gap = false;
+	rope_set_depth(rope, ldepth > rdepth ? ldepth : rdepth);
+	if (left) {
 		rope->len += left->len;
-	if (right)
+		rope->has_external |= left->has_external;
+		rope->has_gap |= left->has_gap;
+	}
+	if (right) {
 		rope->len += right->len;
-	rope->left = rope_ref(left);
-	rope->right = rope_ref(right);
+		rope->has_external |= right->has_external;
+		rope->has_gap |= right->has_gap;
+	}
+	rope->left = left;
+	rope->right = right;
 
 	return rope;
 }
 
+static Rope rope_join(Rope left, Rope right, size_t *budget);
+static size_t rebalance_steps;
+
 Rope
-RopeCreate(char *str, size_t len) {
-	Rope rope = palloc(sizeof(*rope) + len + 1);
+RopeConcat(const Rope left, const Rope right) {
+	Rope rope;
+	size_t budget = rebalance_steps;
+	INSTR_OP_BEGIN(ROPE_OP_CONCAT);
 
-	rope->is_leaf = true;
-	rope->ref_count = 1;
-	rope->len = len;
-	rope->left = rope->right = NULL;
-	memcpy(rope->str, str, len);
-	rope->str[len] = '\0';
+	rope = rope_join(rope_ref(left), rope_ref(right), &budget);
 
+	INSTR_OP_END(ROPE_OP_CONCAT);
 	return rope;
 }
 
-void
-RopeDestroy(Rope rope) {
-	assert(rope);
-	rope_deref(rope);
-}
+/* a ROPE_LEAF of len bytes, which are left to the caller, and room for cap */
+static Rope
+rope_leaf_alloc(size_t len, size_t cap) {
+	Rope rope = palloc(sizeof(*rope) + cap + 1);
 
-static void
-rope_dump(Rope rope, int level) {
-	for (int i = 0; i < level; i++)
-		printf("  ");
-	printf("| ");
+	rope->kind = ROPE_LEAF;
+	rope->has_external = rope->has_gap = false;
+	rope->depth = 0;
+	atomic_init(&rope->ref_count, 1);
+	atomic_init(&rope->flat, false);
+	rope->len = rope->gap = len;
+	rope->cap = cap;
+	rope->str[len] = '\0';
 
-	if (rope->is_leaf)
-		printf("Leaf: len=%zu, str=%s, refcount=%d\n", rope->len, rope->str,
-		       rope->ref_count);
-	else {
-		printf("Concat: len=%zu, refcount=%d\n", rope->len, rope->ref_count);
-		rope_dump(rope->left, level + 1);
-		rope_dump(rope->right, level + 1);
-	}
+	return rope;
 }
 
-void
-RopeDump(Rope rope) {
-	assert(rope);
-	rope_dump(rope, 0);
-}
+Rope
+RopeCreate(char *str, size_t len) {
+	Rope rope;
+	INSTR_OP_BEGIN(ROPE_OP_CREATE);
 
-static int
-rope_collect_cstr(Rope rope, char *ret_buf, int i) {
-	if (rope->is_leaf) {
-		memcpy(ret_buf + i, rope->str, rope->len);
-		return i + rope->len;
-	}
+	rope = rope_leaf_alloc(len, len);
+	memcpy(rope->str, str, len);
 
-	i = rope_collect_cstr(rope->left, ret_buf, i);
-	return rope_collect_cstr(rope->right, ret_buf, i);
+	INSTR_ADD(create_bytes, len);
+	INSTR_OP_END(ROPE_OP_CREATE);
+	return rope;
 }
 
-int
-RopeToString(Rope rope, char *ret_buf, size_t buf_size) {
-	int rv;
+Rope
+RopeCreateExternal(const char *str, size_t len, void *owner,
+                   RopeReleaseFunc release) {
+	Rope rope;
+	INSTR_OP_BEGIN(ROPE_OP_CREATE);
 
-	if (rope->len > buf_size - 1)
-		return -1;
+	rope = palloc(sizeof(*rope) + sizeof(release));
+	rope->kind = ROPE_LEAF_EXT;
+	rope->has_external = true;
+	rope->has_gap = false;
+	rope->depth = 0;
+	atomic_init(&rope->ref_count, 1);
+	atomic_init(&rope->flat, false);
+	rope->len = len;
+	rope->ext.ptr = str;
+	rope->ext.owner = owner;
+	memcpy(rope->str, &release, sizeof(release));
 
-	rv = rope_collect_cstr(rope, ret_buf, 0);
-	ret_buf[rope->len] = '\0';
+	INSTR_OP_END(ROPE_OP_CREATE);
+	return rope;
+}
 
-	return rv;
+/*
+ * A part of an external leaf borrows from the same buffer and keeps the
+ * original leaf alive as its owner, so the buffer is released only after
+ * every part of it. The bytes of a plain leaf are borrowed likewise by
+ * RopeAppender snapshots; such a view is not external to the caller.
+ */
+static void
+rope_external_release(void *owner) {
+	RopeDestroy(owner);
 }
 
-size_t
-RopeGetLen(Rope rope) {
-	assert(rope);
-	return rope->len;
+static Rope
+rope_external_base(const Rope rope) {
+	RopeReleaseFunc release;
+
+	memcpy(&release, rope->str, sizeof(release));
+
+	return release == rope_external_release ? rope->ext.owner : rope;
 }
 
+/* a leaf of the len bytes at str, which are in base; takes over a
+ * reference to base */
 static Rope
-rope_concat_without_rec_ref(Rope left, Rope right) {
-	Rope rope = palloc(sizeof(*rope));
+rope_view(const char *str, size_t len, Rope base) {
+	Rope rope = RopeCreateExternal(str, len, base, rope_external_release);
 
-	rope->is_leaf = false;
-	rope->ref_count = 1;
-	rope->len = 0;
-	if (left)
-		rope->len += left->len;
-	if (right)
-		rope->len += right->len;
-	rope->left = left;
-	rope->right = right;
+	rope->has_external = base->has_external;
 
 	return rope;
 }
 
 static Rope
-rope_get_substr(Rope rope, size_t i, size_t n) {
-	if (rope->is_leaf) {
-		if (n == rope->len)
-			return rope_ref(rope);
+rope_external_substr(const Rope rope, size_t i, size_t n) {
+	return rope_view(rope->ext.ptr + i, n, rope_ref(rope_external_base(rope)));
+}
 
-		return RopeCreate(((char *) rope->str) + i, n);
-	} else {
-		size_t llen = rope->left->len;
+bool
+RopeGetExternal(const Rope rope, const char **str, void **owner) {
+	assert(rope);
 
-		if (llen >= i + n)
-			return rope_get_substr(rope->left, i, n);
-		else if (llen <= i)
-			return rope_get_substr(rope->right, i - llen, n);
-		else
-			return rope_concat_without_rec_ref(
-			    rope_get_substr(rope->left, i, llen - i),
-			    rope_get_substr(rope->right, 0, n - llen + i));
-	}
+	if (rope->kind != ROPE_LEAF_EXT || !rope->has_external)
+		return false;
+
+	*str = rope->ext.ptr;
+	*owner = rope_external_base(rope)->ext.owner;
+
+	return true;
 }
 
 Rope
-RopeSubstr(Rope rope, size_t i, size_t n) {
+RopeRef(const Rope rope) {
 	assert(rope);
-	assert(n != 0);
-	assert(i + n <= rope->len);
+	return rope_ref(rope);
+}
 
-	return rope_get_substr(rope, i, n);
+void
+RopeDestroy(Rope rope) {
+	assert(rope);
+	rope_deref(rope);
 }
 
-char
-RopeIndex(Rope rope, size_t i) {
+/*
+ * Deferred destruction
+ *
+ * RopeDestroyDeferred moves a dead rope onto a queue instead of freeing it.
+ * The queue is handed to whoever reclaims as a whole, and RopeReclaim frees
+ * from it at most max_nodes nodes, so neither the caller dropping a large
+ * rope nor the reclaimer pauses for long. Producers only take queue_lock,
+ * so they never wait for a batch in progress.
+ */
+static struct {
+	pthread_mutex_t queue_lock; /* protects queue */
+	pthread_mutex_t work_lock;  /* protects work, held for a batch */
+	pthread_cond_t cond;        /* something is queued, or stopping */
+	Rope queue;                 /* roots dropped by RopeDestroyDeferred */
+	Rope work;                  /* nodes being freed by the reclaimer */
+	atomic_size_t n_dead;       /* nodes on queue and work */
+	size_t batch;               /* of the reclaim thread */
+	bool running, stopping;
+	pthread_t thread;
+} rope_reclaim = {.queue_lock = PTHREAD_MUTEX_INITIALIZER,
+                  .work_lock = PTHREAD_MUTEX_INITIALIZER,
+                  .cond = PTHREAD_COND_INITIALIZER};
+
+void
+RopeDestroyDeferred(Rope rope) {
+	Rope dead = NULL;
+
 	assert(rope);
-	assert(i < rope->len);
+	rope_release(rope, &dead);
+	if (!dead)
+		return;
+
+	pthread_mutex_lock(&rope_reclaim.queue_lock);
+	dead->next_dead = rope_reclaim.queue;
+	rope_reclaim.queue = dead;
+	atomic_fetch_add(&rope_reclaim.n_dead, 1);
+	pthread_cond_signal(&rope_reclaim.cond);
+	pthread_mutex_unlock(&rope_reclaim.queue_lock);
+}
+
+size_t
+RopeReclaim(size_t max_nodes) {
+	size_t n_freed = 0;
+	Rope before;
+
+	pthread_mutex_lock(&rope_reclaim.work_lock);
+	if (!rope_reclaim.work) {
+		pthread_mutex_lock(&rope_reclaim.queue_lock);
+		rope_reclaim.work = rope_reclaim.queue;
+		rope_reclaim.queue = NULL;
+		pthread_mutex_unlock(&rope_reclaim.queue_lock);
+	}
+
+	while (rope_reclaim.work && n_freed < max_nodes) {
+		before = rope_reclaim.work->next_dead;
+		rope_free_dead(&rope_reclaim.work);
+		n_freed++;
+
+		/* count the children pushed in place of the node freed */
+		for (Rope p = rope_reclaim.work; p != before; p = p->next_dead)
+			atomic_fetch_add(&rope_reclaim.n_dead, 1);
+		atomic_fetch_sub(&rope_reclaim.n_dead, 1);
+	}
+	pthread_mutex_unlock(&rope_reclaim.work_lock);
+
+	return n_freed;
+}
 
+size_t
+RopeReclaimPending(void) {
+	return atomic_load(&rope_reclaim.n_dead);
+}
+
+static void *
+rope_reclaim_main(void *arg) {
+	(void) arg;
+
+	pthread_mutex_lock(&rope_reclaim.queue_lock);
 	for (;;) {
-		if (rope->is_leaf)
-			return rope->str[i];
-		else {
-			size_t llen = rope->left->len;
+		while (!atomic_load(&rope_reclaim.n_dead) && !rope_reclaim.stopping)
+			pthread_cond_wait(&rope_reclaim.cond, &rope_reclaim.queue_lock);
+		if (!atomic_load(&rope_reclaim.n_dead))
+			break;
 
-			if (i < llen)
-				rope = rope->left;
-			else {
-				rope = rope->right;
-				i -= llen;
-			}
-		}
+		pthread_mutex_unlock(&rope_reclaim.queue_lock);
+		RopeReclaim(rope_reclaim.batch);
+		pthread_mutex_lock(&rope_reclaim.queue_lock);
 	}
+	pthread_mutex_unlock(&rope_reclaim.queue_lock);
+
+	return NULL;
 }
 
-#define ROPE_SCAN_MAX_DEPTH \
-	64 /* TODO: It may be possible to fix this value by wordsize */
+bool
+RopeReclaimThreadStart(size_t batch) {
+	bool started;
 
-typedef enum {
-	LEFT_DOWN,
-	RIGHT_DOWN,
-} scan_dir;
+	pthread_mutex_lock(&rope_reclaim.queue_lock);
+	rope_reclaim.batch = batch ? batch : 1;
+	started = !rope_reclaim.running &&
+	          pthread_create(&rope_reclaim.thread, NULL, rope_reclaim_main,
+	                         NULL) == 0;
+	if (started)
+		rope_reclaim.running = true;
+	pthread_mutex_unlock(&rope_reclaim.queue_lock);
 
-struct rope_scan_leaf_tag {
-	size_t depth;
-	bool is_end;
-	Rope rope;
-	scan_dir dir[ROPE_SCAN_MAX_DEPTH];
-	Rope stack[ROPE_SCAN_MAX_DEPTH];
+	return started;
+}
+
+void
+RopeReclaimThreadStop(void) {
+	pthread_mutex_lock(&rope_reclaim.queue_lock);
+	if (!rope_reclaim.running) {
+		pthread_mutex_unlock(&rope_reclaim.queue_lock);
+		return;
+	}
+	rope_reclaim.stopping = true;
+	pthread_cond_signal(&rope_reclaim.cond);
+	pthread_mutex_unlock(&rope_reclaim.queue_lock);
+
+	pthread_join(rope_reclaim.thread, NULL);
+
+	pthread_mutex_lock(&rope_reclaim.queue_lock);
+	rope_reclaim.running = rope_reclaim.stopping = false;
+	pthread_mutex_unlock(&rope_reclaim.queue_lock);
+}
+
+/*
+ * Compressed leaves
+ *
+ * A ROPE_LEAF_LZ node keeps its bytes compressed and is decoded on demand.
+ * RopeToString decodes straight into the caller's buffer and scanners decode
+ * into a buffer of their own, while random access (RopeIndex, RopeSubstr)
+ * goes through a small per-thread cache of recently decoded leaves, which
+ * is released when the thread exits (or by RopeDecodeCacheFlush).
+ */
+
+#define ROPE_DECODE_CACHE_SLOTS 4
+
+struct rope_decode_cache_slot {
+	unsigned long id; /* 0 if empty */
+	size_t size;
+	char *buf;
 };
 
-RopeScanLeaf
-RopeScanLeafInit(Rope rope) {
-	RopeScanLeaf scan = palloc(sizeof(*scan));
+static atomic_ulong rope_lz_last_id;
+static _Thread_local struct rope_decode_cache_slot
+    decode_cache[ROPE_DECODE_CACHE_SLOTS];
+static _Thread_local int decode_cache_victim;
+static _Thread_local bool decode_cache_registered;
+static pthread_once_t decode_cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t decode_cache_key; /* frees the cache on thread exit */
 
-	scan->rope = rope;
-	scan->depth = 0;
-	scan->is_end = false;
+static void
+rope_decode_cache_free(void *cache) {
+	struct rope_decode_cache_slot *slots = cache;
 
-	while (!scan->rope->is_leaf) {
-		scan->stack[scan->depth] = scan->rope;
-		scan->dir[scan->depth] = LEFT_DOWN;
-		scan->depth++;
-		scan->rope = scan->rope->left;
+	for (int i = 0; i < ROPE_DECODE_CACHE_SLOTS; i++) {
+		if (slots[i].buf)
+			pfree(slots[i].buf);
+		slots[i].id = 0;
+		slots[i].size = 0;
+		slots[i].buf = NULL;
 	}
+}
 
-	return scan;
+static void
+rope_decode_cache_key_init(void) {
+	pthread_key_create(&decode_cache_key, rope_decode_cache_free);
 }
 
-char *
-RopeScanLeafGetNext(RopeScanLeaf scan) {
-	char *rv;
+/* have the cache of this thread freed when it exits */
+static void
+rope_decode_cache_register(void) {
+	pthread_once(&decode_cache_once, rope_decode_cache_key_init);
+	pthread_setspecific(decode_cache_key, decode_cache);
+	decode_cache_registered = true;
+}
 
-	if (scan->is_end)
-		return NULL;
+static void
+rope_lz_decode(const Rope rope, char *buf) {
+	size_t len = LzDecompress(rope->str, rope->lz.clen, buf, rope->len);
 
-	rv = scan->rope->str;
+	assert(len == rope->len);
+	(void) len;
+	buf[rope->len] = '\0';
+}
 
-	do {
-		if (scan->depth == 0) /* End of scan */
-		{
-			scan->is_end = true;
-			return rv;
-		}
-		scan->depth--;
-	} while (scan->dir[scan->depth] == RIGHT_DOWN);
+static const char *
+rope_lz_decode_cached(const Rope rope) {
+	struct rope_decode_cache_slot *slot;
 
-	scan->rope = scan->stack[scan->depth];
-	scan->dir[scan->depth] = RIGHT_DOWN;
-	scan->depth++;
-	scan->rope =
-	    scan->rope->right; /* XXX: Assuming non-leaf rope has right child */
+	for (int i = 0; i < ROPE_DECODE_CACHE_SLOTS; i++)
+		if (decode_cache[i].id == rope->lz.id)
+			return decode_cache[i].buf;
+
+	slot = &decode_cache[decode_cache_victim];
+	decode_cache_victim = (decode_cache_victim + 1) % ROPE_DECODE_CACHE_SLOTS;
 
-	while (!scan->rope->is_leaf) {
-		scan->stack[scan->depth] = scan->rope;
-		scan->dir[scan->depth] = LEFT_DOWN;
-		scan->depth++;
-		scan->rope = scan->rope->left;
+	if (slot->size < rope->len + 1) {
+		if (!decode_cache_registered)
+			rope_decode_cache_register();
+		if (slot->buf)
+			pfree(slot->buf);
+		slot->buf = palloc(rope->len + 1);
+		slot->size = rope->len + 1;
 	}
 
-	return rv;
+	rope_lz_decode(rope, slot->buf);
+	slot->id = rope->lz.id;
+
+	return slot->buf;
+}
+
+/* bytes of a leaf, valid until the next decode on this thread */
+static const char *
+rope_leaf_str(const Rope rope) {
+	if (rope->kind == ROPE_LEAF_LZ)
+		return rope_lz_decode_cached(rope);
+	else if (rope->kind == ROPE_LEAF_EXT)
+		return rope->ext.ptr;
+
+	rope_close_gaps((Rope) rope);
+	return rope->str;
 }
 
 void
-RopeScanLeafFini(RopeScanLeaf scan) {
-	pfree(scan);
+RopeDecodeCacheFlush(void) {
+	rope_decode_cache_free(decode_cache);
 }
 
-struct rope_scan_char_tag {
-	RopeScanLeaf scan_leaf;
-	char *str;
-	size_t pos;
+static void
+rope_dump(const Rope rope, int level) {
+	for (int i = 0; i < level; i++)
+		printf("  ");
+	printf("| ");
+
+	if (rope->kind == ROPE_LEAF)
+		printf("Leaf: len=%zu, str=%s, refcount=%d\n", rope->len,
+		       rope_leaf_str(rope), rope->ref_count);
+	else if (rope->kind == ROPE_LEAF_LZ)
+		printf("LzLeaf: len=%zu, clen=%zu, refcount=%d\n", rope->len,
+		       rope->lz.clen, rope->ref_count);
+	else if (rope->kind == ROPE_LEAF_EXT)
+		printf("ExtLeaf: len=%zu, str=%.*s, refcount=%d\n", rope->len,
+		       (int) rope->len, rope->ext.ptr, rope->ref_count);
+	else if (rope->kind == ROPE_REPEAT) {
+		printf("Repeat: len=%zu, count=%zu, refcount=%d\n", rope->len,
+		       rope->rep.count, rope->ref_count);
+		rope_dump(rope->rep.child, level + 1);
+	} else {
+		printf("Concat: len=%zu, refcount=%d\n", rope->len, rope->ref_count);
+		rope_dump(rope->left, level + 1);
+		rope_dump(rope->right, level + 1);
+	}
+}
+
+void
+RopeDump(const Rope rope) {
+	assert(rope);
+	rope_dump(rope, 0);
+}
+
+/*
+ * Flat cache
+ *
+ * The bytes of a concat or repeat node flattened by RopeToString can be
+ * kept, so that flattening it again, indexing into it and comparing it are
+ * a memcpy, an array lookup and a memcmp. So are those of the subtrees
+ * flattened with it which other ropes share, the subtrees read through
+ * more than one parent; the others would only duplicate bytes of the root.
+ * Entries are keyed by node, which is flagged while it has one so that
+ * others are not looked up, and are evicted least recently used first to
+ * keep them within a global budget.
+ * An entry in use is pinned and freed only when unpinned. A node changed
+ * in place (by its sole owner) or freed drops its entry.
+ */
+struct rope_flat {
+	Rope node;
+	char *bytes; /* node->len bytes and a NUL */
+	size_t len;
+	int pins;
+	bool dropped;                  /* freed when unpinned */
+	struct rope_flat *prev, *next; /* most recently used first */
+	struct rope_flat *chain;       /* in the bucket */
 };
 
-RopeScanChar
-RopeScanCharInit(Rope rope) {
-	RopeScanChar scan = palloc(sizeof(*scan));
+static struct {
+	pthread_mutex_t lock;
+	size_t budget, min_len, used;
+	struct rope_flat **buckets; /* n_buckets is a power of 2 */
+	size_t n_buckets, n;
+	struct rope_flat *head, *tail;
+} flat_cache = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                .min_len = ROPE_FLAT_CACHE_MIN_LEN};
 
-	scan->scan_leaf = RopeScanLeafInit(rope);
-	scan->str = RopeScanLeafGetNext(scan->scan_leaf);
-	scan->pos = 0;
+static struct rope_flat **
+rope_flat_bucket(const Rope node) {
+	size_t i = ((uintptr_t) node >> 4) * 0x9E3779B97F4A7C15ull;
 
-	return scan;
+	return &flat_cache.buckets[i & (flat_cache.n_buckets - 1)];
 }
 
-char
-RopeScanCharGetNext(RopeScanChar scan) {
-	if (scan->str[scan->pos] == '\0') {
-		scan->str = RopeScanLeafGetNext(scan->scan_leaf);
+/* called with the lock held */
+static struct rope_flat *
+rope_flat_find(const Rope node) {
+	struct rope_flat *flat;
 
-		if (!scan->str)
-			return 0;
+	if (!flat_cache.n)
+		return NULL;
+	for (flat = *rope_flat_bucket(node); flat && flat->node != node;
+	     flat = flat->chain)
+		;
 
-		scan->pos = 0;
-	}
+	return flat;
+}
 
-	return scan->str[scan->pos++];
+static void
+rope_flat_free(struct rope_flat *flat) {
+	pfree(flat->bytes);
+	pfree(flat);
 }
 
-void
-RopeScanCharFini(RopeScanChar scan) {
-	RopeScanLeafFini(scan->scan_leaf);
-	pfree(scan);
+static void
+rope_flat_lru_unlink(struct rope_flat *flat) {
+	*(flat->prev ? &flat->prev->next : &flat_cache.head) = flat->next;
+	*(flat->next ? &flat->next->prev : &flat_cache.tail) = flat->prev;
+}
+
+static void
+rope_flat_lru_push(struct rope_flat *flat) {
+	flat->prev = NULL;
+	flat->next = flat_cache.head;
+	*(flat_cache.head ? &flat_cache.head->prev : &flat_cache.tail) = flat;
+	flat_cache.head = flat;
+}
+
+/* remove flat from the cache, called with the lock held */
+static void
+rope_flat_remove(struct rope_flat *flat) {
+	struct rope_flat **slot = rope_flat_bucket(flat->node);
+
+	while (*slot != flat)
+		slot = &(*slot)->chain;
+	*slot = flat->chain;
+	rope_flat_lru_unlink(flat);
+	flat_cache.n--;
+	flat_cache.used -= flat->len;
+	atomic_store_explicit(&flat->node->flat, false, memory_order_relaxed);
+
+	if (flat->pins)
+		flat->dropped = true;
+	else
+		rope_flat_free(flat);
+}
+
+/* called with the lock held */
+static void
+rope_flat_evict(size_t budget) {
+	while (flat_cache.used > budget)
+		rope_flat_remove(flat_cache.tail);
+}
+
+/* return the entry of node, pinned, or NULL */
+static struct rope_flat *
+rope_flat_pin(const Rope node) {
+	struct rope_flat *flat;
+
+	if (!atomic_load_explicit(&node->flat, memory_order_relaxed))
+		return NULL;
+
+	pthread_mutex_lock(&flat_cache.lock);
+	if ((flat = rope_flat_find(node))) {
+		flat->pins++;
+		rope_flat_lru_unlink(flat);
+		rope_flat_lru_push(flat);
+	}
+	pthread_mutex_unlock(&flat_cache.lock);
+
+	return flat;
+}
+
+static void
+rope_flat_unpin(struct rope_flat *flat) {
+	pthread_mutex_lock(&flat_cache.lock);
+	if (--flat->pins == 0 && flat->dropped)
+		rope_flat_free(flat);
+	pthread_mutex_unlock(&flat_cache.lock);
+}
+
+/* cache bytes, the flattened node, if it is worth it */
+static void
+rope_flat_put(const Rope node, const char *bytes) {
+	struct rope_flat *flat, **slot;
+
+	if (rope_is_leaf(node) || rope_is_immortal(node) ||
+	    node->len < flat_cache.min_len || node->len > flat_cache.budget ||
+	    atomic_load_explicit(&node->flat, memory_order_relaxed))
+		return;
+
+	flat = palloc(sizeof(*flat));
+	flat->node = node;
+	flat->len = node->len;
+	flat->bytes = palloc(flat->len + 1);
+	memcpy(flat->bytes, bytes, flat->len);
+	flat->bytes[flat->len] = '\0';
+	flat->pins = 0;
+	flat->dropped = false;
+
+	pthread_mutex_lock(&flat_cache.lock);
+	if (flat->len > flat_cache.budget || rope_flat_find(node)) {
+		pthread_mutex_unlock(&flat_cache.lock);
+		rope_flat_free(flat);
+		return;
+	}
+
+	if (flat_cache.n + 1 > flat_cache.n_buckets) {
+		size_t n_buckets = flat_cache.n_buckets ? flat_cache.n_buckets * 2 : 64;
+		struct rope_flat **buckets = palloc(sizeof(*buckets) * n_buckets),
+		                 **old = flat_cache.buckets, *next;
+		size_t n_old = flat_cache.n_buckets;
+
+		memset(buckets, 0, sizeof(*buckets) * n_buckets);
+		flat_cache.buckets = buckets;
+		flat_cache.n_buckets = n_buckets;
+		for (size_t i = 0; i < n_old; i++)
+			for (struct rope_flat *f = old[i]; f; f = next) {
+				next = f->chain;
+				slot = rope_flat_bucket(f->node);
+				f->chain = *slot;
+				*slot = f;
+			}
+		if (old)
+			pfree(old);
+	}
+
+	rope_flat_evict(flat_cache.budget - flat->len);
+	slot = rope_flat_bucket(node);
+	flat->chain = *slot;
+	*slot = flat;
+	rope_flat_lru_push(flat);
+	flat_cache.n++;
+	flat_cache.used += flat->len;
+	atomic_store_explicit(&node->flat, true, memory_order_relaxed);
+	pthread_mutex_unlock(&flat_cache.lock);
+}
+
+static void
+rope_flat_drop(const Rope node) {
+	struct rope_flat *flat;
+
+	if (!atomic_load_explicit(&node->flat, memory_order_relaxed))
+		return;
+
+	pthread_mutex_lock(&flat_cache.lock);
+	if ((flat = rope_flat_find(node)))
+		rope_flat_remove(flat);
+	pthread_mutex_unlock(&flat_cache.lock);
+}
+
+void
+RopeSetFlatCache(size_t budget, size_t min_len) {
+	pthread_mutex_lock(&flat_cache.lock);
+	flat_cache.budget = budget;
+	flat_cache.min_len = min_len;
+	rope_flat_evict(budget);
+	if (!flat_cache.n && flat_cache.buckets) {
+		pfree(flat_cache.buckets);
+		flat_cache.buckets = NULL;
+		flat_cache.n_buckets = 0;
+	}
+	pthread_mutex_unlock(&flat_cache.lock);
+}
+
+size_t
+RopeFlatCacheSize(void) {
+	size_t used;
+
+	pthread_mutex_lock(&flat_cache.lock);
+	used = flat_cache.used;
+	pthread_mutex_unlock(&flat_cache.lock);
+
+	return used;
+}
+
+static size_t
+rope_collect_cstr(const Rope rope, char *ret_buf, size_t i) {
+	struct rope_flat *flat;
+
+	if (rope->kind == ROPE_LEAF_LZ) {
+		rope_lz_decode(rope, ret_buf + i);
+		return i + rope->len;
+	} else if (rope_is_leaf(rope)) {
+		memcpy(ret_buf + i, rope_leaf_str(rope), rope->len);
+		return i + rope->len;
+	} else if ((flat = rope_flat_pin(rope))) {
+		memcpy(ret_buf + i, flat->bytes, rope->len);
+		rope_flat_unpin(flat);
+		return i + rope->len;
+	} else if (rope->kind == ROPE_REPEAT) {
+		size_t done = rope->rep.child->len;
+
+		rope_collect_cstr(rope->rep.child, ret_buf, i);
+		/* double the copied part until it fills rope */
+		for (; done < rope->len; done *= 2)
+			memcpy(ret_buf + i + done, ret_buf + i,
+			       done < rope->len - done ? done : rope->len - done);
+	} else
+		rope_collect_cstr(rope->right, ret_buf,
+		                  rope_collect_cstr(rope->left, ret_buf, i));
+
+	if (flat_cache.budget &&
+	    atomic_load_explicit(&rope->ref_count, memory_order_relaxed) > 1)
+		rope_flat_put(rope, ret_buf + i);
+	return i + rope->len;
+}
+
+ssize_t
+RopeToString(const Rope rope, char *ret_buf, size_t buf_size) {
+	ssize_t rv;
+	INSTR_OP_BEGIN(ROPE_OP_TO_STRING);
+
+	if (rope->len >= buf_size)
+		rv = -1;
+	else {
+		rv = rope_collect_cstr(rope, ret_buf, 0);
+		ret_buf[rope->len] = '\0';
+		if (flat_cache.budget)
+			rope_flat_put(rope, ret_buf);
+		INSTR_ADD(to_string_bytes, rope->len);
+	}
+
+	INSTR_OP_END(ROPE_OP_TO_STRING);
+	return rv;
+}
+
+size_t
+RopeGetLen(const Rope rope) {
+	assert(rope);
+	return rope->len;
+}
+
+size_t
+RopeGetDepth(const Rope rope) {
+	assert(rope);
+	return rope_depth(rope);
+}
+
+struct rope_array {
+	Rope *items;
+	size_t n, cap;
+};
+
+static void
+rope_array_push(struct rope_array *array, Rope rope) {
+	if (array->n == array->cap) {
+		size_t cap = array->cap ? array->cap * 2 : 64;
+		Rope *items = palloc(sizeof(*items) * cap);
+
+		if (array->items) {
+			memcpy(items, array->items, sizeof(*items) * array->n);
+			pfree(array->items);
+		}
+		array->items = items;
+		array->cap = cap;
+	}
+
+	array->items[array->n++] = rope;
+}
+
+/*
+ * Memory accounting
+ *
+ * A rope is a DAG: the same node can be reached through several paths
+ * (e.g. RopeConcat(r, r)) and from other ropes. Traversal remembers visited
+ * nodes in an open addressing hash set so that each node is counted once.
+ */
+
+struct rope_set_entry {
+	Rope rope;
+	int hits;     /* number of paths reaching this node */
+	size_t depth; /* height of the subtree */
+	Rope value;   /* result of a transform of the node (rope_map) */
+	size_t pos;   /* position of the node (RopeDiff) */
+};
+
+struct rope_set {
+	size_t n, size; /* size is a power of 2 */
+	struct rope_set_entry *entries;
+};
+
+static void
+rope_set_init(struct rope_set *set) {
+	set->n = 0;
+	set->size = 64;
+	set->entries = palloc(sizeof(*set->entries) * set->size);
+	memset(set->entries, 0, sizeof(*set->entries) * set->size);
+}
+
+static void
+rope_set_fini(struct rope_set *set) {
+	pfree(set->entries);
+}
+
+static struct rope_set_entry *
+rope_set_slot(struct rope_set_entry *entries, size_t size, const Rope rope) {
+	size_t i = ((uintptr_t) rope >> 4) * 0x9E3779B97F4A7C15ull;
+
+	for (i &= size - 1; entries[i].rope && entries[i].rope != rope;
+	     i = (i + 1) & (size - 1))
+		;
+
+	return &entries[i];
+}
+
+/* return NULL if rope is not in set */
+static struct rope_set_entry *
+rope_set_find(const struct rope_set *set, const Rope rope) {
+	struct rope_set_entry *entry = rope_set_slot(set->entries, set->size, rope);
+
+	return entry->rope ? entry : NULL;
+}
+
+/* return the entry of rope, whose hits is 0 if rope is newly added */
+static struct rope_set_entry *
+rope_set_lookup(struct rope_set *set, const Rope rope) {
+	struct rope_set_entry *entry;
+
+	if ((set->n + 1) * 2 > set->size) {
+		size_t size = set->size * 2;
+		struct rope_set_entry *entries = palloc(sizeof(*entries) * size);
+
+		memset(entries, 0, sizeof(*entries) * size);
+		for (size_t i = 0; i < set->size; i++)
+			if (set->entries[i].rope)
+				*rope_set_slot(entries, size, set->entries[i].rope) =
+				    set->entries[i];
+
+		pfree(set->entries);
+		set->entries = entries;
+		set->size = size;
+	}
+
+	entry = rope_set_slot(set->entries, set->size, rope);
+	if (!entry->rope) {
+		entry->rope = rope;
+		set->n++;
+	}
+
+	return entry;
+}
+
+static size_t
+rope_node_size(const Rope rope) {
+	switch (rope->kind) {
+		case ROPE_LEAF:
+			return sizeof(*rope) + rope->cap + 1;
+		case ROPE_LEAF_LZ:
+			return sizeof(*rope) + rope->lz.clen;
+		case ROPE_LEAF_EXT:
+			return sizeof(*rope) + sizeof(RopeReleaseFunc);
+		case ROPE_CONCAT:
+		case ROPE_REPEAT:
+			break;
+	}
+
+	return sizeof(*rope);
+}
+
+/* count the nodes of rope into set and their leaves into stats, and return
+ * the height of rope; without recursion as rope may be arbitrarily deep, a
+ * node is pushed under a NULL and popped again for its height once its
+ * children have been visited */
+static size_t
+rope_collect_stats(const Rope rope, struct rope_set *set, RopeStats *stats) {
+	struct rope_array stack = {NULL, 0, 0};
+
+	rope_array_push(&stack, rope);
+	while (stack.n > 0) {
+		Rope node = stack.items[--stack.n];
+		struct rope_set_entry *entry;
+		size_t depth;
+
+		if (!node) {
+			node = stack.items[--stack.n];
+			if (node->kind == ROPE_REPEAT)
+				depth = rope_set_find(set, node->rep.child)->depth;
+			else {
+				size_t ldepth = node->left ? rope_set_find(set, node->left)->depth
+				                           : 0,
+				       rdepth = node->right
+				                    ? rope_set_find(set, node->right)->depth
+				                    : 0;
+
+				depth = ldepth > rdepth ? ldepth : rdepth;
+			}
+			rope_set_find(set, node)->depth = 1 + depth;
+			continue;
+		}
+
+		entry = rope_set_lookup(set, node);
+		if (entry->hits++ > 0)
+			continue;
+
+		if (rope_is_leaf(node)) {
+			int bucket = 0;
+
+			for (size_t len = node->len;
+			     len > 1 && bucket < ROPE_STATS_HIST_SIZE - 1; len >>= 1)
+				bucket++;
+
+			stats->n_leaves++;
+			stats->leaf_hist[bucket]++;
+			if (node->kind == ROPE_LEAF_LZ)
+				stats->n_compressed++;
+			else if (node->kind == ROPE_LEAF_EXT)
+				stats->external_size += node->len;
+			continue;
+		}
+
+		rope_array_push(&stack, node);
+		rope_array_push(&stack, NULL);
+		if (node->kind == ROPE_REPEAT)
+			rope_array_push(&stack, node->rep.child);
+		else {
+			if (node->right)
+				rope_array_push(&stack, node->right);
+			if (node->left)
+				rope_array_push(&stack, node->left);
+		}
+	}
+
+	pfree(stack.items);
+
+	return rope_set_find(set, rope)->depth;
+}
+
+void
+RopeGetStats(const Rope rope, RopeStats *stats) {
+	struct rope_set set;
+
+	assert(rope);
+
+	memset(stats, 0, sizeof(*stats));
+	stats->len = rope->len;
+
+	rope_set_init(&set);
+	stats->depth = rope_collect_stats(rope, &set, stats);
+
+	for (size_t i = 0; i < set.size; i++) {
+		struct rope_set_entry *entry = &set.entries[i];
+		size_t size;
+
+		if (!entry->rope)
+			continue;
+
+		size = rope_node_size(entry->rope);
+		stats->n_nodes++;
+		stats->size += size;
+
+		/* shared within this rope, or referenced from another rope */
+		if (entry->hits > 1 || entry->rope->ref_count > 1)
+			stats->shared_size += size;
+		else
+			stats->exclusive_size += size;
+	}
+
+	rope_set_fini(&set);
+}
+
+size_t
+RopeGetNodeSize(const Rope rope) {
+	assert(rope);
+	return rope_node_size(rope);
+}
+
+size_t
+RopeGetSize(const Rope rope) {
+	RopeStats stats;
+
+	RopeGetStats(rope, &stats);
+
+	return stats.size;
+}
+
+/* without recursion, like rope_collect_stats */
+static void
+rope_each_external(const Rope rope, struct rope_set *set,
+                   void (*func)(void *owner, void *arg), void *arg) {
+	struct rope_array stack = {NULL, 0, 0};
+
+	rope_array_push(&stack, rope);
+	while (stack.n > 0) {
+		Rope node = stack.items[--stack.n];
+
+		if (!node || !node->has_external ||
+		    rope_set_lookup(set, node)->hits++ > 0)
+			continue;
+
+		if (node->kind == ROPE_LEAF_EXT)
+			func(rope_external_base(node)->ext.owner, arg);
+		else if (node->kind == ROPE_REPEAT)
+			rope_array_push(&stack, node->rep.child);
+		else if (!rope_is_leaf(node)) {
+			rope_array_push(&stack, node->right);
+			rope_array_push(&stack, node->left);
+		}
+	}
+
+	pfree(stack.items);
+}
+
+void
+RopeEachExternal(const Rope rope, void (*func)(void *owner, void *arg),
+                 void *arg) {
+	struct rope_set set;
+
+	assert(rope);
+
+	if (!rope->has_external)
+		return;
+
+	rope_set_init(&set);
+	rope_each_external(rope, &set, func, arg);
+	rope_set_fini(&set);
+}
+
+static Rope rope_repeat(const Rope child, size_t count);
+static Rope rope_get_substr(const Rope rope, size_t i, size_t n);
+
+/* a part of a repeat node is a tail of the child, whole repetitions and a
+ * head of the child */
+static Rope
+rope_get_repeat_substr(const Rope rope, size_t i, size_t n) {
+	Rope child = rope->rep.child, rv = NULL, part;
+	size_t clen = child->len, off = i % clen, count;
+
+	if (off + n <= clen)
+		return rope_get_substr(child, off, n);
+
+	if (off > 0) {
+		rv = rope_get_substr(child, off, clen - off);
+		n -= clen - off;
+	}
+
+	if ((count = n / clen) > 0) {
+		part = rope_repeat(child, count);
+		rv = rv ? rope_concat_without_rec_ref(rv, part) : part;
+	}
+
+	if (n % clen > 0) {
+		part = rope_get_substr(child, 0, n % clen);
+		rv = rv ? rope_concat_without_rec_ref(rv, part) : part;
+	}
+
+	return rv;
+}
+
+static Rope
+rope_get_substr(const Rope rope, size_t i, size_t n) {
+	if (i == 0 && n == rope->len)
+		return rope_ref(rope);
+
+	if (rope->kind == ROPE_REPEAT)
+		return rope_get_repeat_substr(rope, i, n);
+
+	if (rope_is_leaf(rope)) {
+		if (rope->kind == ROPE_LEAF_EXT)
+			return rope_external_substr(rope, i, n);
+
+		return RopeCreate((char *) rope_leaf_str(rope) + i, n);
+	} else {
+		size_t llen = rope->left->len;
+
+		if (llen >= i + n)
+			return rope_get_substr(rope->left, i, n);
+		else if (llen <= i)
+			return rope_get_substr(rope->right, i - llen, n);
+		else
+			return rope_concat_without_rec_ref(
+			    rope_get_substr(rope->left, i, llen - i),
+			    rope_get_substr(rope->right, 0, n - llen + i));
+	}
+}
+
+Rope
+RopeSubstr(const Rope rope, size_t i, size_t n) {
+	Rope rv;
+	INSTR_OP_BEGIN(ROPE_OP_SUBSTR);
+	assert(rope);
+	assert(i + n <= rope->len);
+
+	rv = rope_get_substr(rope, i, n);
+
+	INSTR_OP_END(ROPE_OP_SUBSTR);
+	return rv;
+}
+
+Rope
+RopeDelete(const Rope rope, size_t i, size_t n) {
+	Rope left, right, ret_rope;
+	INSTR_OP_BEGIN(ROPE_OP_DELETE);
+	assert(rope);
+	assert(i + n <= rope->len);
+
+	if (i == 0)
+		ret_rope = RopeSubstr(rope, n, rope->len - n);
+	else if (i + n == rope->len)
+		ret_rope = RopeSubstr(rope, 0, i);
+	else {
+		left = RopeSubstr(rope, 0, i);
+		right = RopeSubstr(rope, i + n, rope->len - i - n);
+		ret_rope = RopeConcat(left, right);
+
+		RopeDestroy(left);
+		RopeDestroy(right);
+	}
+
+	INSTR_OP_END(ROPE_OP_DELETE);
+	return ret_rope;
+}
+
+char
+RopeIndex(const Rope rope, size_t i) {
+	Rope this = rope;
+	struct rope_flat *flat;
+	char c;
+	INSTR_OP_BEGIN(ROPE_OP_INDEX);
+	assert(rope);
+	assert(i < rope->len);
+
+	for (;;) {
+		INSTR_ADD(index_nodes_visited, 1);
+
+		if (this->kind == ROPE_LEAF) { /* read around a gap without closing it */
+			c = this->str[i < this->gap ? i : i + this->cap - this->len];
+			break;
+		} else if (rope_is_leaf(this)) {
+			c = rope_leaf_str(this)[i];
+			break;
+		} else if ((flat = rope_flat_pin(this))) {
+			c = flat->bytes[i];
+			rope_flat_unpin(flat);
+			break;
+		} else if (this->kind == ROPE_REPEAT) {
+			i %= this->rep.child->len;
+			this = this->rep.child;
+		} else {
+			size_t llen = this->left->len;
+
+			if (i < llen)
+				this = this->left;
+			else {
+				this = this->right;
+				i -= llen;
+			}
+		}
+	}
+
+	INSTR_OP_END(ROPE_OP_INDEX);
+	return c;
+}
+
+/*
+ * In-place append
+ *
+ * A rope owned by the caller alone is modified instead of copied: bytes go
+ * into the spare capacity of its rightmost leaf, and a new leaf (with slack
+ * growing with the rope) is hung on the right spine where it keeps the tree
+ * balanced. Shared ropes are left intact and concatenated as usual.
+ */
+
+/* return false if the rightmost leaf is shared or has no room for len */
+static bool
+rope_append_to_leaf(Rope rope, const char *str, size_t len) {
+	if (rope->ref_count != 1)
+		return false;
+
+	if (rope_is_leaf(rope)) {
+		if (rope->kind != ROPE_LEAF || rope->cap - rope->len < len)
+			return false;
+
+		rope_close_gaps(rope);
+		memcpy(rope->str + rope->len, str, len);
+		rope->len += len;
+		rope->gap = rope->len;
+		rope->str[rope->len] = '\0';
+		return true;
+	}
+
+	if (rope->kind != ROPE_CONCAT || !rope->right ||
+	    !rope_append_to_leaf(rope->right, str, len))
+		return false;
+
+	rope_flat_drop(rope);
+	rope->len += len;
+	return true;
+}
+
+static Rope
+rope_append_node(Rope rope, Rope leaf) {
+	if (rope->ref_count == 1 && rope->kind == ROPE_CONCAT && rope->left &&
+	    rope->right && rope->right->len + leaf->len <= rope->left->len) {
+		rope_flat_drop(rope);
+		rope->has_external |= leaf->has_external;
+		rope->has_gap |= leaf->has_gap;
+		rope->right = rope_append_node(rope->right, leaf);
+		rope->len += leaf->len;
+		rope_set_depth(rope, rope->left->depth > rope->right->depth
+		                         ? rope->left->depth
+		                         : rope->right->depth);
+		return rope;
+	}
+
+	return rope_concat_without_rec_ref(rope, leaf);
+}
+
+Rope
+RopeAppendInPlace(Rope rope, const char *str, size_t len) {
+	Rope leaf;
+	size_t slack;
+	INSTR_OP_BEGIN(ROPE_OP_APPEND);
+	assert(rope);
+
+	if (rope_append_to_leaf(rope, str, len)) {
+		INSTR_OP_END(ROPE_OP_APPEND);
+		return rope;
+	}
+
+	slack = rope->len + len < ROPE_APPEND_MAX_SLACK ? rope->len + len
+	                                                 : ROPE_APPEND_MAX_SLACK;
+	leaf = rope_leaf_alloc(len, len + slack);
+	memcpy(leaf->str, str, len);
+
+	if (rope->len == 0) {
+		RopeDestroy(rope);
+		rope = leaf;
+	} else
+		rope = rope_append_node(rope, leaf);
+
+	INSTR_OP_END(ROPE_OP_APPEND);
+	return rope;
+}
+
+Rope
+RopeAppendRope(Rope rope, const Rope other) {
+	INSTR_OP_BEGIN(ROPE_OP_APPEND);
+	assert(rope && other);
+
+	if (other->len == 0) {
+		INSTR_OP_END(ROPE_OP_APPEND);
+		return rope;
+	}
+	if (rope->len == 0) {
+		rope_deref(rope);
+		rope = rope_ref(other);
+	} else
+		rope = rope_append_node(rope, rope_ref(other));
+
+	INSTR_OP_END(ROPE_OP_APPEND);
+	return rope;
+}
+
+/*
+ * Concurrent appender
+ *
+ * Writers reserve room in the current chunk, a ROPE_LEAF of
+ * ROPE_APPENDER_CHUNK bytes, by one atomic add, copy their bytes in
+ * parallel and publish them in the order of their reservations. The writer
+ * whose reservation runs past the end closes the chunk: once the writers
+ * before it have published, the chunk becomes a plain leaf of the bytes
+ * written, and a new chunk starting with the closer's bytes is installed.
+ *
+ * Closed chunks are kept as a binary counter of balanced subtrees, so a
+ * snapshot concatenates O(log n) of them and a view of the published part
+ * of the current chunk. app->lock is taken only to close a chunk and to
+ * take a snapshot, never by a writer which fits in the current chunk.
+ */
+struct rope_chunk {
+	Rope leaf;                 /* len is 0 until closed */
+	size_t cap;                /* of leaf, which may be freed once closed */
+	atomic_size_t reserved;    /* bytes handed out, may run past cap */
+	atomic_size_t published;   /* bytes written, in order of reservation */
+	struct rope_chunk *prev;   /* freed with the appender: late writers may
+	                            * still add to reserved */
+};
+
+struct rope_appender_tag {
+	pthread_mutex_t lock;
+	_Atomic(struct rope_chunk *) chunk;
+	Rope closed[64];           /* subtrees of closed chunks, oldest first */
+	size_t n_chunks[64];       /* chunks in each subtree */
+	int n_closed;
+};
+
+static struct rope_chunk *
+rope_chunk_new(size_t cap, struct rope_chunk *prev) {
+	struct rope_chunk *chunk = palloc(sizeof(*chunk));
+
+	chunk->leaf = rope_leaf_alloc(0, cap);
+	chunk->cap = cap;
+	atomic_init(&chunk->reserved, 0);
+	atomic_init(&chunk->published, 0);
+	chunk->prev = prev;
+
+	return chunk;
+}
+
+static void
+rope_chunk_wait(atomic_size_t *published, size_t pos) {
+	while (atomic_load_explicit(published, memory_order_acquire) != pos)
+		sched_yield();
+}
+
+RopeAppender
+RopeAppenderCreate(void) {
+	RopeAppender app = palloc(sizeof(*app));
+
+	pthread_mutex_init(&app->lock, NULL);
+	atomic_init(&app->chunk, rope_chunk_new(ROPE_APPENDER_CHUNK, NULL));
+	app->n_closed = 0;
+
+	return app;
+}
+
+/* called with app->lock held */
+static void
+rope_appender_push(RopeAppender app, Rope leaf) {
+	int n = app->n_closed;
+
+	app->closed[n] = leaf;
+	app->n_chunks[n++] = 1;
+	while (n > 1 && app->n_chunks[n - 2] <= app->n_chunks[n - 1]) {
+		app->closed[n - 2] =
+		    rope_concat_without_rec_ref(app->closed[n - 2], app->closed[n - 1]);
+		app->n_chunks[n - 2] += app->n_chunks[n - 1];
+		n--;
+	}
+	app->n_closed = n;
+}
+
+/* close chunk, whose bytes end at end, and install a new one starting with
+ * str */
+static void
+rope_appender_close(RopeAppender app, struct rope_chunk *chunk, size_t end,
+                    const char *str, size_t len) {
+	struct rope_chunk *next = rope_chunk_new(
+	    len > ROPE_APPENDER_CHUNK ? len : ROPE_APPENDER_CHUNK, chunk);
+	Rope leaf = chunk->leaf;
+
+	memcpy(next->leaf->str, str, len);
+	atomic_store_explicit(&next->reserved, len, memory_order_relaxed);
+	atomic_store_explicit(&next->published, len, memory_order_relaxed);
+
+	rope_chunk_wait(&chunk->published, end);
+
+	pthread_mutex_lock(&app->lock);
+	leaf->len = leaf->gap = end;
+	leaf->str[end] = '\0';
+	if (end > 0)
+		rope_appender_push(app, leaf);
+	else
+		rope_deref(leaf);
+	atomic_store_explicit(&app->chunk, next, memory_order_release);
+	pthread_mutex_unlock(&app->lock);
+}
+
+void
+RopeAppenderAppend(RopeAppender app, const char *str, size_t len) {
+	struct rope_chunk *chunk;
+	size_t pos, cap;
+	INSTR_OP_BEGIN(ROPE_OP_APPEND);
+
+	for (;;) {
+		chunk = atomic_load_explicit(&app->chunk, memory_order_acquire);
+		cap = chunk->cap;
+		pos = atomic_fetch_add(&chunk->reserved, len);
+
+		if (pos + len <= cap) {
+			memcpy(chunk->leaf->str + pos, str, len);
+			rope_chunk_wait(&chunk->published, pos);
+			atomic_store_explicit(&chunk->published, pos + len,
+			                      memory_order_release);
+			break;
+		}
+
+		if (pos <= cap) {
+			rope_appender_close(app, chunk, pos, str, len);
+			break;
+		}
+
+		/* another writer is closing the chunk */
+		while (atomic_load_explicit(&app->chunk, memory_order_acquire) == chunk)
+			sched_yield();
+	}
+
+	INSTR_OP_END(ROPE_OP_APPEND);
+}
+
+Rope
+RopeAppenderSnapshot(RopeAppender app) {
+	struct rope_chunk *chunk;
+	Rope rope = NULL, part;
+	size_t len;
+
+	pthread_mutex_lock(&app->lock);
+	for (int k = 0; k < app->n_closed; k++)
+		rope = rope ? rope_concat_without_rec_ref(rope, rope_ref(app->closed[k]))
+		            : rope_ref(app->closed[k]);
+
+	chunk = atomic_load_explicit(&app->chunk, memory_order_acquire);
+	len = atomic_load_explicit(&chunk->published, memory_order_acquire);
+	if (len > 0) {
+		part = rope_view(chunk->leaf->str, len, rope_ref(chunk->leaf));
+		rope = rope ? rope_concat_without_rec_ref(rope, part) : part;
+	}
+	pthread_mutex_unlock(&app->lock);
+
+	return rope ? rope : RopeCreate((char *) "", 0);
+}
+
+void
+RopeAppenderDestroy(RopeAppender app) {
+	struct rope_chunk *chunk = atomic_load(&app->chunk), *prev;
+
+	rope_deref(chunk->leaf);
+	for (; chunk; chunk = prev) {
+		prev = chunk->prev;
+		pfree(chunk);
+	}
+	for (int k = 0; k < app->n_closed; k++)
+		rope_deref(app->closed[k]);
+	pthread_mutex_destroy(&app->lock);
+	pfree(app);
+}
+
+/*
+ * In-place splice
+ *
+ * Like append, an edit of a rope owned by the caller alone is made in the
+ * leaf it falls in: the gap of the leaf is moved to the edit and takes the
+ * deleted bytes or gives room for the inserted ones. A short leaf without
+ * room is rebuilt with a gap, and otherwise the edited range is replaced by
+ * a new leaf with a gap, so a run of edits at a cursor copies little.
+ */
+
+/* a leaf of leaf[0, i) + str + leaf[i + n, len) with the gap after str */
+static Rope
+rope_gap_leaf(const Rope leaf, size_t i, size_t n, const char *str,
+              size_t len) {
+	size_t tail = leaf ? leaf->len - i - n : 0, rlen = i + len + tail,
+	       cap = rlen + ROPE_GAP_SLACK;
+	const char *src = leaf ? rope_leaf_str(leaf) : NULL;
+	Rope rope = rope_leaf_alloc(rlen, cap);
+
+	rope->gap = i + len;
+	rope->has_gap = tail > 0;
+	if (i > 0)
+		memcpy(rope->str, src, i);
+	memcpy(rope->str + i, str, len);
+	if (tail > 0)
+		memcpy(rope->str + cap - tail, src + i + n, tail);
+	rope->str[cap] = '\0';
+
+	return rope;
+}
+
+/* return false unless the edit is made in the leaf at *slot or below it */
+static bool
+rope_splice_in_place(Rope *slot, size_t i, size_t n, const char *str,
+                     size_t len) {
+	Rope rope = *slot;
+	size_t llen;
+
+	if (rope_is_leaf(rope)) {
+		if (rope->kind == ROPE_LEAF && rope->ref_count == 1 &&
+		    rope->cap - rope->len + n >= len) {
+			rope_gap_move(rope, i);
+			memcpy(rope->str + i, str, len);
+			rope->len = rope->len - n + len;
+			rope->gap = i + len;
+			rope->has_gap = rope->gap != rope->len;
+			if (!rope->has_gap)
+				rope->str[rope->len] = '\0';
+			return true;
+		}
+
+		/* the leaf may be shared, it is the reference at slot which is ours */
+		if (rope->len - n + len > ROPE_GAP_MAX_LEAF_LEN)
+			return false;
+		*slot = rope_gap_leaf(rope, i, n, str, len);
+		rope_deref(rope);
+		return true;
+	}
+
+	if (rope->ref_count != 1 || rope->kind != ROPE_CONCAT || !rope->left ||
+	    !rope->right)
+		return false;
+
+	/* an insertion between the children goes to the end of the left one */
+	llen = rope->left->len;
+	if (!(i + n <= llen && rope_splice_in_place(&rope->left, i, n, str, len)) &&
+	    !(i >= llen && rope_splice_in_place(&rope->right, i - llen, n, str, len)))
+		return false;
+
+	rope_flat_drop(rope);
+	rope->len = rope->len - n + len;
+	rope->has_gap = rope->left->has_gap || rope->right->has_gap;
+	rope->has_external = rope->left->has_external || rope->right->has_external;
+	return true;
+}
+
+Rope
+RopeSpliceInPlace(Rope rope, size_t i, size_t n, const char *str, size_t len) {
+	Rope left = NULL, mid, right = NULL, rv;
+	INSTR_OP_BEGIN(ROPE_OP_SPLICE);
+	assert(rope);
+	assert(i + n <= rope->len);
+
+	if (rope_splice_in_place(&rope, i, n, str, len)) {
+		INSTR_OP_END(ROPE_OP_SPLICE);
+		return rope;
+	}
+
+	if (i > 0)
+		left = rope_get_substr(rope, 0, i);
+	if (i + n < rope->len)
+		right = rope_get_substr(rope, i + n, rope->len - i - n);
+	rope_deref(rope);
+
+	mid = rope_gap_leaf(NULL, 0, 0, str, len);
+	rv = left ? RopeConcat(left, mid) : rope_ref(mid);
+	rope_deref(left);
+	rope_deref(mid);
+	if (right) {
+		mid = rv;
+		rv = RopeConcat(mid, right);
+		rope_deref(mid);
+		rope_deref(right);
+	}
+
+	INSTR_OP_END(ROPE_OP_SPLICE);
+	return rv;
+}
+
+/*
+ * Reading
+ *
+ * Bytes are read straight into the str of leaves, so they are copied once
+ * from the kernel. A leaf is filled before the next one is started, and
+ * leaves grow from ROPE_READ_MIN_LEAF_LEN so that short inputs do not waste
+ * a large leaf while long ones get few nodes; at most half of the last leaf
+ * is left unused.
+ */
+
+/* return a leaf filled from fd up to cap bytes, NULL if nothing is read at
+ * the end of input or on an error (with *error set to errno); a read() or
+ * wait interrupted by a signal sets *interrupted and returns what has been
+ * read, so that the caller can handle the signal */
+static Rope
+rope_read_leaf(int fd, size_t cap, int *error, bool *interrupted) {
+	Rope leaf = rope_leaf_alloc(0, cap);
+
+	*interrupted = false;
+	while (leaf->len < cap) {
+		ssize_t n = read(fd, leaf->str + leaf->len, cap - leaf->len);
+
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			/* a non-blocking descriptor is waited on as a blocking one */
+			struct pollfd pfd = {fd, POLLIN, 0};
+
+			if (poll(&pfd, 1, -1) >= 0)
+				continue;
+		}
+		if (n < 0 && errno == EINTR) {
+			*interrupted = true;
+			break;
+		}
+		if (n < 0)
+			*error = errno;
+		if (n <= 0)
+			break;
+		leaf->len += n;
+	}
+
+	if (leaf->len == 0) {
+		pfree(leaf);
+		return NULL;
+	}
+
+	leaf->gap = leaf->len;
+	leaf->str[leaf->len] = '\0';
+	return leaf;
+}
+
+static size_t
+rope_read_next_cap(size_t cap, size_t left) {
+	cap = cap ? (cap < ROPE_READ_MAX_LEAF_LEN ? cap * 2 : cap)
+	          : ROPE_READ_MIN_LEAF_LEN;
+
+	return cap < left ? cap : left;
+}
+
+Rope
+RopeReadFdInterruptible(int fd, size_t max_bytes, bool *interrupted) {
+	Rope rope = NULL, leaf;
+	size_t cap = 0;
+	int error = 0;
+	bool intr = false, eof = false;
+
+	while (!error && !eof && (!rope || rope->len < max_bytes)) {
+		cap = rope_read_next_cap(cap, max_bytes - (rope ? rope->len : 0));
+		leaf = rope_read_leaf(fd, cap, &error, &intr);
+		/* a leaf is filled unless read() has reached the end */
+		eof = !intr && (!leaf || leaf->len < cap);
+		if (leaf)
+			rope = rope ? rope_append_node(rope, leaf) : leaf;
+		if (intr && interrupted)
+			break;
+	}
+	if (interrupted)
+		*interrupted = intr;
+
+	if (error) {
+		elog("read failed");
+		rope_deref(rope);
+		errno = error;
+		return NULL;
+	}
+
+	return rope ? rope : RopeCreate((char *) "", 0);
+}
+
+Rope
+RopeReadFd(int fd, size_t max_bytes) {
+	return RopeReadFdInterruptible(fd, max_bytes, NULL);
+}
+
+struct rope_reader_tag {
+	int fd;
+	size_t max_bytes;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	Rope queue[ROPE_READER_QUEUE_LEN]; /* leaves read, not yet taken */
+	size_t head, n;
+	int error;
+	bool done;        /* the thread has read everything */
+	bool stopped;     /* the consumer has gone, set by RopeReaderFinish */
+	bool interrupted; /* set by RopeReaderInterrupt until a Next returns */
+};
+
+static void
+rope_reader_free(RopeReader reader) {
+	for (size_t k = 0; k < reader->n; k++)
+		rope_deref(reader->queue[(reader->head + k) % ROPE_READER_QUEUE_LEN]);
+	pthread_mutex_destroy(&reader->lock);
+	pthread_cond_destroy(&reader->cond);
+	pfree(reader);
+}
+
+static void *
+rope_reader_main(void *arg) {
+	RopeReader reader = arg;
+	size_t cap = 0, left = reader->max_bytes;
+	int error = 0;
+	bool stopped = false, eof = false, intr;
+
+	while (!stopped && !eof && left > 0) {
+		Rope leaf;
+
+		cap = rope_read_next_cap(cap, left);
+		/* signals are for the consumer, the thread reads on */
+		if (!(leaf = rope_read_leaf(reader->fd, cap, &error, &intr))) {
+			if (intr)
+				continue;
+			break;
+		}
+		left -= leaf->len;
+		eof = !intr && leaf->len < cap;
+
+		pthread_mutex_lock(&reader->lock);
+		while (reader->n == ROPE_READER_QUEUE_LEN && !reader->stopped)
+			pthread_cond_wait(&reader->cond, &reader->lock);
+		if (!(stopped = reader->stopped)) {
+			reader->queue[(reader->head + reader->n) % ROPE_READER_QUEUE_LEN] =
+			    leaf;
+			reader->n++;
+			pthread_cond_broadcast(&reader->cond);
+		}
+		pthread_mutex_unlock(&reader->lock);
+
+		if (stopped)
+			rope_deref(leaf);
+	}
+
+	pthread_mutex_lock(&reader->lock);
+	reader->done = true;
+	reader->error = error;
+	stopped = reader->stopped;
+	pthread_cond_broadcast(&reader->cond);
+	pthread_mutex_unlock(&reader->lock);
+
+	/* the consumer has detached the thread and left the reader to it */
+	if (stopped)
+		rope_reader_free(reader);
+
+	return NULL;
+}
+
+RopeReader
+RopeReaderStart(int fd, size_t max_bytes) {
+	RopeReader reader = palloc(sizeof(*reader));
+
+	reader->fd = fd;
+	reader->max_bytes = max_bytes;
+	reader->head = reader->n = 0;
+	reader->error = 0;
+	reader->done = reader->stopped = reader->interrupted = false;
+	pthread_mutex_init(&reader->lock, NULL);
+	pthread_cond_init(&reader->cond, NULL);
+
+	if (pthread_create(&reader->thread, NULL, rope_reader_main, reader) != 0) {
+		elog("RopeReaderStart: cannot start a thread");
+		pthread_mutex_destroy(&reader->lock);
+		pthread_cond_destroy(&reader->cond);
+		pfree(reader);
+		return NULL;
+	}
+
+	return reader;
+}
+
+Rope
+RopeReaderNext(RopeReader reader) {
+	Rope leaf = NULL;
+
+	assert(reader);
+
+	pthread_mutex_lock(&reader->lock);
+	while (reader->n == 0 && !reader->done && !reader->interrupted)
+		pthread_cond_wait(&reader->cond, &reader->lock);
+	reader->interrupted = false;
+	if (reader->n > 0) {
+		leaf = reader->queue[reader->head];
+		reader->head = (reader->head + 1) % ROPE_READER_QUEUE_LEN;
+		reader->n--;
+		pthread_cond_broadcast(&reader->cond);
+	}
+	pthread_mutex_unlock(&reader->lock);
+
+	return leaf;
+}
+
+void
+RopeReaderInterrupt(RopeReader reader) {
+	assert(reader);
+
+	pthread_mutex_lock(&reader->lock);
+	reader->interrupted = true;
+	pthread_cond_broadcast(&reader->cond);
+	pthread_mutex_unlock(&reader->lock);
+}
+
+bool
+RopeReaderAtEnd(RopeReader reader) {
+	bool at_end;
+
+	assert(reader);
+
+	pthread_mutex_lock(&reader->lock);
+	at_end = reader->done && reader->n == 0;
+	pthread_mutex_unlock(&reader->lock);
+
+	return at_end;
+}
+
+int
+RopeReaderFinish(RopeReader reader) {
+	pthread_t thread;
+	int error;
+	bool done;
+
+	assert(reader);
+
+	pthread_mutex_lock(&reader->lock);
+	thread = reader->thread;
+	done = reader->done;
+	error = reader->error;
+	reader->stopped = true;
+	pthread_cond_broadcast(&reader->cond);
+	pthread_mutex_unlock(&reader->lock);
+
+	/* a thread blocked in read() frees the reader when it returns */
+	if (!done) {
+		pthread_detach(thread);
+		return 0;
+	}
+
+	pthread_join(thread, NULL);
+	rope_reader_free(reader);
+
+	return error;
+}
+
+/*
+ * Repetition
+ *
+ * A ROPE_REPEAT node stands for its child repeated count times without
+ * copying it, and positions in the node are mapped into the child.
+ */
+static Rope
+rope_repeat(const Rope child, size_t count) {
+	Rope rope, base = child;
+
+	if (count == 1)
+		return rope_ref(child);
+
+	if (base->kind == ROPE_REPEAT) {
+		count *= base->rep.count;
+		base = base->rep.child;
+	}
+
+	rope = palloc(sizeof(*rope));
+	rope->kind = ROPE_REPEAT;
+	rope->has_external = base->has_external;
+	rope->has_gap = false;
+	rope_set_depth(rope, base->depth);
+	atomic_init(&rope->ref_count, 1);
+	atomic_init(&rope->flat, false);
+	rope->len = base->len * count;
+	rope->rep.child = rope_ref(base);
+	rope->rep.count = count;
+
+	return rope;
+}
+
+Rope
+RopeRepeat(const Rope rope, size_t count) {
+	assert(rope);
+
+	if (count == 0 || rope->len == 0)
+		return RopeCreate((char *) "", 0);
+
+	if (rope->len > SIZE_MAX / count) {
+		elog("RopeRepeat: too long");
+		return NULL;
+	}
+
+	return rope_repeat(rope, count);
+}
+
+/* return NULL if str does not shrink enough under policy */
+static Rope
+rope_lz_create(const char *str, size_t len, const RopeCompactPolicy *policy) {
+	size_t bound = LZ_COMPRESS_BOUND(len), clen;
+	char *buf = palloc(bound);
+	Rope rope;
+
+	clen = LzCompress(str, len, buf, bound);
+	if (clen == 0 || clen * 100 > len * policy->max_ratio) {
+		pfree(buf);
+		return NULL;
+	}
+
+	rope = palloc(sizeof(*rope) + clen);
+	rope->kind = ROPE_LEAF_LZ;
+	rope->has_external = rope->has_gap = false;
+	rope->depth = 0;
+	atomic_init(&rope->ref_count, 1);
+	atomic_init(&rope->flat, false);
+	rope->len = len;
+	rope->lz.clen = clen;
+	rope->lz.id = atomic_fetch_add(&rope_lz_last_id, 1) + 1;
+	memcpy(rope->str, buf, clen);
+	pfree(buf);
+
+	return rope;
+}
+
+/* return NULL if nothing in rope is compressed */
+static Rope
+rope_compact(const Rope rope, const RopeCompactPolicy *policy) {
+	Rope left, right;
+
+	if (!rope)
+		return NULL;
+
+	switch (rope->kind) {
+		case ROPE_LEAF:
+			if (rope->len < policy->min_leaf_len)
+				return NULL;
+			return rope_lz_create(rope_leaf_str(rope), rope->len, policy);
+		case ROPE_LEAF_LZ:
+		case ROPE_LEAF_EXT: /* the owner keeps the bytes anyway */
+			return NULL;
+		case ROPE_REPEAT:
+			if (!(left = rope_compact(rope->rep.child, policy)))
+				return NULL;
+			right = rope_repeat(left, rope->rep.count);
+			RopeDestroy(left);
+			return right;
+		case ROPE_CONCAT:
+			break;
+	}
+
+	left = rope_compact(rope->left, policy);
+	right = rope_compact(rope->right, policy);
+
+	if (!left && !right)
+		return NULL;
+
+	if (!left && rope->left)
+		left = rope_ref(rope->left);
+	if (!right && rope->right)
+		right = rope_ref(rope->right);
+
+	return rope_concat_without_rec_ref(left, right);
+}
+
+Rope
+RopeCompact(const Rope rope, const RopeCompactPolicy *policy) {
+	RopeCompactPolicy default_policy = {ROPE_COMPACT_MIN_LEAF_LEN,
+	                                    ROPE_COMPACT_MAX_RATIO};
+	Rope rv;
+
+	assert(rope);
+
+	rv = rope_compact(rope, policy ? policy : &default_policy);
+
+	return rv ? rv : rope_ref(rope);
+}
+
+/*
+ * Rebalancing
+ *
+ * RopeRebalance rebuilds a rope from its leaves (repeat nodes are kept as
+ * they are) with short leaves merged, in O(n_leaves). RopeConcat may also
+ * do a bounded number of AVL like rotations and merges of short leaves
+ * per call (RopeSetRebalanceSteps), which keeps ropes built by
+ * concatenation alone from degenerating.
+ */
+#define ROPE_REBALANCE_DEPTH_SLACK 4
+
+static Rope
+rope_merge_leaves(Rope left, Rope right) {
+	char buf[ROPE_REBALANCE_MIN_LEAF_LEN * 2];
+	Rope rope;
+
+	memcpy(buf, rope_leaf_str(left), left->len);
+	memcpy(buf + left->len, rope_leaf_str(right), right->len);
+	rope = RopeCreate(buf, left->len + right->len);
+	rope_deref(left);
+	rope_deref(right);
+
+	return rope;
+}
+
+/* concat left and right (taking over the references), spending budget on
+ * rotations which keep the heights of siblings within 1 */
+static Rope
+rope_join(Rope left, Rope right, size_t *budget) {
+	Rope a, b, t, rv;
+
+	if (!left || !right || *budget == 0)
+		return rope_concat_without_rec_ref(left, right);
+
+	/* leaves made by merging are at least MIN_LEAF_LEN long before the next
+	 * leaf is started */
+	if (rope_is_leaf(left) && rope_is_leaf(right) &&
+	    left->len + right->len < ROPE_REBALANCE_MIN_LEAF_LEN * 2) {
+		(*budget)--;
+		return rope_merge_leaves(left, right);
+	}
+
+	/* or into the adjacent leaf of the other side */
+	if (left->kind == ROPE_CONCAT && rope_is_leaf(right) && left->right &&
+	    rope_is_leaf(left->right) &&
+	    left->right->len + right->len < ROPE_REBALANCE_MIN_LEAF_LEN * 2) {
+		(*budget)--;
+		a = rope_ref(left->left);
+		b = rope_ref(left->right);
+		rope_deref(left);
+		return rope_concat_without_rec_ref(a, rope_merge_leaves(b, right));
+	}
+
+	if (right->kind == ROPE_CONCAT && rope_is_leaf(left) && right->left &&
+	    rope_is_leaf(right->left) &&
+	    left->len + right->left->len < ROPE_REBALANCE_MIN_LEAF_LEN * 2) {
+		(*budget)--;
+		a = rope_ref(right->left);
+		b = rope_ref(right->right);
+		rope_deref(right);
+		return rope_concat_without_rec_ref(rope_merge_leaves(left, a), b);
+	}
+
+	if (left->depth > right->depth + 1 && left->kind == ROPE_CONCAT) {
+		(*budget)--;
+		a = rope_ref(left->left);
+		b = rope_ref(left->right);
+		rope_deref(left);
+
+		t = rope_join(b, right, budget);
+		if (t->depth <= rope_depth(a) + 1 || t->kind != ROPE_CONCAT)
+			return rope_concat_without_rec_ref(a, t);
+
+		rv = rope_concat_without_rec_ref(
+		    rope_concat_without_rec_ref(a, rope_ref(t->left)),
+		    rope_ref(t->right));
+		rope_deref(t);
+		return rv;
+	}
+
+	if (right->depth > left->depth + 1 && right->kind == ROPE_CONCAT) {
+		(*budget)--;
+		a = rope_ref(right->left);
+		b = rope_ref(right->right);
+		rope_deref(right);
+
+		t = rope_join(left, a, budget);
+		if (t->depth <= rope_depth(b) + 1 || t->kind != ROPE_CONCAT)
+			return rope_concat_without_rec_ref(t, b);
+
+		rv = rope_concat_without_rec_ref(
+		    rope_ref(t->left),
+		    rope_concat_without_rec_ref(rope_ref(t->right), b));
+		rope_deref(t);
+		return rv;
+	}
+
+	return rope_concat_without_rec_ref(left, right);
+}
+
+void
+RopeSetRebalanceSteps(size_t steps) {
+	rebalance_steps = steps;
+}
+
+/* call func with leaves and repeat nodes of rope from left to right,
+ * without recursion as rope may be arbitrarily deep */
+static void
+rope_each_piece(const Rope rope, void (*func)(Rope piece, void *arg),
+                void *arg) {
+	struct rope_array stack = {NULL, 0, 0};
+
+	rope_array_push(&stack, rope);
+	while (stack.n > 0) {
+		Rope node = stack.items[--stack.n];
+
+		if (!node)
+			continue;
+
+		if (node->kind == ROPE_CONCAT) {
+			rope_array_push(&stack, node->right);
+			rope_array_push(&stack, node->left);
+		} else
+			func(node, arg);
+	}
+
+	pfree(stack.items);
+}
+
+struct rope_rebalance_state {
+	struct rope_array pieces;
+	char run[ROPE_REBALANCE_MAX_LEAF_LEN]; /* bytes of short leaves */
+	size_t run_len, n_run;
+	Rope run_first;
+};
+
+static void
+rope_rebalance_flush(struct rope_rebalance_state *state) {
+	if (state->n_run == 1)
+		rope_array_push(&state->pieces, rope_ref(state->run_first));
+	else if (state->n_run > 1)
+		rope_array_push(&state->pieces, RopeCreate(state->run, state->run_len));
+
+	state->run_len = state->n_run = 0;
+}
+
+static void
+rope_rebalance_piece(Rope piece, void *arg) {
+	struct rope_rebalance_state *state = arg;
+
+	if (!rope_is_leaf(piece) || piece->len >= ROPE_REBALANCE_MIN_LEAF_LEN) {
+		rope_rebalance_flush(state);
+		rope_array_push(&state->pieces, rope_ref(piece));
+		return;
+	}
+
+	if (state->run_len + piece->len > ROPE_REBALANCE_MAX_LEAF_LEN)
+		rope_rebalance_flush(state);
+	if (state->n_run++ == 0)
+		state->run_first = piece;
+	memcpy(state->run + state->run_len, rope_leaf_str(piece), piece->len);
+	state->run_len += piece->len;
+}
+
+static Rope
+rope_build_balanced(Rope *pieces, size_t n) {
+	if (n == 1)
+		return pieces[0];
+
+	return rope_concat_without_rec_ref(rope_build_balanced(pieces, n / 2),
+	                                   rope_build_balanced(pieces + n / 2,
+	                                                       n - n / 2));
+}
+
+Rope
+RopeRebalance(const Rope rope) {
+	struct rope_rebalance_state *state = palloc(sizeof(*state));
+	Rope rv;
+
+	assert(rope);
+
+	memset(state, 0, sizeof(*state));
+	rope_each_piece(rope, rope_rebalance_piece, state);
+	rope_rebalance_flush(state);
+
+	rv = state->pieces.n > 0
+	         ? rope_build_balanced(state->pieces.items, state->pieces.n)
+	         : RopeCreate((char *) "", 0);
+
+	if (state->pieces.items)
+		pfree(state->pieces.items);
+	pfree(state);
+
+	return rv;
+}
+
+static void
+rope_count_short(Rope piece, void *arg) {
+	size_t *counts = arg; /* leaves, short leaves */
+
+	if (!rope_is_leaf(piece))
+		return;
+
+	counts[0]++;
+	if (piece->len < ROPE_REBALANCE_MIN_LEAF_LEN)
+		counts[1]++;
+}
+
+bool
+RopeNeedsRebalance(const Rope rope) {
+	size_t balanced = 0, counts[2] = {0, 0};
+
+	assert(rope);
+
+	for (size_t n = rope->len / ROPE_REBALANCE_MIN_LEAF_LEN; n > 1; n >>= 1)
+		balanced++;
+
+	if (rope->depth > 2 * balanced + ROPE_REBALANCE_DEPTH_SLACK)
+		return true;
+
+	rope_each_piece(rope, rope_count_short, counts);
+
+	return counts[1] > 1 && counts[1] * 2 > counts[0];
+}
+
+/*
+ * Byte transforms
+ *
+ * Each distinct leaf is mapped once (by several threads if asked), and
+ * only nodes above changed leaves are rebuilt, so leaves the transform
+ * keeps as they are, and whole subtrees of them, are shared with the
+ * source. Case conversion handles 8 bytes at a time in a uint64_t.
+ */
+
+/* shorter ropes are mapped on the calling thread alone */
+#define ROPE_MAP_PARALLEL_MIN_LEN (1 << 20)
+#define ROPE_MAP_ONES 0x0101010101010101ull
+
+typedef enum {
+	ROPE_MAP_TABLE,
+	ROPE_MAP_UPCASE,
+	ROPE_MAP_DOWNCASE,
+} rope_map_kind;
+
+struct rope_map {
+	rope_map_kind kind;
+	const unsigned char *table;
+	struct rope_set memo;     /* value is the mapped node, NULL if unchanged */
+	struct rope_array leaves; /* distinct leaves */
+	Rope *mapped;             /* for each of leaves */
+	atomic_size_t next_leaf;
+};
+
+/* flip the case of ASCII bytes in [lo, hi] */
+static inline uint64_t
+rope_map_case_word(uint64_t w, unsigned char lo, unsigned char hi) {
+	uint64_t low7 = w & (ROPE_MAP_ONES * 0x7f),
+	         ge = low7 + ROPE_MAP_ONES * (0x80 - lo),
+	         gt = low7 + ROPE_MAP_ONES * (0x7f - hi),
+	         in_range = ge & ~gt & ~w & (ROPE_MAP_ONES * 0x80);
+
+	return w ^ (in_range >> 2);
+}
+
+/* map len bytes of src to dst (which may be src), return false if no byte
+ * is changed */
+static bool
+rope_map_bytes(const struct rope_map *map, const char *src, char *dst,
+               size_t len) {
+	const unsigned char *s = (const unsigned char *) src;
+	unsigned char lo, hi, diff = 0;
+	uint64_t wdiff = 0;
+	size_t i = 0;
+
+	if (map->kind == ROPE_MAP_TABLE) {
+		for (; i < len; i++) {
+			unsigned char c = map->table[s[i]];
+
+			diff |= c ^ s[i];
+			dst[i] = c;
+		}
+		return diff != 0;
+	}
+
+	lo = map->kind == ROPE_MAP_UPCASE ? 'a' : 'A';
+	hi = map->kind == ROPE_MAP_UPCASE ? 'z' : 'Z';
+
+	for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+		uint64_t w, mapped;
+
+		memcpy(&w, src + i, sizeof(w));
+		mapped = rope_map_case_word(w, lo, hi);
+		wdiff |= w ^ mapped;
+		memcpy(dst + i, &mapped, sizeof(mapped));
+	}
+	for (; i < len; i++) {
+		unsigned char c = s[i] >= lo && s[i] <= hi ? s[i] ^ 0x20 : s[i];
+
+		diff |= c ^ s[i];
+		dst[i] = c;
+	}
+
+	return wdiff != 0 || diff != 0;
+}
+
+/* return NULL if leaf is unchanged */
+static Rope
+rope_map_leaf(const struct rope_map *map, const Rope leaf) {
+	Rope rope = rope_leaf_alloc(leaf->len, leaf->len);
+	const char *src = leaf->str;
+
+	/* decoded in place rather than in the decode cache of a worker */
+	if (leaf->kind == ROPE_LEAF_LZ) {
+		rope_lz_decode(leaf, rope->str);
+		src = rope->str;
+	} else if (leaf->kind == ROPE_LEAF_EXT)
+		src = leaf->ext.ptr;
+
+	if (rope_map_bytes(map, src, rope->str, leaf->len))
+		return rope;
+
+	pfree(rope);
+	return NULL;
+}
+
+static void *
+rope_map_worker(void *arg) {
+	struct rope_map *map = arg;
+	size_t k;
+
+	while ((k = atomic_fetch_add(&map->next_leaf, 1)) < map->leaves.n)
+		map->mapped[k] = rope_map_leaf(map, map->leaves.items[k]);
+
+	return NULL;
+}
+
+static void
+rope_map_collect(struct rope_map *map, const Rope rope) {
+	if (!rope || rope_set_lookup(&map->memo, rope)->hits++ > 0)
+		return;
+
+	if (rope->kind == ROPE_CONCAT) {
+		rope_map_collect(map, rope->left);
+		rope_map_collect(map, rope->right);
+	} else if (rope->kind == ROPE_REPEAT)
+		rope_map_collect(map, rope->rep.child);
+	else
+		rope_array_push(&map->leaves, rope);
+}
+
+/* return the mapped node, NULL if unchanged; hits < 0 marks built nodes */
+static Rope
+rope_map_build(struct rope_map *map, const Rope rope) {
+	struct rope_set_entry *entry;
+	Rope left, right, rv = NULL;
+
+	if (!rope)
+		return NULL;
+
+	entry = rope_set_lookup(&map->memo, rope);
+	if (rope_is_leaf(rope) || entry->hits < 0)
+		return entry->value;
+
+	if (rope->kind == ROPE_REPEAT) {
+		if ((left = rope_map_build(map, rope->rep.child)))
+			rv = rope_repeat(left, rope->rep.count);
+	} else {
+		left = rope_map_build(map, rope->left);
+		right = rope_map_build(map, rope->right);
+		if (left || right)
+			rv = rope_concat_without_rec_ref(rope_ref(left ? left : rope->left),
+			                                 rope_ref(right ? right
+			                                                : rope->right));
+	}
+
+	/* entries may move while visiting children */
+	entry = rope_set_lookup(&map->memo, rope);
+	entry->hits = -1;
+	entry->value = rv;
+
+	return rv;
+}
+
+static Rope
+rope_map(const Rope rope, rope_map_kind kind, const unsigned char *table,
+         int n_threads) {
+	struct rope_map map;
+	pthread_t threads[ROPE_MAP_MAX_THREADS];
+	int n_started = 0;
+	Rope rv;
+
+	assert(rope);
+
+	map.kind = kind;
+	map.table = table;
+	map.leaves.items = NULL;
+	map.leaves.n = map.leaves.cap = 0;
+	rope_set_init(&map.memo);
+	/* workers read leaves without closing their gaps */
+	rope_close_gaps(rope);
+	rope_map_collect(&map, rope);
+
+	map.mapped = palloc(sizeof(*map.mapped) * (map.leaves.n + 1));
+	atomic_init(&map.next_leaf, 0);
+
+	if (n_threads > ROPE_MAP_MAX_THREADS)
+		n_threads = ROPE_MAP_MAX_THREADS;
+	if (rope->len >= ROPE_MAP_PARALLEL_MIN_LEN)
+		for (; n_started < n_threads - 1; n_started++)
+			if (pthread_create(&threads[n_started], NULL, rope_map_worker,
+			                   &map) != 0)
+				break;
+	rope_map_worker(&map);
+	for (int i = 0; i < n_started; i++)
+		pthread_join(threads[i], NULL);
+
+	for (size_t k = 0; k < map.leaves.n; k++)
+		rope_set_lookup(&map.memo, map.leaves.items[k])->value = map.mapped[k];
+
+	rv = rope_map_build(&map, rope);
+	rv = rope_ref(rv ? rv : rope);
+
+	for (size_t i = 0; i < map.memo.size; i++)
+		if (map.memo.entries[i].rope && map.memo.entries[i].value)
+			rope_deref(map.memo.entries[i].value);
+
+	rope_set_fini(&map.memo);
+	if (map.leaves.items)
+		pfree(map.leaves.items);
+	pfree(map.mapped);
+
+	return rv;
+}
+
+Rope
+RopeMapBytes(const Rope rope, const unsigned char table[256], int n_threads) {
+	return rope_map(rope, ROPE_MAP_TABLE, table, n_threads);
+}
+
+Rope
+RopeUpcase(const Rope rope, int n_threads) {
+	return rope_map(rope, ROPE_MAP_UPCASE, NULL, n_threads);
+}
+
+Rope
+RopeDowncase(const Rope rope, int n_threads) {
+	return rope_map(rope, ROPE_MAP_DOWNCASE, NULL, n_threads);
+}
+
+/*
+ * Comparison
+ *
+ * A cursor holds the subtrees which are left to read, the next one on top.
+ * Two cursors at the same position skip a subtree they both refer to
+ * without reading it, so versions of a rope sharing most of their nodes
+ * are compared in time proportional to the changed parts.
+ */
+struct rope_frame {
+	Rope node;
+	size_t lo, hi; /* bytes of a leaf, or repetitions of a repeat node left */
+};
+
+struct rope_cursor {
+	bool backward;
+	struct rope_frame *frames;
+	size_t n, cap;
+};
+
+static void
+rope_cursor_push(struct rope_cursor *cursor, Rope node, size_t lo, size_t hi) {
+	if (!node)
+		return;
+
+	if (cursor->n == cursor->cap) {
+		size_t cap = cursor->cap ? cursor->cap * 2 : ROPE_SCAN_MAX_DEPTH;
+		struct rope_frame *frames = palloc(sizeof(*frames) * cap);
+
+		if (cursor->frames) {
+			memcpy(frames, cursor->frames, sizeof(*frames) * cursor->n);
+			pfree(cursor->frames);
+		}
+		cursor->frames = frames;
+		cursor->cap = cap;
+	}
+
+	cursor->frames[cursor->n].node = node;
+	cursor->frames[cursor->n].lo = lo;
+	cursor->frames[cursor->n].hi = hi;
+	cursor->n++;
+}
+
+/* push the whole of node */
+static void
+rope_cursor_push_node(struct rope_cursor *cursor, Rope node) {
+	if (node)
+		rope_cursor_push(cursor, node, 0,
+		                 node->kind == ROPE_REPEAT ? node->rep.count : node->len);
+}
+
+static size_t
+rope_frame_len(const struct rope_frame *frame) {
+	switch (frame->node->kind) {
+		case ROPE_CONCAT:
+			return frame->node->len;
+		case ROPE_REPEAT:
+			return (frame->hi - frame->lo) * frame->node->rep.child->len;
+	}
+
+	return frame->hi - frame->lo;
+}
+
+/* a cursor reading rope forward from pos, or backward from pos */
+static void
+rope_cursor_init(struct rope_cursor *cursor, const Rope rope, size_t pos,
+                 bool backward) {
+	Rope node = rope;
+
+	cursor->backward = backward;
+	cursor->frames = NULL;
+	cursor->n = cursor->cap = 0;
+
+	if (backward ? pos == 0 : pos >= rope->len)
+		return;
+
+	while (node && !rope_is_leaf(node)) {
+		if (node->kind == ROPE_REPEAT) {
+			size_t clen = node->rep.child->len,
+			       k = (backward ? pos - 1 : pos) / clen;
+
+			if (backward && k > 0)
+				rope_cursor_push(cursor, node, 0, k);
+			else if (!backward && k + 1 < node->rep.count)
+				rope_cursor_push(cursor, node, k + 1, node->rep.count);
+			pos -= k * clen;
+			node = node->rep.child;
+		} else {
+			size_t llen = node->left ? node->left->len : 0;
+
+			if (backward ? pos <= llen : pos < llen) {
+				if (!backward)
+					rope_cursor_push_node(cursor, node->right);
+				node = node->left;
+			} else {
+				if (backward)
+					rope_cursor_push_node(cursor, node->left);
+				pos -= llen;
+				node = node->right;
+			}
+		}
+	}
+
+	if (node)
+		rope_cursor_push(cursor, node, backward ? 0 : pos,
+		                 backward ? pos : node->len);
+}
+
+static void
+rope_cursor_fini(struct rope_cursor *cursor) {
+	if (cursor->frames)
+		pfree(cursor->frames);
+}
+
+/* return the next subtree, skipping empty ones */
+static struct rope_frame *
+rope_cursor_top(struct rope_cursor *cursor) {
+	while (cursor->n > 0 && rope_frame_len(&cursor->frames[cursor->n - 1]) == 0)
+		cursor->n--;
+
+	return cursor->n > 0 ? &cursor->frames[cursor->n - 1] : NULL;
+}
+
+/* replace the top, which is not a leaf, with its children */
+static void
+rope_cursor_expand(struct rope_cursor *cursor) {
+	struct rope_frame frame = cursor->frames[--cursor->n];
+	Rope node = frame.node;
+
+	if (node->kind == ROPE_REPEAT) {
+		if (frame.hi - frame.lo > 1)
+			rope_cursor_push(cursor, node, frame.lo + !cursor->backward,
+			                 frame.hi - cursor->backward);
+		rope_cursor_push_node(cursor, node->rep.child);
+	} else if (cursor->backward) {
+		rope_cursor_push_node(cursor, node->left);
+		rope_cursor_push_node(cursor, node->right);
+	} else {
+		rope_cursor_push_node(cursor, node->right);
+		rope_cursor_push_node(cursor, node->left);
+	}
+}
+
+/* return the number of equal bytes next to x and y, up to max */
+static size_t
+rope_cursor_common(struct rope_cursor *x, struct rope_cursor *y, size_t max) {
+	size_t n = 0;
+
+	while (n < max) {
+		struct rope_frame *fx = rope_cursor_top(x), *fy = rope_cursor_top(y);
+		size_t lx, ly, m, k;
+		const char *sx, *sy;
+
+		if (!fx || !fy)
+			break;
+
+		lx = rope_frame_len(fx);
+		ly = rope_frame_len(fy);
+
+		if (fx->node == fy->node && fx->lo == fy->lo && fx->hi == fy->hi &&
+		    lx <= max - n) {
+			x->n--;
+			y->n--;
+			n += lx;
+			continue;
+		}
+
+		if (!rope_is_leaf(fx->node) || !rope_is_leaf(fy->node)) {
+			/* split the larger one, so that both come to the same boundaries */
+			if (!rope_is_leaf(fx->node) && (lx >= ly || rope_is_leaf(fy->node)))
+				rope_cursor_expand(x);
+			else
+				rope_cursor_expand(y);
+			continue;
+		}
+
+		m = lx < ly ? lx : ly;
+		if (m > max - n)
+			m = max - n;
+		/* two decodes at most, both are kept by the decode cache */
+		sx = rope_leaf_str(fx->node);
+		sy = rope_leaf_str(fy->node);
+
+		if (x->backward) {
+			for (k = 0; k < m && sx[fx->hi - 1 - k] == sy[fy->hi - 1 - k]; k++)
+				;
+			fx->hi -= k;
+			fy->hi -= k;
+		} else {
+			for (k = 0; k < m && sx[fx->lo + k] == sy[fy->lo + k]; k++)
+				;
+			fx->lo += k;
+			fy->lo += k;
+		}
+		n += k;
+
+		if (k < m)
+			break;
+	}
+
+	return n;
+}
+
+/* the bytes of rope if they are contiguous, pinned in *flat if they are
+ * cached */
+static const char *
+rope_contiguous(const Rope rope, struct rope_flat **flat) {
+	*flat = NULL;
+	if (rope_is_leaf(rope))
+		return rope->kind == ROPE_LEAF_LZ ? NULL : rope_leaf_str(rope);
+
+	*flat = rope_flat_pin(rope);
+	return *flat ? (*flat)->bytes : NULL;
+}
+
+/* equal bytes from a[i] and b[j] forward, or backward from a[i-1] and b[j-1] */
+static size_t
+rope_common(const Rope a, size_t i, const Rope b, size_t j, size_t max,
+            bool backward) {
+	struct rope_cursor x, y;
+	struct rope_flat *fa = NULL, *fb = NULL;
+	const char *sa, *sb;
+	size_t n = 0;
+	bool flat;
+
+	/* cached ropes are compared flat, unless they are the same node */
+	flat = a != b && (sa = rope_contiguous(a, &fa)) &&
+	       (sb = rope_contiguous(b, &fb)) && (fa || fb);
+	if (flat && backward)
+		for (; n < max && sa[i - 1 - n] == sb[j - 1 - n]; n++)
+			;
+	else if (flat)
+		for (; n < max && sa[i + n] == sb[j + n]; n++)
+			;
+	if (fa)
+		rope_flat_unpin(fa);
+	if (fb)
+		rope_flat_unpin(fb);
+	if (flat)
+		return n;
+
+	rope_cursor_init(&x, a, i, backward);
+	rope_cursor_init(&y, b, j, backward);
+	n = rope_cursor_common(&x, &y, max);
+	rope_cursor_fini(&x);
+	rope_cursor_fini(&y);
+
+	return n;
+}
+
+size_t
+RopeCommonPrefix(const Rope a, const Rope b) {
+	assert(a && b);
+
+	return rope_common(a, 0, b, 0, a->len < b->len ? a->len : b->len, false);
+}
+
+size_t
+RopeCommonSuffix(const Rope a, const Rope b) {
+	assert(a && b);
+
+	return rope_common(a, a->len, b, b->len, a->len < b->len ? a->len : b->len,
+	                   true);
+}
+
+/*
+ * RopeDiff trims the common prefix and suffix, and then matches subtrees of
+ * the rest of b against the nodes in the rest of a by address, taking the
+ * largest ones first. Bytes are compared only to trim the gaps between
+ * matched subtrees.
+ */
+struct rope_diff {
+	const Rope a, b;
+	void (*func)(const RopeDiffEdit *edit, void *arg);
+	void *arg;
+};
+
+struct rope_span {
+	Rope node;
+	size_t pos;
+};
+
+struct rope_span_stack {
+	struct rope_span *spans;
+	size_t n, cap;
+};
+
+static void
+rope_span_push(struct rope_span_stack *stack, Rope node, size_t pos) {
+	if (!node)
+		return;
+
+	if (stack->n == stack->cap) {
+		size_t cap = stack->cap ? stack->cap * 2 : ROPE_SCAN_MAX_DEPTH;
+		struct rope_span *spans = palloc(sizeof(*spans) * cap);
+
+		if (stack->spans) {
+			memcpy(spans, stack->spans, sizeof(*spans) * stack->n);
+			pfree(stack->spans);
+		}
+		stack->spans = spans;
+		stack->cap = cap;
+	}
+
+	stack->spans[stack->n].node = node;
+	stack->spans[stack->n].pos = pos;
+	stack->n++;
+}
+
+static void
+rope_diff_gap(const struct rope_diff *diff, size_t a0, size_t a1, size_t b0,
+              size_t b1) {
+	RopeDiffEdit edit;
+	size_t n;
+
+	n = rope_common(diff->a, a0, diff->b, b0,
+	                a1 - a0 < b1 - b0 ? a1 - a0 : b1 - b0, false);
+	a0 += n;
+	b0 += n;
+	n = rope_common(diff->a, a1, diff->b, b1,
+	                a1 - a0 < b1 - b0 ? a1 - a0 : b1 - b0, true);
+	a1 -= n;
+	b1 -= n;
+
+	if (a0 == a1 && b0 == b1)
+		return;
+
+	edit.a_pos = a0;
+	edit.a_len = a1 - a0;
+	edit.b_pos = b0;
+	edit.b_len = b1 - b0;
+	diff->func(&edit, diff->arg);
+}
+
+/* record subtrees of a within [lo, hi) which may be found in b */
+static void
+rope_diff_collect(struct rope_set *set, const Rope a, size_t lo, size_t hi,
+                  size_t max_len) {
+	struct rope_span_stack stack = {NULL, 0, 0};
+
+	rope_span_push(&stack, a, 0);
+	while (stack.n > 0) {
+		struct rope_span span = stack.spans[--stack.n];
+		Rope node = span.node;
+
+		if (span.pos >= hi || span.pos + node->len <= lo)
+			continue;
+
+		if (lo <= span.pos && span.pos + node->len <= hi &&
+		    node->len <= max_len) {
+			struct rope_set_entry *entry = rope_set_lookup(set, node);
+
+			if (entry->hits++ == 0)
+				entry->pos = span.pos;
+		}
+
+		if (node->kind == ROPE_CONCAT) {
+			rope_span_push(&stack, node->right,
+			               span.pos + (node->left ? node->left->len : 0));
+			rope_span_push(&stack, node->left, span.pos);
+		}
+	}
+
+	if (stack.spans)
+		pfree(stack.spans);
+}
+
+void
+RopeDiff(const Rope a, const Rope b,
+         void (*func)(const RopeDiffEdit *edit, void *arg), void *arg) {
+	struct rope_diff diff = {a, b, func, arg};
+	struct rope_span_stack stack = {NULL, 0, 0};
+	struct rope_set set;
+	size_t prefix, suffix, a_end, b_end, a_cur, b_cur;
+
+	assert(a && b);
+
+	prefix = RopeCommonPrefix(a, b);
+	suffix = rope_common(a, a->len, b, b->len,
+	                     (a->len < b->len ? a->len : b->len) - prefix, true);
+	a_end = a->len - suffix;
+	b_end = b->len - suffix;
+	a_cur = b_cur = prefix;
+
+	if (a_cur == a_end || b_cur == b_end) {
+		rope_diff_gap(&diff, a_cur, a_end, b_cur, b_end);
+		return;
+	}
+
+	rope_set_init(&set);
+	rope_diff_collect(&set, a, a_cur, a_end, b_end - b_cur);
+
+	rope_span_push(&stack, b, 0);
+	while (stack.n > 0) {
+		struct rope_span span = stack.spans[--stack.n];
+		Rope node = span.node;
+		struct rope_set_entry *entry;
+
+		if (span.pos >= b_end || span.pos + node->len <= b_cur)
+			continue;
+
+		if (span.pos >= b_cur && span.pos + node->len <= b_end &&
+		    node->len > 0 && (entry = rope_set_find(&set, node)) &&
+		    entry->pos >= a_cur) {
+			rope_diff_gap(&diff, a_cur, entry->pos, b_cur, span.pos);
+			a_cur = entry->pos + node->len;
+			b_cur = span.pos + node->len;
+			continue;
+		}
+
+		if (node->kind == ROPE_CONCAT) {
+			rope_span_push(&stack, node->right,
+			               span.pos + (node->left ? node->left->len : 0));
+			rope_span_push(&stack, node->left, span.pos);
+		}
+	}
+	rope_diff_gap(&diff, a_cur, a_end, b_cur, b_end);
+
+	if (stack.spans)
+		pfree(stack.spans);
+	rope_set_fini(&set);
+}
+
+/*
+ * Batched access
+ *
+ * Queries are answered in the order of their positions by moving a finger:
+ * the path to the last leaf read is kept, and each query climbs only as far
+ * as the subtree containing it, instead of descending from the root.
+ */
+struct rope_query {
+	size_t pos, len;
+	char *dst;
+};
+
+static int
+rope_query_cmp(const void *x, const void *y) {
+	size_t a = ((const struct rope_query *) x)->pos,
+	       b = ((const struct rope_query *) y)->pos;
+
+	return a < b ? -1 : a > b;
+}
+
+static void
+rope_gather(const Rope rope, struct rope_query *queries, size_t n) {
+	struct rope_span_stack path = {NULL, 0, 0};
+	bool sorted = true;
+
+	for (size_t k = 1; k < n && sorted; k++)
+		sorted = queries[k - 1].pos <= queries[k].pos;
+	if (!sorted)
+		qsort(queries, n, sizeof(*queries), rope_query_cmp);
+
+	rope_span_push(&path, rope, 0);
+	for (size_t k = 0; k < n; k++) {
+		size_t pos = queries[k].pos, len = queries[k].len,
+		       next = k + 1 < n ? queries[k + 1].pos : SIZE_MAX;
+		char *dst = queries[k].dst;
+
+		while (len > 0) {
+			/* climb to the subtree containing pos, the root contains all */
+			while (path.n > 1 &&
+			       (pos < path.spans[path.n - 1].pos ||
+			        pos >= path.spans[path.n - 1].pos +
+			                   path.spans[path.n - 1].node->len))
+				path.n--;
+
+			for (;;) {
+				Rope node = path.spans[path.n - 1].node;
+				size_t off = path.spans[path.n - 1].pos;
+
+				INSTR_ADD(index_nodes_visited, 1);
+
+				if (rope_is_leaf(node)) {
+					size_t m = off + node->len - pos;
+
+					if (m > len)
+						m = len;
+					memcpy(dst, rope_leaf_str(node) + (pos - off), m);
+					dst += m;
+					pos += m;
+					len -= m;
+					break;
+				}
+
+				if (node->kind == ROPE_REPEAT) {
+					size_t clen = node->rep.child->len;
+
+					rope_span_push(&path, node->rep.child,
+					               off + (pos - off) / clen * clen);
+				} else if (pos < off + node->left->len) {
+					size_t mid = off + node->left->len;
+
+					/* the rest of this query or the next one is on the right */
+					if (pos + len > mid || (next >= mid && next < off + node->len))
+						ROPE_PREFETCH(node->right);
+					rope_span_push(&path, node->left, off);
+				} else
+					rope_span_push(&path, node->right, off + node->left->len);
+			}
+		}
+	}
+
+	pfree(path.spans);
+}
+
+void
+RopeIndexMany(const Rope rope, const size_t *positions, size_t n, char *out) {
+	struct rope_query *queries;
+	INSTR_OP_BEGIN(ROPE_OP_INDEX_MANY);
+	assert(rope);
+
+	if (n > 0) {
+		queries = palloc(sizeof(*queries) * n);
+		for (size_t k = 0; k < n; k++) {
+			assert(positions[k] < rope->len);
+			queries[k].pos = positions[k];
+			queries[k].len = 1;
+			queries[k].dst = out + k;
+		}
+
+		rope_gather(rope, queries, n);
+		pfree(queries);
+	}
+
+	INSTR_OP_END(ROPE_OP_INDEX_MANY);
+}
+
+void
+RopeGatherRanges(const Rope rope, const size_t *starts, const size_t *lens,
+                 size_t n, char *out) {
+	struct rope_query *queries;
+	INSTR_OP_BEGIN(ROPE_OP_INDEX_MANY);
+	assert(rope);
+
+	if (n > 0) {
+		queries = palloc(sizeof(*queries) * n);
+		for (size_t k = 0; k < n; k++) {
+			assert(starts[k] + lens[k] <= rope->len);
+			queries[k].pos = starts[k];
+			queries[k].len = lens[k];
+			queries[k].dst = out;
+			out += lens[k];
+		}
+
+		rope_gather(rope, queries, n);
+		pfree(queries);
+	}
+
+	INSTR_OP_END(ROPE_OP_INDEX_MANY);
+}
+
+struct rope_scan_leaf_tag {
+	size_t depth;
+	bool is_end;
+	Rope rope;
+	char *buf; /* decoded bytes of the current compressed leaf */
+	size_t buf_size;
+	size_t max_depth;
+	size_t *child; /* index of the child being scanned, per stack entry */
+	Rope *stack;
+};
+
+/* number of children a node is scanned through, and the k-th of them */
+static size_t
+rope_scan_n_children(const Rope rope) {
+	return rope->kind == ROPE_REPEAT ? rope->rep.count : 2;
+}
+
+static Rope
+rope_scan_child(const Rope rope, size_t k) {
+	if (rope->kind == ROPE_REPEAT)
+		return rope->rep.child;
+
+	return k == 0 ? rope->left : rope->right;
+}
+
+static void
+rope_scan_leaf_push(RopeScanLeaf scan) {
+	if (scan->depth == scan->max_depth) {
+		size_t max_depth = scan->max_depth * 2;
+		size_t *child = palloc(sizeof(*child) * max_depth);
+		Rope *stack = palloc(sizeof(*stack) * max_depth);
+
+		memcpy(child, scan->child, sizeof(*child) * scan->depth);
+		memcpy(stack, scan->stack, sizeof(*stack) * scan->depth);
+		pfree(scan->child);
+		pfree(scan->stack);
+		scan->child = child;
+		scan->stack = stack;
+		scan->max_depth = max_depth;
+	}
+
+	scan->stack[scan->depth] = scan->rope;
+	scan->child[scan->depth] = 0;
+	scan->depth++;
+	scan->rope = rope_scan_child(scan->rope, 0);
+}
+
+static char *
+rope_scan_leaf_buf(RopeScanLeaf scan, size_t len) {
+	if (scan->buf_size < len + 1) {
+		if (scan->buf)
+			pfree(scan->buf);
+		scan->buf = palloc(len + 1);
+		scan->buf_size = len + 1;
+	}
+
+	return scan->buf;
+}
+
+/* bytes of leaf, NUL terminated if cstr */
+static char *
+rope_scan_leaf_str(RopeScanLeaf scan, const Rope leaf, bool cstr) {
+	char *buf;
+
+	switch (leaf->kind) {
+		case ROPE_LEAF_LZ:
+			buf = rope_scan_leaf_buf(scan, leaf->len);
+			rope_lz_decode(leaf, buf);
+			return buf;
+		case ROPE_LEAF_EXT:
+			if (!cstr)
+				return (char *) leaf->ext.ptr;
+			buf = rope_scan_leaf_buf(scan, leaf->len);
+			memcpy(buf, leaf->ext.ptr, leaf->len);
+			buf[leaf->len] = '\0';
+			return buf;
+	}
+
+	return (char *) rope_leaf_str(leaf);
+}
+
+RopeScanLeaf
+RopeScanLeafInit(const Rope rope) {
+	RopeScanLeaf scan = palloc(sizeof(*scan));
+
+	scan->rope = rope;
+	scan->depth = 0;
+	scan->is_end = false;
+	scan->buf = NULL;
+	scan->buf_size = 0;
+	scan->max_depth = ROPE_SCAN_MAX_DEPTH;
+	scan->child = palloc(sizeof(*scan->child) * scan->max_depth);
+	scan->stack = palloc(sizeof(*scan->stack) * scan->max_depth);
+
+	while (!rope_is_leaf(scan->rope))
+		rope_scan_leaf_push(scan);
+
+	return scan;
+}
+
+/* return the current leaf and move to the next */
+static Rope
+rope_scan_leaf_next(RopeScanLeaf scan) {
+	Rope rv;
+
+	if (scan->is_end)
+		return NULL;
+
+	rv = scan->rope;
+
+	do {
+		if (scan->depth == 0) /* End of scan */
+		{
+			scan->is_end = true;
+			return rv;
+		}
+		scan->depth--;
+	} while (scan->child[scan->depth] + 1 ==
+	         rope_scan_n_children(scan->stack[scan->depth]));
+
+	scan->rope = rope_scan_child(scan->stack[scan->depth],
+	                             ++scan->child[scan->depth]);
+	scan->depth++;
+	/* XXX: Assuming non-leaf rope has right child */
+
+	while (!rope_is_leaf(scan->rope))
+		rope_scan_leaf_push(scan);
+
+	return rv;
+}
+
+char *
+RopeScanLeafGetNext(RopeScanLeaf scan) {
+	Rope leaf = rope_scan_leaf_next(scan);
+
+	return leaf ? rope_scan_leaf_str(scan, leaf, true) : NULL;
+}
+
+const char *
+RopeScanLeafGetNextLen(RopeScanLeaf scan, size_t *len) {
+	Rope leaf = rope_scan_leaf_next(scan);
+
+	if (!leaf)
+		return NULL;
+
+	*len = leaf->len;
+	return rope_scan_leaf_str(scan, leaf, false);
+}
+
+void
+RopeScanLeafFini(RopeScanLeaf scan) {
+	if (scan->buf)
+		pfree(scan->buf);
+	pfree(scan->child);
+	pfree(scan->stack);
+	pfree(scan);
+}
+
+struct rope_scan_char_tag {
+	RopeScanLeaf scan_leaf;
+	const char *str;
+	size_t len, pos;
+};
+
+RopeScanChar
+RopeScanCharInit(const Rope rope) {
+	RopeScanChar scan = palloc(sizeof(*scan));
+
+	scan->scan_leaf = RopeScanLeafInit(rope);
+	scan->str = RopeScanLeafGetNextLen(scan->scan_leaf, &scan->len);
+	scan->pos = 0;
+
+	return scan;
+}
+
+char
+RopeScanCharGetNext(RopeScanChar scan) {
+	while (scan->pos == scan->len) {
+		if (!scan->str)
+			return 0;
+
+		scan->str = RopeScanLeafGetNextLen(scan->scan_leaf, &scan->len);
+		scan->pos = 0;
+
+		if (!scan->str)
+			return 0;
+	}
+
+	return scan->str[scan->pos++];
+}
+
+void
+RopeScanCharFini(RopeScanChar scan) {
+	RopeScanLeafFini(scan->scan_leaf);
+	pfree(scan);
+}
+
+/*
+ * Substring search and gram index
+ *
+ * RopeFind scans the leaves for the first byte of the pattern. A
+ * RopeGramIndex lists where each k-gram occurs, so a pattern of k bytes or
+ * more is looked for only where its rarest gram occurs. The index is made
+ * of pieces, each a subtree of up to ROPE_GRAM_PIECE_LEN bytes (or a part
+ * of a larger leaf), which an index of an edited rope shares with the old
+ * index wherever the ropes share the subtree. Grams across the boundary
+ * of two pieces are not listed; the few positions where a match could
+ * have its gram there are checked one by one. Large repeat nodes are not
+ * indexed but scanned. Each piece has a Bloom filter of its grams, so that
+ * a search skips the pieces without the gram at a bit test.
+ */
+struct rope_gram_piece {
+	atomic_int ref_count; /* indexes sharing the piece */
+	Rope node;
+	size_t lo, len; /* bytes [lo, lo + len) of node */
+	/* open addressing table of the grams, count 0 for an empty slot */
+	size_t cap;
+	uint64_t *keys;
+	uint32_t *first, *count; /* postings in pos */
+	uint32_t *pos;           /* in the piece, by gram and then by position */
+	size_t n_pos;
+	uint64_t *bloom; /* two bits of each gram, 8 bits per gram or more */
+	size_t bloom_mask;
+};
+
+struct rope_gram_span {
+	size_t offset, len;
+	struct rope_gram_piece *piece; /* NULL if the span is scanned */
+};
+
+struct rope_gram_index_tag {
+	Rope rope;
+	size_t k;
+	struct rope_gram_span *spans;
+	size_t n_spans, cap;
+};
+
+/* the gram of k bytes at str */
+static uint64_t
+rope_gram_key(const char *str, size_t k) {
+	uint64_t key = 0;
+
+	for (size_t i = 0; i < k; i++)
+		key = key << 8 | (unsigned char) str[i];
+
+	return key;
+}
+
+static uint64_t
+rope_gram_hash(uint64_t key) {
+	return key * 0x9E3779B97F4A7C15ull;
+}
+
+static size_t
+rope_gram_slot(const uint64_t *keys, const uint32_t *count, size_t cap,
+               uint64_t key) {
+	uint64_t h = rope_gram_hash(key);
+	size_t i = h ^ h >> 32;
+
+	for (i &= cap - 1; count[i] && keys[i] != key; i = (i + 1) & (cap - 1))
+		;
+
+	return i;
+}
+
+static void
+rope_gram_grow(struct rope_gram_piece *piece) {
+	size_t cap = piece->cap * 2;
+	uint64_t *keys = palloc(sizeof(*keys) * cap);
+	uint32_t *count = palloc(sizeof(*count) * cap);
+
+	memset(count, 0, sizeof(*count) * cap);
+	for (size_t i = 0; i < piece->cap; i++)
+		if (piece->count[i]) {
+			size_t j = rope_gram_slot(keys, count, cap, piece->keys[i]);
+
+			keys[j] = piece->keys[i];
+			count[j] = piece->count[i];
+		}
+
+	pfree(piece->keys);
+	pfree(piece->count);
+	piece->keys = keys;
+	piece->count = count;
+	piece->cap = cap;
+}
+
+static struct rope_gram_piece *
+rope_gram_piece_new(const Rope node, size_t lo, size_t len, size_t k) {
+	struct rope_gram_piece *piece = palloc(sizeof(*piece));
+	size_t n = len >= k ? len - k + 1 : 0, n_keys = 0, i, j;
+	const char *str;
+	char *buf = NULL;
+	uint32_t *next;
+
+	atomic_init(&piece->ref_count, 1);
+	piece->node = rope_ref(node);
+	piece->lo = lo;
+	piece->len = len;
+	piece->cap = 64;
+	piece->keys = palloc(sizeof(*piece->keys) * piece->cap);
+	piece->count = palloc(sizeof(*piece->count) * piece->cap);
+	memset(piece->count, 0, sizeof(*piece->count) * piece->cap);
+
+	if (rope_is_leaf(node))
+		str = rope_leaf_str(node) + lo;
+	else {
+		str = buf = palloc(len + 1);
+		rope_collect_cstr(node, buf, 0);
+	}
+
+	/* count the grams, then lay out their postings one after another */
+	for (i = 0; i < n; i++) {
+		uint64_t key = rope_gram_key(str + i, k);
+
+		j = rope_gram_slot(piece->keys, piece->count, piece->cap, key);
+		if (!piece->count[j]++) {
+			piece->keys[j] = key;
+			if (++n_keys * 2 > piece->cap)
+				rope_gram_grow(piece);
+		}
+	}
+
+	piece->first = palloc(sizeof(*piece->first) * piece->cap);
+	next = palloc(sizeof(*next) * piece->cap);
+	for (i = j = 0; i < piece->cap; i++) {
+		piece->first[i] = next[i] = j;
+		j += piece->count[i];
+	}
+
+	piece->n_pos = n;
+	piece->pos = palloc(sizeof(*piece->pos) * (n ? n : 1));
+	for (i = 0; i < n; i++) {
+		j = rope_gram_slot(piece->keys, piece->count, piece->cap,
+		                   rope_gram_key(str + i, k));
+		piece->pos[next[j]++] = i;
+	}
+
+	pfree(next);
+	if (buf)
+		pfree(buf);
+
+	for (piece->bloom_mask = 63; piece->bloom_mask < n_keys * 8;)
+		piece->bloom_mask = piece->bloom_mask * 2 + 1;
+	n = piece->bloom_mask / 64 + 1;
+	piece->bloom = palloc(sizeof(*piece->bloom) * n);
+	memset(piece->bloom, 0, sizeof(*piece->bloom) * n);
+	for (i = 0; i < piece->cap; i++)
+		if (piece->count[i]) {
+			uint64_t h = rope_gram_hash(piece->keys[i]);
+			size_t b1 = h >> 40 & piece->bloom_mask,
+			       b2 = h >> 16 & piece->bloom_mask;
+
+			piece->bloom[b1 / 64] |= 1ull << b1 % 64;
+			piece->bloom[b2 / 64] |= 1ull << b2 % 64;
+		}
+
+	return piece;
+}
+
+/* false if key is certainly not in piece */
+static bool
+rope_gram_maybe(const struct rope_gram_piece *piece, uint64_t key) {
+	uint64_t h = rope_gram_hash(key);
+	size_t b1 = h >> 40 & piece->bloom_mask, b2 = h >> 16 & piece->bloom_mask;
+
+	return (piece->bloom[b1 / 64] >> b1 % 64 & 1) &&
+	       (piece->bloom[b2 / 64] >> b2 % 64 & 1);
+}
+
+static void
+rope_gram_piece_release(struct rope_gram_piece *piece) {
+	if (atomic_fetch_sub_explicit(&piece->ref_count, 1, memory_order_acq_rel) >
+	    1)
+		return;
+
+	rope_deref(piece->node);
+	pfree(piece->keys);
+	pfree(piece->first);
+	pfree(piece->count);
+	pfree(piece->pos);
+	pfree(piece->bloom);
+	pfree(piece);
+}
+
+static size_t
+rope_gram_piece_size(const struct rope_gram_piece *piece) {
+	return sizeof(*piece) +
+	       piece->cap * (sizeof(*piece->keys) + sizeof(*piece->first) +
+	                     sizeof(*piece->count)) +
+	       (piece->n_pos ? piece->n_pos : 1) * sizeof(*piece->pos) +
+	       (piece->bloom_mask / 64 + 1) * sizeof(*piece->bloom);
+}
+
+/* the postings of key in piece, return their number */
+static size_t
+rope_gram_lookup(const struct rope_gram_piece *piece, uint64_t key,
+                 const uint32_t **pos) {
+	size_t i;
+
+	if (!rope_gram_maybe(piece, key))
+		return 0;
+
+	i = rope_gram_slot(piece->keys, piece->count, piece->cap, key);
+
+	*pos = piece->pos + piece->first[i];
+	return piece->count[i];
+}
+
+static void
+rope_gram_push(RopeGramIndex index, size_t offset, size_t len,
+               struct rope_gram_piece *piece) {
+	if (index->n_spans == index->cap) {
+		size_t cap = index->cap ? index->cap * 2 : 16;
+		struct rope_gram_span *spans = palloc(sizeof(*spans) * cap);
+
+		if (index->spans) {
+			memcpy(spans, index->spans, sizeof(*spans) * index->n_spans);
+			pfree(index->spans);
+		}
+		index->spans = spans;
+		index->cap = cap;
+	}
+
+	index->spans[index->n_spans].offset = offset;
+	index->spans[index->n_spans].len = len;
+	index->spans[index->n_spans].piece = piece;
+	index->n_spans++;
+}
+
+/* the piece of [lo, lo + len) of node in old (of which first is the span
+ * index of the first piece of node), shared, or a new one */
+static struct rope_gram_piece *
+rope_gram_piece_get(const RopeGramIndex old, struct rope_set *old_nodes,
+                    const Rope node, size_t lo, size_t len, size_t k) {
+	struct rope_set_entry *entry;
+	struct rope_gram_piece *piece;
+
+	if (old && (entry = rope_set_find(old_nodes, node))) {
+		size_t i = entry->pos + lo / ROPE_GRAM_PIECE_LEN;
+
+		piece = i < old->n_spans ? old->spans[i].piece : NULL;
+		if (piece && piece->node == node && piece->lo == lo &&
+		    piece->len == len) {
+			atomic_fetch_add_explicit(&piece->ref_count, 1,
+			                          memory_order_relaxed);
+			return piece;
+		}
+	}
+
+	return rope_gram_piece_new(node, lo, len, k);
+}
+
+static RopeGramIndex
+rope_gram_build(const Rope rope, size_t k, const RopeGramIndex old) {
+	RopeGramIndex index = palloc(sizeof(*index));
+	struct rope_array stack = {NULL, 0, 0};
+	struct rope_set old_nodes;
+	size_t offset = 0;
+
+	index->rope = rope_ref(rope);
+	index->k = k;
+	index->spans = NULL;
+	index->n_spans = index->cap = 0;
+
+	rope_set_init(&old_nodes);
+	for (size_t i = 0; old && i < old->n_spans; i++) {
+		struct rope_gram_piece *piece = old->spans[i].piece;
+
+		if (piece && piece->lo == 0)
+			rope_set_lookup(&old_nodes, piece->node)->pos = i;
+	}
+
+	rope_array_push(&stack, rope);
+	while (stack.n > 0) {
+		Rope node = stack.items[--stack.n];
+
+		if (!node || node->len == 0)
+			continue;
+
+		if (node->len <= ROPE_GRAM_PIECE_LEN || rope_is_leaf(node)) {
+			for (size_t lo = 0; lo < node->len; lo += ROPE_GRAM_PIECE_LEN) {
+				size_t len = node->len - lo < ROPE_GRAM_PIECE_LEN
+				                 ? node->len - lo
+				                 : ROPE_GRAM_PIECE_LEN;
+
+				rope_gram_push(index, offset + lo, len,
+				               rope_gram_piece_get(old, &old_nodes, node, lo,
+				                                   len, k));
+			}
+		} else if (node->kind == ROPE_REPEAT)
+			rope_gram_push(index, offset, node->len, NULL);
+		else {
+			rope_array_push(&stack, node->right);
+			rope_array_push(&stack, node->left);
+			continue;
+		}
+		offset += node->len;
+	}
+
+	pfree(stack.items);
+	rope_set_fini(&old_nodes);
+
+	return index;
+}
+
+RopeGramIndex
+RopeBuildIndex(const Rope rope, size_t k) {
+	assert(rope);
+
+	if (k < ROPE_INDEX_MIN_K || k > ROPE_INDEX_MAX_K)
+		return NULL;
+
+	return rope_gram_build(rope, k, NULL);
+}
+
+RopeGramIndex
+RopeRebuildIndex(const RopeGramIndex old, const Rope rope) {
+	assert(old && rope);
+
+	return rope_gram_build(rope, old->k, old);
+}
+
+void
+RopeIndexFree(RopeGramIndex index) {
+	for (size_t i = 0; i < index->n_spans; i++)
+		if (index->spans[i].piece)
+			rope_gram_piece_release(index->spans[i].piece);
+	if (index->spans)
+		pfree(index->spans);
+	rope_deref(index->rope);
+	pfree(index);
+}
+
+void
+RopeIndexGetStats(const RopeGramIndex index, RopeStats *stats) {
+	RopeGetStats(index->rope, stats);
+
+	stats->index_size = sizeof(*index) + sizeof(*index->spans) * index->cap;
+	for (size_t i = 0; i < index->n_spans; i++)
+		if (index->spans[i].piece)
+			stats->index_size += rope_gram_piece_size(index->spans[i].piece);
+}
+
+/* return true if the len bytes of rope at pos are pattern; buf holds len */
+static bool
+rope_match_at(const Rope rope, size_t pos, const char *pattern, size_t len,
+              char *buf) {
+	RopeGatherRanges(rope, &pos, &len, 1, buf);
+
+	return memcmp(buf, pattern, len) == 0;
+}
+
+/* the first match of pattern starting in [from, end), or end */
+static size_t
+rope_find_scan(const Rope rope, const char *pattern, size_t len, size_t from,
+               size_t end, char *buf) {
+	RopeScanLeaf scan = RopeScanLeafInit(rope);
+	const char *str, *p;
+	size_t n, offset = 0, found = end;
+
+	while (found == end && offset < end &&
+	       (str = RopeScanLeafGetNextLen(scan, &n))) {
+		size_t i = from > offset ? from - offset : 0;
+
+		for (; i < n && offset + i < end; i = p - str + 1) {
+			if (!(p = memchr(str + i, pattern[0], n - i)) ||
+			    offset + (p - str) >= end)
+				break;
+			if ((size_t) (p - str) + len <= n
+			        ? memcmp(p, pattern, len) == 0
+			        : rope_match_at(rope, offset + (p - str), pattern, len,
+			                        buf)) {
+				found = offset + (p - str);
+				break;
+			}
+		}
+		offset += n;
+	}
+	RopeScanLeafFini(scan);
+
+	return found;
+}
+
+struct rope_positions {
+	size_t *items;
+	size_t n, cap;
+};
+
+static void
+rope_positions_push(struct rope_positions *array, size_t pos) {
+	if (array->n == array->cap) {
+		size_t cap = array->cap ? array->cap * 2 : 64;
+		size_t *items = palloc(sizeof(*items) * cap);
+
+		if (array->items) {
+			memcpy(items, array->items, sizeof(*items) * array->n);
+			pfree(array->items);
+		}
+		array->items = items;
+		array->cap = cap;
+	}
+
+	array->items[array->n++] = pos;
+}
+
+static int
+rope_size_cmp(const void *x, const void *y) {
+	size_t a = *(const size_t *) x, b = *(const size_t *) y;
+
+	return a < b ? -1 : a > b;
+}
+
+/* the first match of pattern at or after from, or end (the last start + 1) */
+static size_t
+rope_find_indexed(const RopeGramIndex index, const char *pattern, size_t len,
+                  size_t from, size_t end, char *buf) {
+	size_t k = index->k, best_o = 0, best_n = SIZE_MAX, found = end,
+	       step = (len - k) / ROPE_GRAM_MAX_PROBES + 1,
+	       stride = index->n_spans / ROPE_GRAM_SAMPLE_SPANS + 1;
+	struct rope_positions cands = {NULL, 0, 0};
+	uint64_t key;
+
+	/* the rarest of some grams of the pattern, in a sample of the pieces */
+	for (size_t o = 0; o + k <= len && best_n > 0; o += step) {
+		size_t total = 0;
+		const uint32_t *pos;
+
+		key = rope_gram_key(pattern + o, k);
+		for (size_t i = 0; i < index->n_spans && total < best_n; i += stride)
+			if (index->spans[i].piece)
+				total += rope_gram_lookup(index->spans[i].piece, key, &pos);
+		if (total < best_n) {
+			best_n = total;
+			best_o = o;
+		}
+	}
+	key = rope_gram_key(pattern + best_o, k);
+
+	for (size_t i = 0; i < index->n_spans; i++) {
+		const struct rope_gram_span *span = &index->spans[i];
+		const uint32_t *pos;
+		size_t n;
+
+		/* a match whose gram crosses the start of the span */
+		for (size_t t = 1; i > 0 && t < k; t++)
+			if (span->offset >= t + best_o + from &&
+			    span->offset - t - best_o < found)
+				rope_positions_push(&cands, span->offset - t - best_o);
+
+		if (!span->piece) {
+			size_t lo = span->offset + 1 > len ? span->offset + 1 - len : 0,
+			       hi = span->offset + span->len < found
+			                ? span->offset + span->len
+			                : found;
+
+			if (lo < from)
+				lo = from;
+			if (lo < hi) {
+				size_t s = rope_find_scan(index->rope, pattern, len, lo, hi,
+				                          buf);
+
+				if (s < hi)
+					found = s;
+			}
+			continue;
+		}
+
+		n = rope_gram_lookup(span->piece, key, &pos);
+		for (size_t j = 0; j < n; j++) {
+			size_t q = span->offset + pos[j];
+
+			if (q >= best_o + from && q - best_o < found)
+				rope_positions_push(&cands, q - best_o);
+		}
+	}
+
+	if (cands.n)
+		qsort(cands.items, cands.n, sizeof(*cands.items), rope_size_cmp);
+	for (size_t i = 0; i < cands.n && cands.items[i] < found; i++)
+		if (rope_match_at(index->rope, cands.items[i], pattern, len, buf))
+			found = cands.items[i];
+	if (cands.items)
+		pfree(cands.items);
+
+	return found;
+}
+
+ssize_t
+RopeFind(const Rope rope, const char *pattern, size_t len, size_t from,
+         const RopeGramIndex index) {
+	size_t end, found;
+	char *buf;
+	INSTR_OP_BEGIN(ROPE_OP_FIND);
+	assert(rope);
+
+	if (from > rope->len || len > rope->len - from) {
+		INSTR_OP_END(ROPE_OP_FIND);
+		return -1;
+	}
+	if (len == 0) {
+		INSTR_OP_END(ROPE_OP_FIND);
+		return from;
+	}
+
+	end = rope->len - len + 1;
+	buf = palloc(len);
+	if (index && index->rope == rope && len >= index->k)
+		found = rope_find_indexed(index, pattern, len, from, end, buf);
+	else
+		found = rope_find_scan(rope, pattern, len, from, end, buf);
+	pfree(buf);
+
+	INSTR_OP_END(ROPE_OP_FIND);
+	return found < end ? (ssize_t) found : -1;
+}
+
+/*
+ * Freezing for fork
+ *
+ * A process forking workers shares the pages of its ropes with them until
+ * either writes to them. The only writes to a node being read are its
+ * ref_count and its flat flag, so once the nodes of a rope are immortal
+ * and out of the flat cache, workers using it dirty none of its pages.
+ * Immortal nodes are never freed: the rope lives as long as the process.
+ */
+size_t
+RopeFreezeForFork(const Rope rope) {
+	struct rope_array stack = {NULL, 0, 0};
+	size_t n = 0;
+
+	assert(rope);
+
+	rope_close_gaps(rope);
+	rope_array_push(&stack, rope);
+	while (stack.n > 0) {
+		Rope node = stack.items[--stack.n];
+
+		/* the children of an immortal node are immortal already */
+		if (!node || rope_is_immortal(node))
+			continue;
+
+		rope_flat_drop(node);
+		atomic_store_explicit(&node->ref_count, INT_MAX,
+		                      memory_order_relaxed);
+		n++;
+		if (node->kind == ROPE_CONCAT) {
+			rope_array_push(&stack, node->right);
+			rope_array_push(&stack, node->left);
+		} else if (node->kind == ROPE_REPEAT)
+			rope_array_push(&stack, node->rep.child);
+	}
+	pfree(stack.items);
+
+	return n;
+}
+
+bool
+RopeIsImmortal(const Rope rope) {
+	assert(rope);
+
+	return rope_is_immortal(rope);
 }
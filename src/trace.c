@@ -0,0 +1,121 @@
+#include "trace.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * A trace is the magic followed by records, each of which is one byte of
+ * op and its arguments as LEB128 varints.
+ */
+
+#define TRACE_MAGIC "ROPETRC1"
+#define TRACE_MAGIC_LEN 8
+
+struct rope_trace_tag {
+	FILE *fp;
+};
+
+static const struct {
+	const char *name;
+	int n_args;
+} trace_ops[ROPE_TRACE_N_OPS] = {
+    {"create", 2}, {"concat", 3}, {"substr", 4}, {"delete", 4},
+    {"index", 2},  {"to_s", 1},   {"free", 1},   {"append", 3},
+};
+
+const char *
+RopeTraceOpName(RopeTraceOp op) {
+	return trace_ops[op].name;
+}
+
+static RopeTrace
+trace_open(const char *path, const char *mode) {
+	RopeTrace trace;
+	FILE *fp = fopen(path, mode);
+
+	if (!fp)
+		return NULL;
+
+	trace = palloc(sizeof(*trace));
+	trace->fp = fp;
+
+	return trace;
+}
+
+RopeTrace
+RopeTraceOpenWrite(const char *path) {
+	RopeTrace trace = trace_open(path, "wb");
+
+	if (trace)
+		fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_LEN, trace->fp);
+
+	return trace;
+}
+
+RopeTrace
+RopeTraceOpenRead(const char *path) {
+	RopeTrace trace = trace_open(path, "rb");
+	char magic[TRACE_MAGIC_LEN];
+
+	if (!trace)
+		return NULL;
+
+	if (fread(magic, 1, TRACE_MAGIC_LEN, trace->fp) != TRACE_MAGIC_LEN ||
+	    memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+		elog("not a rope trace");
+		RopeTraceClose(trace);
+		return NULL;
+	}
+
+	return trace;
+}
+
+void
+RopeTraceClose(RopeTrace trace) {
+	fclose(trace->fp);
+	pfree(trace);
+}
+
+void
+RopeTraceWrite(RopeTrace trace, const RopeTraceRecord *rec) {
+	putc(rec->op, trace->fp);
+
+	for (int i = 0; i < trace_ops[rec->op].n_args; i++) {
+		uint64_t v = rec->args[i];
+
+		for (; v >= 0x80; v >>= 7)
+			putc((v & 0x7f) | 0x80, trace->fp);
+		putc(v, trace->fp);
+	}
+}
+
+bool
+RopeTraceRead(RopeTrace trace, RopeTraceRecord *rec) {
+	int c = getc(trace->fp);
+
+	if (c == EOF)
+		return false;
+	if (c >= ROPE_TRACE_N_OPS) {
+		elog("broken trace");
+		return false;
+	}
+
+	memset(rec, 0, sizeof(*rec));
+	rec->op = c;
+
+	for (int i = 0; i < trace_ops[rec->op].n_args; i++) {
+		int shift = 0;
+
+		do {
+			if ((c = getc(trace->fp)) == EOF || shift > 63) {
+				elog("broken trace");
+				return false;
+			}
+			rec->args[i] |= (uint64_t)(c & 0x7f) << shift;
+			shift += 7;
+		} while (c & 0x80);
+	}
+
+	return true;
+}
@@ -1,7 +1,8 @@
 #pragma once
 
-#include <stddef.h>
 #include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
 
 #define elog(str) printf("elog(%s): %s\n", __func__, (str))
 